@@ -0,0 +1,105 @@
+#define _GNU_SOURCE /* sched_setaffinity */
+#include "common.h"
+
+#include <errno.h>
+#include <sched.h>
+
+/*****************************************************************************
+--------------------------------- BUSY POLL ----------------------------------
+******************************************************************************
+
+  Optional low latency receive mode. Sleeping in epoll or poll costs a
+  wakeup for every packet, which is most of the time a small transfer takes.
+  In busy poll mode the wait first spins on a check that does not block,
+  for a budget of microseconds, and only sleeps if nothing came in that
+  time. The time spun is taken off the sleep, so timers are not late.
+
+  SO_BUSY_POLL makes the kernel also poll the device queue of the socket
+  while a read spins, if the driver supports it. Raising it above
+  net.core.busy_read needs CAP_NET_ADMIN, without that only user space
+  spins. Spinning keeps a core busy, so the process can be pinned to one
+  that is set aside for it.
+
+******************************************************************************/
+
+/**
+ * Current time in microseconds, from a clock that does not jump
+ */
+static long long busypoll_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+
+/**
+ * Ask the kernel to busy poll the device queue of a socket
+ * @param fd: socket to poll
+ * @param budget_us: how long a read may spin in the kernel
+ * Returns -1 if it is not permitted, then only user space spins
+ */
+int busypoll_enable(int fd, int budget_us) {
+    if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &budget_us, sizeof(budget_us)) == -1) {
+        perror("setsockopt: SO_BUSY_POLL");
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/**
+ * Run the process on one cpu only
+ * @param cpu: number of cpu, see /proc/cpuinfo
+ * Returns -1 if the cpu does not exist or may not be used
+ */
+int busypoll_pin(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/**
+ * Spin on a readiness check before the caller goes to sleep
+ * Never spins longer than the caller would have slept
+ * @param budget_us: longest time to spin, 0 to not spin at all
+ * @param timeout_ms: time the caller would sleep, -1 for no limit, the time spun is taken off
+ * @param ready: check that does not block
+ * @param arg: passed on to ready
+ * Returns what ready returned last, 0 if nothing came in time
+ */
+int busypoll_spin(int budget_us, int *timeout_ms, busypoll_ready ready, void *arg) {
+    if(budget_us <= 0 || *timeout_ms == 0) {
+        return 0;
+    }
+
+    long long start = busypoll_now_us();
+    long long end = start + budget_us;
+    if(*timeout_ms > 0 && start + (long long) *timeout_ms * 1000 < end) {
+        end = start + (long long) *timeout_ms * 1000;
+    }
+
+    int rc;
+    long long now;
+    do {
+        rc = ready(arg);
+        now = busypoll_now_us();
+    } while(rc == 0 && now < end);
+
+    if(rc == 0 && *timeout_ms > 0) {
+        int spun_ms = (int) ((now - start) / 1000);
+        *timeout_ms = spun_ms < *timeout_ms ? *timeout_ms - spun_ms : 0;
+    }
+    return rc;
+}
+
+/****************************************************************************/
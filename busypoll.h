@@ -0,0 +1,20 @@
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+// Longest spin budget that may be asked for, in microseconds
+#define BUSYPOLL_MAX_US 100000
+
+
+// Checks without blocking if there is something to handle, returns > 0 if there
+// is, 0 if not and -1 on error
+typedef int (*busypoll_ready)(void *arg);
+
+
+int busypoll_enable(int fd, int budget_us);
+
+int busypoll_pin(int cpu);
+
+int busypoll_spin(int budget_us, int *timeout_ms, busypoll_ready ready, void *arg);
+
+
+#endif
@@ -0,0 +1,275 @@
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*****************************************************************************
+------------------------------- CHUNK CACHE ----------------------------------
+******************************************************************************
+
+  Used by the server in compressed transfer mode. A chunk is compressed the
+  first time any connection sends it and kept, so the other clients, those
+  let in from the queue later, and retries, are served the same bytes
+  without compressing it again. Chunks that do not shrink are kept as they
+  are and sent raw. Every chunk has its own slot, so each one is compressed
+  once for the file however far apart the clients are.
+
+  The slots live in a sidecar file, <filename>.chunks, made for the same
+  file as the manifest and mapped shared. It is created sparse and nothing
+  is compressed at startup, so only chunks that have been sent take disk
+  space, and the page cache rather than the server decides how much of it
+  is in memory. It is kept between runs like the manifest, and a server
+  started again on the same file finds its chunks already compressed. Each
+  slot holds the CRC32C of what is stored in it, checked the first time the
+  slot is used in a run, so a slot left half written is compressed again.
+  If the sidecar can not be written, or the file no longer matches the
+  manifest, the slots are mapped from anonymous memory for this run.
+
+******************************************************************************/
+
+
+
+/**
+ * Size of the slot of one chunk, a multiple of 4 so every slot is aligned
+ */
+static size_t chunk_slot_size(int chunk_size) {
+    return (sizeof(struct chunk) + chunk_size + 3) & ~(size_t) 3;
+}
+
+
+
+/**
+ * Size of a cache file with a given number of chunks
+ */
+static size_t chunk_cache_size(int64_t count, size_t slot_size) {
+    return sizeof(struct chunk_cache_header) + (size_t) count * slot_size;
+}
+
+
+
+/**
+ * Fill in the header of a cache made for a manifest
+ */
+static void chunk_cache_identity(struct chunk_cache_header *h, const struct manifest *m, size_t slot_size) {
+    memset(h, 0, sizeof(struct chunk_cache_header));
+    h -> magic = CHUNK_CACHE_MAGIC;
+    h -> version = CHUNK_CACHE_VERSION;
+    h -> slot_size = slot_size;
+    memcpy(&h -> file, m -> header, sizeof(struct manifest_header));
+}
+
+
+
+/**
+ * Map the sidecar file if it was made for the same manifest
+ * @param path: path of sidecar file
+ * @param m: manifest of the file being served
+ * @param cache: set to the mapping
+ * Returns 0 if the sidecar was mapped, -1 if it is missing or does not match
+ */
+static int chunk_cache_map(const char *path, const struct manifest *m, struct chunk_cache *cache) {
+    int fd = open(path, O_RDWR);
+    if(fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t) st.st_size != cache -> len) {
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, cache -> len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        return -1;
+    }
+
+    struct chunk_cache_header want;
+    chunk_cache_identity(&want, m, cache -> slot_size);
+    if(memcmp(base, &want, sizeof(want)) != 0) {
+        munmap(base, cache -> len);
+        return -1;
+    }
+
+    cache -> header = base;
+    cache -> shared = 1;
+    return 0;
+}
+
+
+
+/**
+ * Make an empty sidecar file and map it
+ * It is made under a temporary name and renamed once it has its header, so
+ * a server starting at the same time never maps a cache without one
+ * @param path: path of sidecar file
+ * @param m: manifest of the file being served
+ * @param cache: set to the mapping
+ * Returns 0 on success, -1 if it could not be made
+ */
+static int chunk_cache_create(const char *path, const struct manifest *m, struct chunk_cache *cache) {
+    char tmp[strlen(path) + 16];
+    sprintf(tmp, "%s.%d", path, getpid());
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        return -1;
+    }
+
+    /* Sparse, slots only take disk space once a chunk is stored in them */
+    if(ftruncate(fd, cache -> len) == -1) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    void *base = mmap(NULL, cache -> len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        unlink(tmp);
+        return -1;
+    }
+
+    chunk_cache_identity(base, m, cache -> slot_size);
+    if(rename(tmp, path) == -1) {
+        munmap(base, cache -> len);
+        unlink(tmp);
+        return -1;
+    }
+
+    cache -> header = base;
+    cache -> shared = 1;
+    return 0;
+}
+
+
+
+/**
+ * Open the cache of compressed chunks of a file, from its sidecar if that
+ * was made for the same manifest
+ * @param filename: name of file to serve
+ * @param m: manifest of the file, giving its chunk count and chunk size
+ * Returns pointer to cache
+ */
+struct chunk_cache *new_chunk_cache(const char *filename, const struct manifest *m) {
+    struct chunk_cache *cache = malloc(sizeof(struct chunk_cache));
+    if (cache == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in new_chunk_cache()\n");
+        exit(EXIT_FAILURE);
+    }
+
+    cache -> count = m -> header -> chunk_count;
+    cache -> slot_size = chunk_slot_size(m -> header -> chunk_size);
+    cache -> len = chunk_cache_size(cache -> count, cache -> slot_size);
+    cache -> checked = calloc((size_t) (cache -> count + 7) / 8 + 1, 1);
+    cache -> scratch = malloc(m -> header -> chunk_size);
+    if (cache -> checked == NULL || cache -> scratch == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in new_chunk_cache()\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char path[strlen(filename) + sizeof(CHUNK_CACHE_SUFFIX)];
+    sprintf(path, "%s%s", filename, CHUNK_CACHE_SUFFIX);
+
+    /* A file that changed since its manifest was made gets a cache for this run only */
+    int current = manifest_is_current(m, filename);
+    if(!current || chunk_cache_map(path, m, cache) == -1) {
+        if(current && chunk_cache_create(path, m, cache) == 0) {
+            printf("Made chunk cache %s\n", path);
+        }
+        else {
+            if(current) {
+                fprintf(stderr, "Could not write chunk cache %s: %s\n", path, strerror(errno));
+            }
+            void *base = mmap(NULL, cache -> len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if(base == MAP_FAILED) {
+                perror("mmap");
+                exit(EXIT_FAILURE);
+            }
+            chunk_cache_identity(base, m, cache -> slot_size);
+            cache -> header = base;
+            cache -> shared = 0;
+        }
+    }
+
+    cache -> slots = (char *) (cache -> header + 1);
+    return cache;
+}
+
+
+
+/**
+ * Look up a chunk in the cache
+ * A slot is checked against its CRC32C the first time it is used in a run,
+ * since it may have been left half written by a server that was stopped
+ * @param index: index of chunk in file
+ * Returns the cached chunk, or NULL if it has not been cached
+ */
+struct chunk *find_cached_chunk(struct chunk_cache *cache, int64_t index) {
+    struct chunk *c = (struct chunk *) (cache -> slots + (size_t) index * cache -> slot_size);
+
+    /* Another server on the same file may be filling the slot, see cache_chunk */
+    uint32_t state = __atomic_load_n(&c -> state, __ATOMIC_ACQUIRE);
+    if(state == CHUNK_EMPTY) {
+        return NULL;
+    }
+
+    unsigned char bit = 1 << (index % 8);
+    if(!(cache -> checked[index / 8] & bit)) {
+        if((state != CHUNK_RAW && state != CHUNK_COMPRESSED)
+           || c -> len > cache -> slot_size - sizeof(struct chunk)
+           || crc32c(0, c -> data, c -> len) != c -> crc) {
+            return NULL;
+        }
+        cache -> checked[index / 8] |= bit;
+    }
+    return c;
+}
+
+
+
+/**
+ * Compress a chunk into its slot
+ * The state is stored last, so a server sharing the sidecar sees either an
+ * empty slot or a whole chunk. Two servers storing the same chunk write the
+ * same bytes, so the slot only ever holds the final chunk
+ * @param index: index of chunk in file
+ * @param data: chunk as read from file
+ * @param len: size of chunk, at most the chunk size of the manifest
+ * Returns the cached chunk
+ */
+struct chunk *cache_chunk(struct chunk_cache *cache, int64_t index, const char *data, int len) {
+    struct chunk *c = (struct chunk *) (cache -> slots + (size_t) index * cache -> slot_size);
+
+    /* Keep compressed version only if it is smaller than the chunk */
+    int packed_len = lz_compress(data, len, cache -> scratch, len - 1);
+    memcpy(c -> data, packed_len > 0 ? cache -> scratch : data, packed_len > 0 ? packed_len : len);
+    c -> len = packed_len > 0 ? packed_len : len;
+    c -> crc = crc32c(0, c -> data, c -> len);
+    __atomic_store_n(&c -> state, packed_len > 0 ? CHUNK_COMPRESSED : CHUNK_RAW, __ATOMIC_RELEASE);
+
+    cache -> checked[index / 8] |= 1 << (index % 8);
+    return c;
+}
+
+
+
+/**
+ * Unmap the cache and free it
+ * @param cache: cache to free
+ */
+void free_chunk_cache(struct chunk_cache *cache) {
+    if(cache == NULL) {
+        return;
+    }
+    munmap(cache -> header, cache -> len);
+    free(cache -> checked);
+    free(cache -> scratch);
+    free(cache);
+}
+
+/****************************************************************************/
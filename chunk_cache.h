@@ -0,0 +1,67 @@
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "manifest.h"
+
+// Sidecar file next to the served file, <filename>.chunks
+#define CHUNK_CACHE_SUFFIX ".chunks"
+
+// "RDPCHNK1" read as a number in host byte order, like MANIFEST_MAGIC
+#define CHUNK_CACHE_MAGIC 0x314b4e4843504452ULL
+#define CHUNK_CACHE_VERSION 1
+
+// State of a chunk in the cache
+#define CHUNK_EMPTY 0
+#define CHUNK_RAW 1
+#define CHUNK_COMPRESSED 2
+
+
+// Start of the cache file, followed by one slot per chunk of the file.
+// file is a copy of the header of the manifest it was made for
+struct chunk_cache_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slot_size;
+  struct manifest_header file;
+};
+
+
+// Slot of one chunk, stored compressed if that made it smaller. state is
+// set last, and crc is the CRC32C of the len bytes stored in data
+struct chunk{
+  uint32_t state;
+  uint32_t len;
+  uint32_t crc;
+  char data[];
+};
+
+
+// Compressed chunks shared by every connection, chunk i of the file is kept
+// in slot i. Mapped from the sidecar file, or from anonymous memory if the
+// sidecar can not be used. checked has a bit per chunk checked in this run,
+// and chunks are compressed into scratch before they are stored
+struct chunk_cache {
+  struct chunk_cache_header *header;
+  char *slots;
+  int64_t count;
+  size_t slot_size;
+  size_t len;
+  int shared;
+  unsigned char *checked;
+  char *scratch;
+};
+
+
+struct chunk_cache *new_chunk_cache(const char *filename, const struct manifest *m);
+
+struct chunk *find_cached_chunk(struct chunk_cache *cache, int64_t index);
+
+struct chunk *cache_chunk(struct chunk_cache *cache, int64_t index, const char *data, int len);
+
+void free_chunk_cache(struct chunk_cache *cache);
+
+
+#endif
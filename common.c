@@ -8,7 +8,61 @@
 void check_error(int res, char *msg){
   if (res == -1) {
     perror(msg);
-    free_all_rdp_connections();
     exit(EXIT_FAILURE);
   }
 }
+
+
+
+/**
+ * Parse an address prefix followed by '=', as in <ip>[/<bits>]=<value>
+ * The prefix length is only digits, nothing else may come before the '='
+ * @param spec: text to parse, e.g. 10.0.0.0/8=2M
+ * @param addr: set to the address with the bits outside the prefix cleared, network byte order
+ * @param mask: set to the netmask of the prefix, network byte order
+ * @param bits: set to the prefix length, 32 if none is given
+ * @param eq: set to the '=', the value follows it
+ * Returns 0 on success, -1 if the prefix could not be parsed
+ */
+int parse_prefix(const char *spec, uint32_t *addr, uint32_t *mask, int *bits, const char **eq) {
+  char ip[INET_ADDRSTRLEN];
+  struct in_addr in;
+
+  *eq = strchr(spec, '=');
+  if (*eq == NULL) {
+    return -1;
+  }
+
+  /* Address part, with optional prefix length */
+  const char *slash = memchr(spec, '/', *eq - spec);
+  size_t ip_len = (slash != NULL ? slash : *eq) - spec;
+  if (ip_len >= sizeof(ip)) {
+    return -1;
+  }
+  memcpy(ip, spec, ip_len);
+  ip[ip_len] = '\0';
+  if (inet_pton(AF_INET, ip, &in) != 1) {
+    return -1;
+  }
+
+  *bits = 32;
+  if (slash != NULL) {
+    if (slash + 1 == *eq) {
+      return -1;
+    }
+    *bits = 0;
+    for (const char *p = slash + 1; p < *eq; p++) {
+      if (*p < '0' || *p > '9' || *bits > 32) {
+        return -1;
+      }
+      *bits = *bits * 10 + (*p - '0');
+    }
+    if (*bits > 32) {
+      return -1;
+    }
+  }
+
+  *mask = *bits == 0 ? 0 : htonl(0xffffffffU << (32 - *bits));
+  *addr = in.s_addr & *mask;
+  return 0;
+}
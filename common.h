@@ -5,6 +5,17 @@
 #include "send_packet.h"
 #include "rdp_packet.h"
 #include "rdp.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "chunk_cache.h"
+#include "manifest.h"
+#include "live.h"
+#include "zerocopy.h"
+#include "sockbuf.h"
+#include "busypoll.h"
+#include "rdp_client.h"
+#include "scheduler.h"
+#include "timer.h"
 
 // Buffersize used
 #define BUFSIZE 999
@@ -13,5 +24,8 @@
 // Function for checking error
 void check_error(int res, char *msg);
 
+// Parse the <ip>[/<bits>]= start of a scheduler rule or prefix rate limit
+int parse_prefix(const char *spec, uint32_t *addr, uint32_t *mask, int *bits, const char **eq);
+
 
 #endif
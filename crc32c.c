@@ -0,0 +1,135 @@
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/*****************************************************************************
+--------------------------------- CRC32C -------------------------------------
+******************************************************************************
+
+  CRC32C (Castagnoli) used to verify every rdp packet and the whole file.
+  Uses the SSE4.2 crc32 instruction on x86-64 when the cpu supports it, the
+  ARMv8 crc32c instructions when built for a cpu that has them, and a lookup
+  table otherwise. The implementation is chosen once when the program is
+  loaded, before any thread can run, so every endpoint on every thread can
+  checksum without locking.
+
+******************************************************************************/
+
+static uint32_t crc_table[256];
+
+static uint32_t (*crc_update)(uint32_t crc, const unsigned char *p, size_t len);
+
+
+
+/**
+ * Table driven crc, one byte at a time
+ * Used on cpus without crc instructions
+ */
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+    while(len--) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+
+
+#if defined(__x86_64__)
+/**
+ * SSE4.2 crc, eight bytes per instruction
+ * Only called after checking that the cpu supports sse4.2
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = crc;
+    uint64_t word;
+
+    while(len >= 8) {
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t) crc64;
+    while(len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+/**
+ * ARMv8 crc, eight bytes per instruction
+ */
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t word;
+
+    while(len >= 8) {
+        memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+        p += 8;
+        len -= 8;
+    }
+
+    while(len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+
+
+/**
+ * Build lookup table and pick the fastest implementation for this cpu
+ * Runs as a constructor, where the cpu has to be looked at explicitly
+ */
+__attribute__((constructor))
+static void crc32c_init() {
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for(int bit = 0; bit < 8; bit++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+
+    crc_update = crc32c_table;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) {
+        crc_update = crc32c_sse42;
+    }
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc_update = crc32c_armv8;
+#endif
+}
+
+
+
+/**
+ * Calculate CRC32C over data
+ * @param crc: result of earlier call to continue a checksum, 0 to start a new one
+ * @param data: bytes to checksum
+ * @param len: number of bytes
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    return ~crc_update(~crc, (const unsigned char *) data, len);
+}
+
+/****************************************************************************/
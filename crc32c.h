@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Castagnoli polynomial, reflected
+#define CRC32C_POLY 0x82F63B78
+
+// Checksum over data, continuing from crc (0 for a new checksum)
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,115 @@
+#include "common.h"
+
+/*****************************************************************************
+--------------------------------- HISTOGRAM ----------------------------------
+******************************************************************************
+
+  Latency histograms with power of two buckets: bucket i counts samples
+  below 2^(i + 1) microseconds that did not fit the one before it. Adding a
+  sample is one count leading zeros, so it can be done for every packet.
+  Percentiles are given as the upper bound of the bucket they fall in.
+
+******************************************************************************/
+
+/**
+ * Empty a histogram
+ */
+void hist_init(struct histogram *h) {
+    memset(h, 0, sizeof(struct histogram));
+    h -> min = UINT32_MAX;
+}
+
+
+
+/**
+ * Bucket a sample falls in
+ */
+static int hist_bucket(uint32_t us) {
+    int b = us < 2 ? 0 : 31 - __builtin_clz(us);
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+
+
+/**
+ * Count one sample
+ * @param us: sample in microseconds
+ */
+void hist_add(struct histogram *h, uint32_t us) {
+    h -> count++;
+    h -> sum += us;
+    h -> min = us < h -> min ? us : h -> min;
+    h -> max = us > h -> max ? us : h -> max;
+    h -> bucket[hist_bucket(us)]++;
+}
+
+
+
+/**
+ * Add the samples of one histogram to another
+ */
+void hist_merge(struct histogram *into, const struct histogram *h) {
+    into -> count += h -> count;
+    into -> sum += h -> sum;
+    into -> min = h -> min < into -> min ? h -> min : into -> min;
+    into -> max = h -> max > into -> max ? h -> max : into -> max;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        into -> bucket[i] += h -> bucket[i];
+    }
+}
+
+
+
+/**
+ * Value below which a share of the samples are
+ * @param p: share of samples, 0.5 for the median
+ * Returns upper bound of the bucket in microseconds, at most the largest sample
+ */
+uint32_t hist_percentile(const struct histogram *h, double p) {
+    uint64_t rank = (uint64_t) (p * h -> count);
+    uint64_t seen = 0;
+
+    for(int i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h -> bucket[i];
+        if(seen > rank) {
+            uint32_t bound = (uint32_t) 2 << i;
+            return bound < h -> max ? bound : h -> max;
+        }
+    }
+    return h -> max;
+}
+
+
+
+/**
+ * Print a histogram on one line: summary first, then every bucket that has
+ * samples as <bound>:<count>, the last one as >=<bound>:<count>
+ * @param out: stream to print to
+ * @param name: what the samples are
+ */
+void hist_print(FILE *out, const char *name, const struct histogram *h) {
+    if(h -> count == 0) {
+        fprintf(out, "%s: no samples\n", name);
+        return;
+    }
+
+    fprintf(out, "%s: %llu samples, min %u us, mean %llu us, p50 %u us, p99 %u us, max %u us |",
+            name,
+            (unsigned long long) h -> count,
+            h -> min,
+            (unsigned long long) (h -> sum / h -> count),
+            hist_percentile(h, 0.5),
+            hist_percentile(h, 0.99),
+            h -> max);
+    for(int i = 0; i < HIST_BUCKETS - 1; i++) {
+        if(h -> bucket[i] > 0) {
+            fprintf(out, " <%u:%llu", (uint32_t) 2 << i, (unsigned long long) h -> bucket[i]);
+        }
+    }
+    if(h -> bucket[HIST_BUCKETS - 1] > 0) {
+        fprintf(out, " >=%u:%llu", (uint32_t) 1 << (HIST_BUCKETS - 1), (unsigned long long) h -> bucket[HIST_BUCKETS - 1]);
+    }
+    fprintf(out, "\n");
+}
+
+/****************************************************************************/
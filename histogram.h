@@ -0,0 +1,32 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Bucket i holds values below 2^(i + 1) microseconds, the last one the rest
+#define HIST_BUCKETS 24
+
+
+// Latency samples in power of two buckets, in microseconds
+struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint32_t min;
+  uint32_t max;
+  uint64_t bucket[HIST_BUCKETS];
+};
+
+
+void hist_init(struct histogram *h);
+
+void hist_add(struct histogram *h, uint32_t us);
+
+void hist_merge(struct histogram *into, const struct histogram *h);
+
+uint32_t hist_percentile(const struct histogram *h, double p);
+
+void hist_print(FILE *out, const char *name, const struct histogram *h);
+
+
+#endif
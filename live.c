@@ -0,0 +1,196 @@
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*****************************************************************************
+-------------------------------- LIVE SOURCE ---------------------------------
+******************************************************************************
+
+  Used by the server in live mode, where the file is not known up front but
+  read as it comes from stdin, a pipe or a file that is still being written.
+  Chunks are kept in a ring of a fixed number of slots, so memory stays the
+  same however long the stream runs. Chunk i is in slot i % slots, and the
+  slot of the chunk being read is reused, so the oldest chunk in the ring is
+  given up as soon as reading into its slot starts. The caller says which
+  chunk it still needs with keep, and reading stops before that chunk would
+  be overwritten. A chunk is only handed out once it is whole, so chunk i is
+  always at byte i * chunk_size of the stream, except for the last one.
+
+  A pipe ends when its writer closes it. A regular file has no such end, it
+  is read again every LIVE_FOLLOW_POLL ms and ends when it has not grown for
+  LIVE_FOLLOW_END ms.
+
+******************************************************************************/
+
+
+
+/**
+ * Open a live source and make its ring
+ * @param path: file or pipe to read, - for stdin
+ * @param chunks: chunks the ring keeps, at least 1
+ * @param chunk_size: bytes per chunk, same as the payload of a data packet
+ * Returns pointer to live source
+ */
+struct live_source *live_open(const char *path, int chunks, int chunk_size) {
+    struct live_source *src = calloc(1, sizeof(struct live_source));
+    if(src == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in live_open()\n");
+        exit(EXIT_FAILURE);
+    }
+
+    src -> fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_NONBLOCK);
+    if(src -> fd == -1) {
+        perror("Error: could not read file");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Pipes are read without blocking, regular files are polled */
+    struct stat st;
+    check_error(fstat(src -> fd, &st), "fstat");
+    src -> follow = S_ISREG(st.st_mode);
+    if(!src -> follow) {
+        check_error(fcntl(src -> fd, F_SETFL, fcntl(src -> fd, F_GETFL) | O_NONBLOCK), "fcntl");
+    }
+
+    /* One slot more than asked for, it is the one being read into */
+    src -> slots = (chunks < 1 ? 1 : chunks) + 1;
+    src -> chunk_size = chunk_size;
+    src -> data = malloc((size_t) src -> slots * chunk_size);
+    src -> len = malloc(sizeof(int) * src -> slots);
+    src -> crc_before = malloc(sizeof(uint32_t) * src -> slots);
+    if(src -> data == NULL || src -> len == NULL || src -> crc_before == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in live_open()\n");
+        exit(EXIT_FAILURE);
+    }
+    src -> grew_ms = rdp_now();
+    return src;
+}
+
+
+
+/**
+ * Hand out the chunk being read, also when it is the short last one
+ */
+static void live_publish(struct live_source *src) {
+    int slot = src -> head % src -> slots;
+    src -> len[slot] = src -> fill;
+    src -> crc_before[slot] = src -> digest;
+    src -> digest = crc32c(src -> digest, src -> data + (size_t) slot * src -> chunk_size, src -> fill);
+    src -> head++;
+    src -> fill = 0;
+}
+
+
+
+/**
+ * Check if more may be read without overwriting a chunk that is still needed
+ * Reading into the slot of chunk head - slots gives that chunk up
+ * @param keep: oldest chunk that must stay in the ring
+ */
+int live_can_read(struct live_source *src, int64_t keep) {
+    return !src -> eof && (src -> fill > 0 || src -> head - src -> slots < keep);
+}
+
+
+
+/**
+ * Read what the source has without blocking, at most a ring full at a time
+ * @param keep: oldest chunk that must stay in the ring, INT64_MAX if none
+ * Returns number of whole chunks read
+ */
+int live_read(struct live_source *src, int64_t keep) {
+    int64_t first = src -> head;
+
+    while(src -> head - first < src -> slots && live_can_read(src, keep)) {
+        char *slot = src -> data + (size_t) (src -> head % src -> slots) * src -> chunk_size;
+        ssize_t rc = read(src -> fd, slot + src -> fill, src -> chunk_size - src -> fill);
+
+        if(rc > 0) {
+            src -> fill += rc;
+            src -> grew_ms = rdp_now();
+            if(src -> fill == src -> chunk_size) {
+                live_publish(src);
+            }
+            continue;
+        }
+        if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        }
+        if(rc == -1) {
+            perror("read");
+        }
+
+        /* A file that is still growing has no end yet */
+        if(rc == 0 && src -> follow && rdp_now() - src -> grew_ms < LIVE_FOLLOW_END) {
+            break;
+        }
+        if(src -> fill > 0) {
+            live_publish(src);
+        }
+        src -> eof = 1;
+    }
+    return src -> head - first;
+}
+
+
+
+/**
+ * Oldest chunk still in the ring
+ */
+int64_t live_oldest(struct live_source *src) {
+    int64_t oldest = src -> head - src -> slots + (src -> fill > 0 ? 1 : 0);
+    return oldest > 0 ? oldest : 0;
+}
+
+
+
+/**
+ * Get a chunk from the ring
+ * @param index: number of chunk in the stream
+ * @param len: set to size of chunk
+ * Returns pointer to chunk data, or NULL if it has left the ring or not been read yet
+ */
+char *live_chunk(struct live_source *src, int64_t index, int *len) {
+    if(index < live_oldest(src) || index >= src -> head) {
+        return NULL;
+    }
+    int slot = index % src -> slots;
+    *len = src -> len[slot];
+    return src -> data + (size_t) slot * src -> chunk_size;
+}
+
+
+
+/**
+ * CRC32C of the stream before a chunk
+ * @param index: chunk in the ring, or head for all that has been read
+ */
+uint32_t live_crc_before(struct live_source *src, int64_t index) {
+    if(index >= src -> head) {
+        return src -> digest;
+    }
+    return src -> crc_before[index % src -> slots];
+}
+
+
+
+/**
+ * Close the source and free its ring
+ * @param src: source to close
+ */
+void live_close(struct live_source *src) {
+    if(src == NULL) {
+        return;
+    }
+    if(src -> fd != STDIN_FILENO) {
+        close(src -> fd);
+    }
+    free(src -> data);
+    free(src -> len);
+    free(src -> crc_before);
+    free(src);
+}
+
+/****************************************************************************/
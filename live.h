@@ -0,0 +1,47 @@
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <stdint.h>
+
+// A regular file is read again this often to see if it has grown, in ms,
+// and its stream ends when it has not grown for LIVE_FOLLOW_END ms
+#define LIVE_FOLLOW_POLL 50
+#define LIVE_FOLLOW_END 5000
+
+
+// Live data read from stdin, a pipe or a growing file, kept in a ring of the
+// most recent chunks. Chunk head is the one being read, chunks before it are
+// whole except the last one of the stream. crc_before holds the CRC32C of
+// the stream up to each chunk in the ring, digest of everything read so far
+struct live_source {
+  int fd;
+  int follow;
+  int eof;
+  int slots;
+  int chunk_size;
+  int64_t head;
+  int fill;
+  char *data;
+  int *len;
+  uint32_t *crc_before;
+  uint32_t digest;
+  long long grew_ms;
+};
+
+
+struct live_source *live_open(const char *path, int chunks, int chunk_size);
+
+int live_read(struct live_source *src, int64_t keep);
+
+int64_t live_oldest(struct live_source *src);
+
+int live_can_read(struct live_source *src, int64_t keep);
+
+char *live_chunk(struct live_source *src, int64_t index, int *len);
+
+uint32_t live_crc_before(struct live_source *src, int64_t index);
+
+void live_close(struct live_source *src);
+
+
+#endif
@@ -0,0 +1,184 @@
+#include <string.h>
+
+#include "lz.h"
+
+/*****************************************************************************
+----------------------------------- LZ ---------------------------------------
+******************************************************************************
+
+  Small LZ77 codec used for compressed chunks. Every block starts with a
+  control byte:
+
+    000LLLLL                   literal run of L + 1 bytes follows
+    LLLOOOOO OOOOOOOO          match of L + 2 bytes, offset O + 1 back
+    111OOOOO LLLLLLLL OOOOOOOO match of L + 9 bytes, offset O + 1 back
+
+  Matches are found with a single hash table of recent positions, so
+  compression is one pass over the input and decompression is a plain copy.
+
+******************************************************************************/
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_MAX_LIT 32
+#define LZ_MAX_OFF (1 << 13)
+#define LZ_MAX_REF ((1 << 8) + (1 << 3))
+
+
+
+/**
+ * Hash of the three bytes starting at p
+ */
+static unsigned int lz_hash(const unsigned char *p) {
+    unsigned int v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return ((v * 2654435761u) >> (32 - LZ_HASH_BITS)) & (LZ_HASH_SIZE - 1);
+}
+
+
+
+/**
+ * Compress a block
+ * @param in: bytes to compress
+ * @param in_len: number of bytes in input
+ * @param out: buffer for compressed bytes
+ * @param out_max: size of output buffer
+ * Returns size of compressed block, or 0 if it does not fit in out_max.
+ * Passing out_max smaller than in_len gives 0 for blocks that do not shrink
+ */
+int lz_compress(const char *src, int in_len, char *dst, int out_max) {
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    int htab[LZ_HASH_SIZE];
+    int ip = 0;
+    int op = 1;
+    int lit = 0;
+
+    if(in_len <= 0 || out_max < 2) {
+        return 0;
+    }
+
+    for(int i = 0; i < LZ_HASH_SIZE; i++) {
+        htab[i] = -1;
+    }
+
+    /* out[op - lit - 1] is the control byte of the current literal run */
+    while(ip < in_len) {
+        if(ip < in_len - 2) {
+            unsigned int h = lz_hash(in + ip);
+            int ref = htab[h];
+            int off = ip - ref - 1;
+            htab[h] = ip;
+
+            if(ref >= 0 && off < LZ_MAX_OFF && memcmp(in + ref, in + ip, 3) == 0) {
+                int len = 3;
+                int max_len = in_len - ip < LZ_MAX_REF ? in_len - ip : LZ_MAX_REF;
+                while(len < max_len && in[ref + len] == in[ip + len]) {
+                    len++;
+                }
+
+                /* Close current literal run, or take back the unused control byte */
+                if(lit) {
+                    out[op - lit - 1] = lit - 1;
+                } else {
+                    op--;
+                }
+
+                if(op + 3 >= out_max) {
+                    return 0;
+                }
+
+                ip += len;
+                len -= 2;
+                if(len < 7) {
+                    out[op++] = (off >> 8) + (len << 5);
+                } else {
+                    out[op++] = (off >> 8) + (7 << 5);
+                    out[op++] = len - 7;
+                }
+                out[op++] = off & 0xff;
+
+                /* Start a new literal run */
+                op++;
+                lit = 0;
+                continue;
+            }
+        }
+
+        if(op >= out_max) {
+            return 0;
+        }
+        out[op++] = in[ip++];
+        lit++;
+
+        if(lit == LZ_MAX_LIT) {
+            out[op - lit - 1] = lit - 1;
+            lit = 0;
+            op++;
+        }
+    }
+
+    if(lit) {
+        out[op - lit - 1] = lit - 1;
+    } else {
+        op--;
+    }
+    return op;
+}
+
+
+
+/**
+ * Decompress a block made by lz_compress
+ * @param in: compressed bytes
+ * @param in_len: number of compressed bytes
+ * @param out: buffer for decompressed bytes
+ * @param out_max: size of output buffer
+ * Returns size of decompressed block, or -1 if input is corrupt or too large
+ */
+int lz_decompress(const char *src, int in_len, char *dst, int out_max) {
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    int ip = 0;
+    int op = 0;
+
+    while(ip < in_len) {
+        unsigned int ctrl = in[ip++];
+
+        /* Literal run */
+        if(ctrl < LZ_MAX_LIT) {
+            int len = ctrl + 1;
+            if(ip + len > in_len || op + len > out_max) {
+                return -1;
+            }
+            memcpy(out + op, in + ip, len);
+            ip += len;
+            op += len;
+            continue;
+        }
+
+        /* Match, copied byte by byte since it may overlap itself */
+        int len = ctrl >> 5;
+        if(len == 7) {
+            if(ip >= in_len) {
+                return -1;
+            }
+            len += in[ip++];
+        }
+        if(ip >= in_len) {
+            return -1;
+        }
+
+        int ref = op - ((ctrl & 0x1f) << 8) - in[ip++] - 1;
+        len += 2;
+        if(ref < 0 || op + len > out_max) {
+            return -1;
+        }
+        for(int i = 0; i < len; i++) {
+            out[op++] = out[ref++];
+        }
+    }
+
+    return op;
+}
+
+/****************************************************************************/
@@ -0,0 +1,10 @@
+#ifndef LZ_H
+#define LZ_H
+
+// Compress in_len bytes, returns compressed size or 0 if it does not fit in out_max
+int lz_compress(const char *in, int in_len, char *out, int out_max);
+
+// Decompress in_len bytes, returns decompressed size or -1 if input is invalid
+int lz_decompress(const char *in, int in_len, char *out, int out_max);
+
+#endif
@@ -0,0 +1,293 @@
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*****************************************************************************
+------------------------------ CHUNK MANIFEST --------------------------------
+******************************************************************************
+
+  The server needs the number of chunks and the CRC32C of the file before it
+  can accept anyone. Reading a large file through to count them takes
+  seconds, so the result is kept in a sidecar file, <filename>.manifest,
+  together with the CRC32C of every chunk and what identifies the file:
+  device, inode, size and mtime. At startup the sidecar is mapped and used
+  as it is if it was made for the same file and chunk size. Only when the
+  file has changed, or the sidecar is missing or broken, is the file read
+  and the sidecar written again. If it can not be written, the manifest is
+  kept in memory for this run.
+
+******************************************************************************/
+
+// Chunks read at a time when building a manifest
+#define MANIFEST_READ_CHUNKS 64
+
+
+
+/**
+ * Size of a manifest file with a given number of chunks
+ */
+static size_t manifest_size(uint64_t chunk_count) {
+    return sizeof(struct manifest_header) + chunk_count * sizeof(uint32_t);
+}
+
+
+
+/**
+ * Check that a manifest was made for this file and chunk size
+ * @param h: header of manifest
+ * @param len: size of manifest in bytes
+ * @param st: status of the file being served
+ * @param chunk_size: bytes per chunk
+ * Returns 1 if the manifest can be used, 0 if not
+ */
+static int manifest_matches(const struct manifest_header *h, size_t len, const struct stat *st, int chunk_size) {
+    if(len < sizeof(struct manifest_header)) {
+        return 0;
+    }
+    uint64_t chunks = ((uint64_t) st -> st_size + chunk_size - 1) / chunk_size;
+
+    return h -> magic == MANIFEST_MAGIC
+        && h -> version == MANIFEST_VERSION
+        && h -> chunk_size == (uint32_t) chunk_size
+        && h -> dev == (uint64_t) st -> st_dev
+        && h -> inode == (uint64_t) st -> st_ino
+        && h -> file_size == (uint64_t) st -> st_size
+        && h -> mtime_sec == (int64_t) st -> st_mtim.tv_sec
+        && h -> mtime_nsec == (int64_t) st -> st_mtim.tv_nsec
+        && h -> chunk_count == chunks
+        && len == manifest_size(chunks);
+}
+
+
+
+/**
+ * Fill in the identity of the file in a manifest header
+ */
+static void manifest_identity(struct manifest_header *h, const struct stat *st, int chunk_size) {
+    memset(h, 0, sizeof(struct manifest_header));
+    h -> magic = MANIFEST_MAGIC;
+    h -> version = MANIFEST_VERSION;
+    h -> chunk_size = chunk_size;
+    h -> dev = st -> st_dev;
+    h -> inode = st -> st_ino;
+    h -> file_size = st -> st_size;
+    h -> mtime_sec = st -> st_mtim.tv_sec;
+    h -> mtime_nsec = st -> st_mtim.tv_nsec;
+}
+
+
+
+/**
+ * Map the sidecar file if it belongs to the file being served
+ * @param path: path of sidecar file
+ * @param st: status of the file being served
+ * @param chunk_size: bytes per chunk
+ * @param m: set to the mapping
+ * Returns 0 if the sidecar was mapped, -1 if it is missing or does not match
+ */
+static int manifest_map(const char *path, const struct stat *st, int chunk_size, struct manifest *m) {
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return -1;
+    }
+
+    struct stat mst;
+    if(fstat(fd, &mst) == -1 || mst.st_size < (off_t) sizeof(struct manifest_header)) {
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, mst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        return -1;
+    }
+
+    if(!manifest_matches(base, mst.st_size, st, chunk_size)) {
+        munmap(base, mst.st_size);
+        return -1;
+    }
+
+    m -> base = base;
+    m -> len = mst.st_size;
+    m -> mapped = 1;
+    return 0;
+}
+
+
+
+/**
+ * Read the whole file and make a manifest of it in memory
+ * @param filename: name of file to index
+ * @param chunk_size: bytes per chunk
+ * @param st: set to the status of the file the manifest was made from
+ * @param m: set to the manifest
+ * Returns 0 on success, 1 if the file changed while it was read
+ */
+static int manifest_build(const char *filename, int chunk_size, struct stat *st, struct manifest *m) {
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) {
+        perror("Error: could not read file");
+        exit(EXIT_FAILURE);
+    }
+    check_error(fstat(fd, st), "fstat");
+
+    uint64_t chunks = ((uint64_t) st -> st_size + chunk_size - 1) / chunk_size;
+    struct manifest_header *h = malloc(manifest_size(chunks));
+    char *buffer = malloc((size_t) chunk_size * MANIFEST_READ_CHUNKS);
+    if(h == NULL || buffer == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in manifest_build()\n");
+        exit(EXIT_FAILURE);
+    }
+    manifest_identity(h, st, chunk_size);
+    uint32_t *crc = (uint32_t *) (h + 1);
+
+    /* Read many chunks per call, the last chunk may be short */
+    uint64_t n = 0;
+    ssize_t a;
+    do {
+        size_t filled = 0;
+        while(filled < (size_t) chunk_size * MANIFEST_READ_CHUNKS
+              && (a = read(fd, buffer + filled, (size_t) chunk_size * MANIFEST_READ_CHUNKS - filled)) > 0) {
+            filled += a;
+        }
+        check_error(a == -1 ? -1 : 0, "read");
+
+        for(size_t off = 0; off < filled && n < chunks; off += chunk_size) {
+            size_t len = filled - off < (size_t) chunk_size ? filled - off : (size_t) chunk_size;
+            crc[n++] = crc32c(0, buffer + off, len);
+            h -> digest = crc32c(h -> digest, buffer + off, len);
+        }
+        a = filled;
+    } while(a == (ssize_t) chunk_size * MANIFEST_READ_CHUNKS && n < chunks);
+    h -> chunk_count = n;
+
+    /* A file written to while it was read gets a manifest for this run only */
+    struct stat after;
+    check_error(fstat(fd, &after), "fstat");
+    close(fd);
+    free(buffer);
+
+    m -> base = h;
+    m -> len = manifest_size(n);
+    m -> mapped = 0;
+    return n != chunks || !manifest_matches(h, m -> len, &after, chunk_size);
+}
+
+
+
+/**
+ * Write a manifest to the sidecar file
+ * It is written to a temporary file first and renamed, so a server starting
+ * at the same time never maps a half written manifest
+ * @param path: path of sidecar file
+ * @param m: manifest to write
+ * Returns 0 on success, -1 if it could not be written
+ */
+static int manifest_save(const char *path, const struct manifest *m) {
+    char tmp[strlen(path) + 16];
+    sprintf(tmp, "%s.%d", path, getpid());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while(done < m -> len) {
+        ssize_t wc = write(fd, (char *) m -> base + done, m -> len - done);
+        if(wc == -1) {
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        done += wc;
+    }
+
+    if(close(fd) == -1 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/**
+ * Get the chunk index of a file, from its sidecar if that is up to date
+ * @param filename: name of file to serve
+ * @param chunk_size: bytes per chunk, same as the payload of a data packet
+ * Returns pointer to manifest
+ */
+struct manifest *manifest_open(const char *filename, int chunk_size) {
+    struct manifest *m = malloc(sizeof(struct manifest));
+    if(m == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in manifest_open()\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char path[strlen(filename) + sizeof(MANIFEST_SUFFIX)];
+    sprintf(path, "%s%s", filename, MANIFEST_SUFFIX);
+
+    struct stat st;
+    if(stat(filename, &st) == -1) {
+        perror("Error: could not read file");
+        exit(EXIT_FAILURE);
+    }
+
+    if(manifest_map(path, &st, chunk_size, m) == -1) {
+        if(manifest_build(filename, chunk_size, &st, m) == 0) {
+            if(manifest_save(path, m) == 0) {
+                printf("Wrote chunk manifest %s\n", path);
+            }
+            else {
+                fprintf(stderr, "Could not write chunk manifest %s: %s\n", path, strerror(errno));
+            }
+        }
+    }
+
+    m -> header = m -> base;
+    m -> chunk_crc = (const uint32_t *) (m -> header + 1);
+    return m;
+}
+
+
+
+/**
+ * Check that a manifest still describes the file as it is now, and not a
+ * file that changed while the manifest was made or since
+ * @param m: manifest of the file
+ * @param filename: name of file being served
+ * Returns 1 if it does, 0 if not
+ */
+int manifest_is_current(const struct manifest *m, const char *filename) {
+    struct stat st;
+    if(stat(filename, &st) == -1) {
+        return 0;
+    }
+    return manifest_matches(m -> header, m -> len, &st, m -> header -> chunk_size);
+}
+
+
+
+/**
+ * Unmap or free a manifest
+ * @param m: manifest to close
+ */
+void manifest_close(struct manifest *m) {
+    if(m == NULL) {
+        return;
+    }
+    if(m -> mapped) {
+        munmap(m -> base, m -> len);
+    }
+    else {
+        free(m -> base);
+    }
+    free(m);
+}
+
+/****************************************************************************/
@@ -0,0 +1,51 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Sidecar file next to the served file, <filename>.manifest
+#define MANIFEST_SUFFIX ".manifest"
+
+// "RDPMANI1" read as a number in host byte order, so a manifest written on a
+// machine of the other byte order does not match and is built again
+#define MANIFEST_MAGIC 0x31494e414d504452ULL
+#define MANIFEST_VERSION 1
+
+
+// Start of the manifest file, followed by chunk_count CRC32Cs of the chunks.
+// The identity of the file is its device, inode, size and mtime
+struct manifest_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t chunk_size;
+  uint64_t dev;
+  uint64_t inode;
+  uint64_t file_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t chunk_count;
+  uint32_t digest;
+  uint32_t reserved;
+};
+
+
+// Chunk index of the file being served, mapped from the sidecar file, or
+// built in memory if the sidecar can not be written
+struct manifest {
+  const struct manifest_header *header;
+  const uint32_t *chunk_crc;
+  void *base;
+  size_t len;
+  int mapped;
+};
+
+
+struct manifest *manifest_open(const char *filename, int chunk_size);
+
+int manifest_is_current(const struct manifest *m, const char *filename);
+
+void manifest_close(struct manifest *m);
+
+
+#endif
@@ -0,0 +1,461 @@
+#include "common.h"
+
+#include <fcntl.h>
+
+/******************************************************************************
+-------------------------------- MICROBENCH -----------------------------------
+*******************************************************************************
+
+Microbenchmarks of the per-packet work of RDP: encoding and decoding packets,
+validating headers, the connection table and chunk lookups. Built and run with
+make microbench, optionally with a word to only run benchmarks whose names
+contain it: ./bench open
+
+Every benchmark is run BENCH_WARMUP times first, then BENCH_RUNS times. A run
+is timed in samples of BENCH_SAMPLE operations, so the percentiles show how
+much single operations vary, not only the mean. Allocations are counted by
+wrapping malloc, calloc and realloc at link time (-Wl,--wrap), which only
+sees calls from RDP and this file, not from inside libc.
+
+The library is built with the CFLAGS of the Makefile, so the numbers are for
+the code as it ships. Compare them between two trees built the same way.
+______________________________________________________________________________
+******************************************************************************/
+
+// Runs thrown away before the measured ones
+#define BENCH_WARMUP 2
+
+// Measured runs of every benchmark
+#define BENCH_RUNS 10
+
+// Operations timed together as one sample
+#define BENCH_SAMPLE 32
+
+// Most samples kept for the percentiles of one benchmark
+#define BENCH_MAX_SAMPLES 65536
+
+// Sizes of the connection table
+#define BENCH_SMALL_TABLE 10000
+#define BENCH_LARGE_TABLE 100000
+
+
+// Operation to time, i counts the operations of a run from 0
+typedef void (*bench_op)(void *arg, long i);
+
+
+// Allocations made through the wrapped functions
+static uint64_t allocations = 0;
+
+// Results go here so the compiler can not drop the work
+static volatile uint64_t sink;
+
+// Results are printed here, a copy of stdout that stays when stdout is
+// sent to /dev/null while something that prints is timed
+static FILE *report;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    allocations++;
+    return __real_realloc(p, size);
+}
+
+
+
+
+/*                             HARNESS                                      */
+/****************************************************************************/
+
+/**
+ * Current time in ns from a clock that only moves forward
+ */
+static long long bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+/**
+ * Compare function for qsort of samples
+ */
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+
+/**
+ * Time one benchmark and print a line for it
+ * @param name: name of benchmark, also matched against the filter
+ * @param filter: only run if the name contains it, NULL to run all
+ * @param op: operation to time
+ * @param arg: passed on to op
+ * @param ops: operations per run, rounded up to whole samples
+ */
+static void bench(const char *name, const char *filter, bench_op op, void *arg, long ops) {
+    static double samples[BENCH_MAX_SAMPLES];
+    long per_run = (ops + BENCH_SAMPLE - 1) / BENCH_SAMPLE;
+    int count = 0;
+    long long total_ns = 0;
+    uint64_t total_allocs = 0;
+
+    if(filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+
+    for(int run = 0; run < BENCH_WARMUP + BENCH_RUNS; run++) {
+        int measured = run >= BENCH_WARMUP;
+        uint64_t allocs = allocations;
+
+        for(long s = 0; s < per_run; s++) {
+            long long start = bench_now_ns();
+            for(long i = s * BENCH_SAMPLE; i < (s + 1) * BENCH_SAMPLE; i++) {
+                op(arg, i);
+            }
+            long long ns = bench_now_ns() - start;
+
+            if(measured) {
+                total_ns += ns;
+                if(count < BENCH_MAX_SAMPLES) {
+                    samples[count++] = (double) ns / BENCH_SAMPLE;
+                }
+            }
+        }
+        if(measured) {
+            total_allocs += allocations - allocs;
+        }
+    }
+
+    double n = (double) per_run * BENCH_SAMPLE * BENCH_RUNS;
+    qsort(samples, count, sizeof(double), compare_double);
+    fprintf(report, "%-36s %10.1f %10.1f %10.1f %10.1f %8.2f\n",
+           name,
+           total_ns / n,
+           samples[count / 2],
+           samples[(int) (count * 0.99)],
+           samples[count - 1],
+           total_allocs / n);
+}
+
+
+
+
+/*                          PACKET CODEC                                    */
+/****************************************************************************/
+
+// Packets used by the codec benchmarks, in memory and on the wire
+struct codec_state {
+  struct rdp_packet *data;
+  struct rdp_packet *ack;
+  char *data_wire;
+  char *ack_wire;
+  unsigned int data_size;
+  unsigned int ack_size;
+  char payload[BUFSIZE];
+  struct rdp_batch batch;
+};
+
+static void op_make_data(void *arg, long i) {
+    struct codec_state *st = arg;
+    struct rdp_packet *pkt = make_rdp_packet(0x04, rdp_chunk_seq(i), 0, 0, 0, 0, BUFSIZE, st -> payload);
+    sink += pkt -> pktseq;
+    free(pkt);
+}
+
+static void op_get_data(void *arg, long i) {
+    struct codec_state *st = arg;
+    unsigned int size;
+    st -> data -> pktseq = rdp_chunk_seq(i);
+    char *d = get_packet(st -> data, &size);
+    sink += size;
+    free(d);
+}
+
+static void op_get_ack(void *arg, long i) {
+    struct codec_state *st = arg;
+    unsigned int size;
+    st -> ack -> ackseq = rdp_chunk_seq(i);
+    char *d = get_packet(st -> ack, &size);
+    sink += size;
+    free(d);
+}
+
+static void op_open_data(void *arg, long i) {
+    struct codec_state *st = arg;
+    (void) i;
+    struct rdp_packet *pkt = open_rdp_packet(st -> data_wire, st -> data_size);
+    sink += pkt -> metadata;
+    free(pkt);
+}
+
+static void op_open_ack(void *arg, long i) {
+    struct codec_state *st = arg;
+    (void) i;
+    struct rdp_packet *pkt = open_rdp_packet(st -> ack_wire, st -> ack_size);
+    sink += pkt -> ackseq;
+    free(pkt);
+}
+
+static void op_verify_data(void *arg, long i) {
+    struct codec_state *st = arg;
+    (void) i;
+    sink += verify_rdp_packet(st -> data_wire, st -> data_size);
+}
+
+static void op_header_valid(void *arg, long i) {
+    struct codec_state *st = arg;
+    sink += rdp_header_valid(i & 1 ? st -> ack_wire : st -> data_wire, i & 1 ? st -> ack_size : st -> data_size);
+}
+
+static void op_validate_batch(void *arg, long i) {
+    struct codec_state *st = arg;
+    (void) i;
+    rdp_validate_batch(&st -> batch);
+    sink += st -> batch.valid[0];
+}
+
+
+
+/**
+ * Benchmarks of making, encoding, decoding and validating packets
+ */
+static void bench_codec(const char *filter) {
+    struct codec_state *st = calloc(1, sizeof(struct codec_state));
+    if(st == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in bench_codec()\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < BUFSIZE; i++) {
+        st -> payload[i] = rand();
+    }
+
+    st -> data = make_rdp_packet(0x04, 1, 0, RDP_OPT_TSTAMP, 0, 0, BUFSIZE, st -> payload);
+    st -> data -> tsval = rdp_tstamp_now();
+    st -> ack = make_rdp_packet(0x08, 0, 1, 0, 0, 0, 0, NULL);
+    st -> data_wire = get_packet(st -> data, &st -> data_size);
+    st -> ack_wire = get_packet(st -> ack, &st -> ack_size);
+
+    /* A full batch of data packets and acks, as a busy server reads it */
+    st -> batch.count = RDP_RECV_BATCH;
+    for(int i = 0; i < RDP_RECV_BATCH; i++) {
+        char *wire = i & 1 ? st -> ack_wire : st -> data_wire;
+        st -> batch.len[i] = i & 1 ? st -> ack_size : st -> data_size;
+        memcpy(st -> batch.buf[i], wire, st -> batch.len[i]);
+    }
+
+    bench("codec/make_rdp_packet data", filter, op_make_data, st, 200000);
+    bench("codec/get_packet data", filter, op_get_data, st, 200000);
+    bench("codec/get_packet ack", filter, op_get_ack, st, 200000);
+    bench("codec/open_rdp_packet data", filter, op_open_data, st, 200000);
+    bench("codec/open_rdp_packet ack", filter, op_open_ack, st, 200000);
+    bench("validate/verify_rdp_packet data", filter, op_verify_data, st, 200000);
+    bench("validate/rdp_header_valid", filter, op_header_valid, st, 1000000);
+    bench("validate/rdp_validate_batch 32", filter, op_validate_batch, st, 200000);
+
+    free(st -> data);
+    free(st -> ack);
+    free(st -> data_wire);
+    free(st -> ack_wire);
+    free(st);
+}
+
+
+
+
+/*                         CONNECTION TABLE                                 */
+/****************************************************************************/
+
+// Endpoint with a full connection table, every client on a port of its own.
+// next_id is the last server id given out
+struct table_state {
+  struct rdp_ctx *ctx;
+  int entries;
+  uint64_t next_id;
+  int devnull;
+  int saved_stdout;
+};
+
+/**
+ * Address and client id of connection i of the table
+ */
+static struct sockaddr_in table_addr(int i) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x0a000000 + i / 50000);
+    addr.sin_port = htons(1024 + i % 50000);
+    return addr;
+}
+
+static void table_add(struct table_state *st, int i) {
+    struct connection *cnt = get_connection(st -> ctx, i + 1, ++st -> next_id, table_addr(i), 0);
+    add_rdp_connection(st -> ctx, cnt);
+}
+
+static long table_pick(struct table_state *st, long i) {
+    return (i * 2654435761u) % st -> entries;
+}
+
+static void op_find_connection(void *arg, long i) {
+    struct table_state *st = arg;
+    int k = table_pick(st, i);
+    sink += (uintptr_t) find_rdp_connection(st -> ctx, table_addr(k), k + 1);
+}
+
+static void op_find_by_address(void *arg, long i) {
+    struct table_state *st = arg;
+    sink += (uintptr_t) find_connection_by_address(st -> ctx, table_addr(table_pick(st, i)));
+}
+
+static void op_find_miss(void *arg, long i) {
+    struct table_state *st = arg;
+    sink += (uintptr_t) find_connection_by_address(st -> ctx, table_addr(st -> entries + i % 1000));
+}
+
+/**
+ * Remove a connection and add another one from the same address, so the
+ * table stays full. remove_rdp_connection prints a line, stdout is /dev/null
+ */
+static void op_remove_add(void *arg, long i) {
+    struct table_state *st = arg;
+    int k = table_pick(st, i);
+    struct connection *cnt = find_rdp_connection(st -> ctx, table_addr(k), k + 1);
+    if(cnt != NULL) {
+        remove_rdp_connection(st -> ctx, cnt -> server_id);
+        table_add(st, k);
+    }
+}
+
+
+
+/**
+ * Benchmarks of the connection table of an endpoint with many connections
+ * @param entries: connections in the table
+ * @param ops: lookups per run, fewer for larger tables
+ */
+static void bench_table(const char *filter, int entries, long ops) {
+    struct table_state st;
+    char name[64];
+
+    st.entries = entries;
+    st.next_id = 0;
+    st.ctx = rdp_ctx_new((entries + RDP_MAX_STREAMS - 1) / RDP_MAX_STREAMS);
+    init_admission(st.ctx, entries, 0, 1000000);
+    for(int i = 0; i < entries; i++) {
+        table_add(&st, i);
+    }
+
+    sprintf(name, "table/find_rdp_connection %dk", entries / 1000);
+    bench(name, filter, op_find_connection, &st, ops);
+    sprintf(name, "table/find_connection_by_address %dk", entries / 1000);
+    bench(name, filter, op_find_by_address, &st, ops);
+    sprintf(name, "table/lookup miss %dk", entries / 1000);
+    bench(name, filter, op_find_miss, &st, ops);
+
+    sprintf(name, "table/remove+add %dk", entries / 1000);
+    fflush(stdout);
+    st.saved_stdout = dup(STDOUT_FILENO);
+    st.devnull = open("/dev/null", O_WRONLY);
+    dup2(st.devnull, STDOUT_FILENO);
+    bench(name, filter, op_remove_add, &st, ops);
+    fflush(stdout);
+    dup2(st.saved_stdout, STDOUT_FILENO);
+    close(st.saved_stdout);
+    close(st.devnull);
+
+    /* Freed quietly, rdp_ctx_free does not print */
+    rdp_ctx_free(st.ctx);
+}
+
+
+
+
+/*                            CHUNK LOOKUP                                  */
+/****************************************************************************/
+
+// Connection with a striped range and a live ring to look chunks up in
+struct chunk_state {
+  struct connection cnt;
+  struct live_source *live;
+};
+
+static void op_file_chunk(void *arg, long i) {
+    struct chunk_state *st = arg;
+    sink += rdp_file_chunk(&st -> cnt, i) + rdp_chunk_seq(i);
+}
+
+static void op_live_chunk(void *arg, long i) {
+    struct chunk_state *st = arg;
+    int len;
+    char *data = live_chunk(st -> live, live_oldest(st -> live) + i % 1000, &len);
+    sink += (uintptr_t) data + len;
+}
+
+
+
+/**
+ * Benchmarks of finding the chunk to send, in a file and in a live ring
+ */
+static void bench_chunks(const char *filter) {
+    struct chunk_state st;
+
+    memset(&st.cnt, 0, sizeof(st.cnt));
+    st.cnt.start_chunk = 3;
+    st.cnt.stride = 4;
+
+    /* A ring read far into the stream, without reading anything */
+    st.live = live_open("/dev/null", 1024, BUFSIZE);
+    st.live -> head = 1000000;
+
+    bench("chunk/rdp_file_chunk", filter, op_file_chunk, &st, 1000000);
+    bench("chunk/live_chunk", filter, op_live_chunk, &st, 1000000);
+
+    live_close(st.live);
+}
+
+/****************************************************************************/
+
+
+
+
+/**
+ * Main function for the microbenchmarks
+ * 1. Packet codec and header validation
+ * 2. Connection table with BENCH_SMALL_TABLE and BENCH_LARGE_TABLE entries
+ * 3. Chunk lookups
+ */
+int main(int argc, char const *argv[]) {
+    const char *filter = argc > 1 ? argv[1] : NULL;
+
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if(report == NULL) {
+        perror("fdopen");
+        return EXIT_FAILURE;
+    }
+    setvbuf(report, NULL, _IOLBF, 0);
+
+    srand(1);
+    fprintf(report, "%-36s %10s %10s %10s %10s %8s\n", "benchmark", "ns/op", "p50", "p99", "max", "allocs");
+    bench_codec(filter);
+    bench_table(filter, BENCH_SMALL_TABLE, 2000);
+    bench_table(filter, BENCH_LARGE_TABLE, 200);
+    bench_chunks(filter);
+    fclose(report);
+    return EXIT_SUCCESS;
+}
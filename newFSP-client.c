@@ -1,4 +1,6 @@
 #include "common.h"
+#include <sys/stat.h>
+#include <poll.h>
 
 
 /*******************************************************************************
@@ -16,60 +18,523 @@ client will close the connection.
 
 
 
+// Max number of servers to download from, the one given first included
+#define MAX_SOURCES 8
+
+// Most streams one file can have, -k streams to each server
+#define MAX_FILE_STREAMS (MAX_SOURCES * RDP_MAX_STREAMS)
+
+// A stream is only split when it has at least this many chunks left
+#define SPLIT_MIN_CHUNKS 64
+
+// Largest stride a split may give a stream
+#define SPLIT_MAX_STRIDE 4096
+
+// A server that sends nothing for this long during a transfer is given up on
+// when there are other servers, it would send keepalives if it were alive
+#define STALL_MS (3 * RDP_KEEPALIVE)
+
+#define USAGE "usage: %s <IP server> <port number> <loss propability> [-r <partial file>] [-n <downloads>] [-k <streams>] [-s <IP server>:<port>]... [-b <busy poll us>] [-c <cpu>] [-t]\n"
+
+
+// Time poll is spun on before it sleeps, in microseconds, set with -b
+static int busy_poll_us = 0;
+
+// Print the latency histograms of every file, set with -t
+static int show_latency = 0;
+
+
+
+/**
+ * One server holding the file, given as <IP server> <port> or with -s
+ */
+struct source {
+    struct sockaddr_in addr;
+    int failed;
+};
+
+
+
+/**
+ * Chunks still to be fetched: first, first + stride, first + 2 * stride ...
+ * up to the end of the file
+ */
+struct task {
+    int64_t first;
+    int stride;
+};
+
+
+
 /**
- * Read file packets from server and write payload to file
- * Uses RDP_read() to read packet and then sends ack back to server
- * Account for packet loss through comparing received with last received packet
- * Finish when receiving EOF packet from server
+ * One file being downloaded, over one or more streams
+ * total is an upper bound on the number of chunks, learned when the first
+ * stream reaches EOF. Work of streams that failed waits in pending until a
+ * stream to a server that is still answering is free. latency has the
+ * samples of all its streams that have stopped
  */
-void read_and_write_file(int sockfd, char *filename, struct sockaddr_in addr){
+struct output_file {
+    char *filename;
+    int64_t start_chunk;
     FILE *fp;
-    ssize_t rc, wc = 0;
+    uint32_t crc;
+    int group;
+    int streams;
+    int active;
+    int failed;
+    uint32_t digest;
+    int64_t total;
+    struct task pending[MAX_FILE_STREAMS];
+    int pending_count;
+    struct rdp_latency latency;
+};
+
+
+
+/**
+ * One connection of a download
+ * With K streams, stream s starts with chunk s, s + K, s + 2K ... of the file,
+ * and the streams of a file rebalance the work between them as they finish
+ */
+struct stream {
+    struct output_file *out;
+    struct source *source;
+    int64_t next_chunk;
+    int stride;
+    struct rdp_download *download;
+};
+
+
+
+/**
+ * Open the file a download is written to
+ * When resuming, any partial chunk is dropped, the whole ones are checksummed
+ * and writing continues after them
+ * @param out: file to open, crc is set to the CRC32C of the kept chunks
+ */
+void open_output_file(struct output_file *out) {
     char buffer[SIZE];
-    unsigned char last = -1;
-    unsigned char new;
+    ssize_t rc;
 
-    // Open file
-    fp = fopen(filename, "wb");
-    if (fp == NULL){
+    // Open file, keep already received chunks when resuming
+    out -> fp = fopen(out -> filename, out -> start_chunk > 0 ? "r+b" : "w+b");
+    if (out -> fp == NULL){
         perror("Error: could not read file");
         exit(EXIT_FAILURE);
     }
 
-    // Loop until all packet are received
-    while(1){
+    out -> crc = 0;
+    if(out -> start_chunk > 0) {
+        off_t offset = (off_t) out -> start_chunk * BUFSIZE;
+        if(ftruncate(fileno(out -> fp), offset) == -1) {
+            perror("Error: could not resume file");
+            exit(EXIT_FAILURE);
+        }
+        while((rc = fread(buffer, 1, SIZE, out -> fp)) > 0) {
+            out -> crc = crc32c(out -> crc, buffer, rc);
+        }
+        if(fseeko(out -> fp, offset, SEEK_SET) == -1) {
+            perror("Error: could not resume file");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+
+/**
+ * CRC32C of the whole file, for files written by several streams
+ */
+uint32_t file_crc(FILE *fp) {
+    char buffer[SIZE];
+    uint32_t crc = 0;
+    size_t rc;
+
+    rewind(fp);
+    while((rc = fread(buffer, 1, SIZE, fp)) > 0) {
+        crc = crc32c(crc, buffer, rc);
+    }
+    return crc;
+}
+
+
+
+/**
+ * Write a chunk delivered by a stream to its place in the file
+ * Compressed payloads are decompressed before they are written
+ * With one stream chunks come in file order, so a CRC32C of everything
+ * written is kept and compared with the digest sent with EOF
+ * A resumed file is opened with the first chunk, so it is left as it is if
+ * the server does not accept the connection
+ * Returns 0, or -1 if the chunk could not be decompressed or written
+ */
+int write_chunk(void *arg, char *data, int len, unsigned char options) {
+    struct stream *st = arg;
+    struct output_file *out = st -> out;
+    char unpacked[SIZE];
+
+    if(out -> fp == NULL) {
+        open_output_file(out);
+    }
+
+    // Decompress payload if server sent it compressed
+    if(options & RDP_OPT_COMPRESS) {
+        len = lz_decompress(data, len, unpacked, SIZE);
+        if(len == -1) {
+            fprintf(stderr, "Could not decompress packet\n");
+            out -> failed = 1;
+            return -1;
+        }
+        data = unpacked;
+    }
+
+    off_t offset = (off_t) st -> next_chunk * BUFSIZE;
+    if(pwrite(fileno(out -> fp), data, len, offset) != (ssize_t) len) {
+        fprintf(stderr, "pwrite failed\n");
+        out -> failed = 1;
+        return -1;
+    }
+    st -> next_chunk += st -> stride;
+
+    if(out -> streams == 1) {
+        out -> crc = crc32c(out -> crc, data, len);
+    }
+    return 0;
+}
+
+
+
+/**
+ * Start fetching a task on a free stream
+ * Returns 0, or -1 if the socket could not be made
+ */
+int start_stream(struct stream *st, struct task task) {
+    struct output_file *out = st -> out;
+
+    st -> next_chunk = task.first;
+    st -> stride = task.stride;
+    st -> download = rdp_download_open_range(st -> source -> addr, task.first, task.stride, 0, out -> group, RDP_OPT_COMPRESS | RDP_OPT_TSTAMP);
+    if(st -> download == NULL) {
+        return -1;
+    }
+    if(busy_poll_us > 0) {
+        busypoll_enable(rdp_download_fd(st -> download), busy_poll_us);
+    }
+    out -> active++;
+    return 0;
+}
+
+
+
+/**
+ * Stop a stream, the server is told the connection has ended
+ */
+void stop_stream(struct stream *st) {
+    const struct rdp_latency *lat = rdp_download_latency(st -> download);
+    hist_merge(&st -> out -> latency.rtt, &lat -> rtt);
+    hist_merge(&st -> out -> latency.owd, &lat -> owd);
+    rdp_download_close(st -> download);
+    st -> download = NULL;
+    st -> out -> active--;
+}
+
+
+
+/**
+ * Number of chunks a stream has left, as far as the client knows
+ */
+int64_t chunks_left(struct stream *st) {
+    int64_t total = st -> out -> total;
+    if(total == -1) {
+        return INT64_MAX;
+    }
+    return total <= st -> next_chunk ? 0 : (total - st -> next_chunk + st -> stride - 1) / st -> stride;
+}
+
+
+
+/**
+ * Give work to the free streams of a file
+ * A free stream first takes work left by streams that failed. Otherwise it
+ * takes half of what the stream with most chunks left has not received yet:
+ * that stream is started again with twice the stride, and the free stream
+ * gets the chunks in between. So servers that are done early take work away
+ * from slow ones until the file is complete. If that stream has heard nothing
+ * from its server for a while, the free stream takes all of its work
+ * @param streams: streams of all files
+ * @param n: number of streams
+ * @param out: file to give work for
+ */
+void assign_work(struct stream *streams, int n, struct output_file *out) {
+    for(int i = 0; i < n && !out -> failed; i++) {
+        struct stream *st = &streams[i];
+        if(st -> out != out || st -> download != NULL || st -> source -> failed) {
+            continue;
+        }
+
+        if(out -> pending_count > 0) {
+            if(start_stream(st, out -> pending[out -> pending_count - 1]) == 0) {
+                out -> pending_count--;
+            }
+            continue;
+        }
+
+        // Stream with most chunks left
+        struct stream *slow = NULL;
+        for(int j = 0; j < n; j++) {
+            if(streams[j].out == out && streams[j].download != NULL
+               && (slow == NULL || chunks_left(&streams[j]) > chunks_left(slow))) {
+                slow = &streams[j];
+            }
+        }
+        if(slow == NULL) {
+            continue;
+        }
 
-        // Try to read payload from server into buffer
-        rc = rdp_read(sockfd, buffer, SIZE, addr, &new);
-        check_error(rc, "rdp_read");
+        // A server that has been quiet for a while is likely gone, take all its work
+        if(rdp_download_idle(slow -> download) >= RDP_KEEPALIVE) {
+            struct task all = { slow -> next_chunk, slow -> stride };
+            if(start_stream(st, all) == 0) {
+                printf("MOVED: chunks from %lld, every %d\n", (long long) all.first, all.stride);
+                slow -> source -> failed = 1;
+                stop_stream(slow);
+            }
+            continue;
+        }
+
+        if(chunks_left(slow) < SPLIT_MIN_CHUNKS || slow -> stride * 2 > SPLIT_MAX_STRIDE) {
+            continue;
+        }
+
+        // Start the new connections before ending the old, so the server sees the download go on
+        struct task keep = { slow -> next_chunk, slow -> stride * 2 };
+        struct task take = { slow -> next_chunk + slow -> stride, slow -> stride * 2 };
+        struct rdp_download *old = slow -> download;
+        if(start_stream(st, take) == 0) {
+            printf("REBALANCED: chunks from %lld, every %d\n", (long long) keep.first, keep.stride);
+            if(start_stream(slow, keep) == 0) {
+                rdp_download_close(old);
+                out -> active--;
+            } else {
+                slow -> download = old;
+                slow -> stride = keep.stride / 2;
+                stop_stream(st);
+            }
+        }
+    }
+}
+
+
+
+/**
+ * Finish a file when all its streams have ended
+ * The file is checked against the digest the server sent with EOF. A partial
+ * file is kept to resume from, unless it is empty or was written by several
+ * streams and so may have holes
+ * Returns 1 if the download failed or did not match the digest, otherwise 0
+ */
+int finish_file(struct output_file *out) {
+
+    // Nothing was delivered if the file was complete already
+    if(!out -> failed && out -> fp == NULL) {
+        open_output_file(out);
+    }
+
+    if(!out -> failed) {
+        if(out -> streams > 1) {
+            out -> crc = file_crc(out -> fp);
+        }
+        if(show_latency) {
+            hist_print(stdout, "RTT", &out -> latency.rtt);
+            hist_print(stdout, "ONE-WAY DELAY", &out -> latency.owd);
+        }
+        printf("%s\n", out -> filename);
+        if(out -> crc != out -> digest) {
+            fprintf(stderr, "Checksum of %s does not match file on server\n", out -> filename);
+            out -> failed = 1;
+        }
+    } else if(out -> fp != NULL) {
+        fseeko(out -> fp, 0, SEEK_END);
+        off_t written = ftello(out -> fp);
+        fclose(out -> fp);
+        out -> fp = NULL;
+        if(written == 0 || out -> streams > 1) {
+            remove(out -> filename);
+        }
+    }
+
+    if(out -> fp != NULL) {
+        fclose(out -> fp);
+        out -> fp = NULL;
+    }
+    return out -> failed;
+}
+
+
+
+/**
+ * Handle a stream that has reached EOF or failed
+ * At EOF the stream has received every chunk of its task, which also tells
+ * how many chunks the file has at most. A stream that failed leaves its
+ * task to the other servers, and its server gets no more work
+ * Returns 1 if the file is finished and failed, otherwise 0
+ */
+int end_stream(struct stream *streams, int n, struct stream *st, int status) {
+    struct output_file *out = st -> out;
 
-        // If rc == 0 rdp has received EOF packet and returns
-        if(rc == 0){
-            fclose(fp);
-            return;
+    if(status == RDP_DOWNLOAD_DONE) {
+        out -> digest = rdp_download_digest(st -> download);
+        if(out -> total == -1 || st -> next_chunk < out -> total) {
+            out -> total = st -> next_chunk;
         }
+    } else if(!out -> failed) {
+        st -> source -> failed = 1;
+        out -> pending[out -> pending_count++] = (struct task) { st -> next_chunk, st -> stride };
+    }
+    stop_stream(st);
+
+    assign_work(streams, n, out);
+    if(out -> active == 0 && out -> pending_count > 0 && !out -> failed) {
+        fprintf(stderr, "No server left to download %s from\n", out -> filename);
+        out -> failed = 1;
+    }
+
+    // The file can not be completed, stop the rest of its streams
+    for(int i = 0; i < n && out -> failed; i++) {
+        if(streams[i].out == out && streams[i].download != NULL) {
+            stop_stream(&streams[i]);
+        }
+    }
+
+    if(out -> active == 0) {
+        return finish_file(out);
+    }
+    return 0;
+}
+
+
+
+/**
+ * Sockets poll waits on, see poll_ready
+ */
+struct poll_set {
+    struct pollfd *fds;
+    int count;
+};
+
 
-        // Check that new packet is not the same as last
-        if(new != last){
 
-            wc = fwrite(buffer, 1, rc, fp);
+/**
+ * Check the sockets of the streams without waiting, see busypoll_spin
+ */
+int poll_ready(void *arg) {
+    struct poll_set *set = arg;
+    return poll(set -> fds, set -> count, 0);
+}
 
-            if(wc != rc){
-              fprintf(stderr, "fwrite failed\n");
-              exit(EXIT_FAILURE);
+
+
+/**
+ * Run downloads until all of them are done or have failed
+ * Waits in poll on the sockets of the streams still going, and lets each
+ * stream handle its packets and timers when it is readable or due. With -b
+ * poll is spun on without sleeping for a while first
+ * @param streams: streams of all files
+ * @param n: number of streams
+ * Returns number of files that failed or did not match the digest
+ */
+int run_downloads(struct stream *streams, int n) {
+    struct pollfd fds[n];
+    int index[n];
+    int failed = 0;
+
+    while(1) {
+
+        // Wait for the first socket to be readable or stream to be due
+        int count = 0;
+        int timeout = -1;
+        for(int i = 0; i < n; i++) {
+            if(streams[i].download != NULL) {
+                int t = rdp_download_timeout(streams[i].download);
+                if(streams[i].out -> streams > 1) {
+                    int stall = STALL_MS - rdp_download_idle(streams[i].download);
+                    t = stall < t ? (stall > 0 ? stall : 0) : t;
+                }
+                timeout = (timeout == -1 || t < timeout) ? t : timeout;
+                fds[count].fd = rdp_download_fd(streams[i].download);
+                fds[count].events = POLLIN;
+                index[count++] = i;
+            }
+        }
+        if(count == 0) {
+            return failed;
+        }
+        struct poll_set set = { fds, count };
+        int rc = busypoll_spin(busy_poll_us, &timeout, poll_ready, &set);
+        if(rc == 0) {
+            rc = poll(fds, count, timeout);
+        }
+        check_error(rc, "poll");
+
+        for(int k = 0; k < count; k++) {
+            struct stream *st = &streams[index[k]];
+            if(st -> download == NULL) {
+                continue;
             }
+            int status = rdp_download_process(st -> download, write_chunk, st);
 
-            last = new;
+            // Fetch the chunks of a server that has gone quiet from the others
+            if(status == RDP_DOWNLOAD_ACTIVE && st -> out -> streams > 1
+               && rdp_download_idle(st -> download) >= STALL_MS) {
+                fprintf(stderr, "No packets from server for %d ms, moving its chunks to other servers\n", STALL_MS);
+                status = RDP_DOWNLOAD_FAILED;
+            }
+            if(status != RDP_DOWNLOAD_ACTIVE) {
+                failed += end_stream(streams, n, st, status);
+            }
         }
+    }
+}
+
+
 
-        // Empty buffer for new packet
-        bzero(buffer, SIZE);
-        wc = 0;
+
+
+/**
+ * Get address of a server
+ * @param ip: IP address of server
+ * @param port: port of server
+ * @param addr: set to the address
+ * Returns 0, or -1 if the IP address is not valid
+ */
+int get_server_address(const char *ip, int port, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr -> sin_family = AF_INET;
+    addr -> sin_port = htons(port);
+    if(inet_pton(AF_INET, ip, &addr -> sin_addr) != 1) {
+        fprintf(stderr, "Invalid IP adress: %s\n", ip);
+        return -1;
     }
+    return 0;
+}
+
 
-    // Close file and return
-    fclose(fp);
-    return;
+
+/**
+ * Get address of a mirror server given as <IP server>:<port>
+ * Returns 0, or -1 if the address is not valid
+ */
+int parse_source(const char *spec, struct sockaddr_in *addr) {
+    char ip[INET_ADDRSTRLEN];
+    const char *colon = strrchr(spec, ':');
+
+    if(colon == NULL || (size_t) (colon - spec) >= sizeof(ip)) {
+        fprintf(stderr, "Invalid server: %s\n", spec);
+        return -1;
+    }
+    memcpy(ip, spec, colon - spec);
+    ip[colon - spec] = '\0';
+    return get_server_address(ip, atoi(colon + 1), addr);
 }
 
 
@@ -84,9 +549,6 @@ void read_and_write_file(int sockfd, char *filename, struct sockaddr_in addr){
  * two be replaced. E.g 'kernel-file-XXX' as input
  */
 char *get_filename(char *name) {
-    time_t t;
-    srand((unsigned) time(&t));
-
     // Generate two random numbers between 0-9
     int random_number_1 = 0 + rand() % 9;
     int random_number_2 = 0 + rand() % 9;
@@ -135,62 +597,156 @@ char *generate_unique_filename(){
 
 
 
+/**
+ * Get the chunk to resume a partial download from
+ * Only whole chunks of BUFSIZE bytes are kept, the rest is fetched again
+ * Returns 0 if the file does not exist yet
+ * @param filename: partial output file from an earlier run
+ */
+int64_t get_resume_chunk(const char *filename) {
+    struct stat st;
+
+    if(stat(filename, &st) == -1) {
+        return 0;
+    }
+    return st.st_size / BUFSIZE;
+}
+
+
+
 /**
  * Main function for NewFSP client
- * 1. Create socket and get address of server
- * 2. Connect to server through rdp_connect
- * 3. Receive file from server and write to file
+ * 1. Get address of server, and of mirror servers given with -s
+ * 2. Start one download, or several with -n, each over one or more streams
+ *    to every server with -k
+ * 3. Receive files from servers and write them to file
  */
 int main(int argc, char const *argv[]) {
 
+    const char *resume_file = NULL;
+    const char *mirrors[MAX_SOURCES];
+    int mirror_count = 0;
+    int count = 1;
+    int streams = 1;
+    int cpu = -1;
+    int opt;
+
+    // Optional flags
+    while((opt = getopt(argc, (char * const *) argv, "r:n:k:s:b:c:t")) != -1) {
+        switch(opt) {
+            case 'r':
+                resume_file = optarg;
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'k':
+                streams = atoi(optarg);
+                break;
+            case 's':
+                if(mirror_count == MAX_SOURCES - 1) {
+                    fprintf(stderr, "Too many servers, max is %d\n", MAX_SOURCES);
+                    return EXIT_FAILURE;
+                }
+                mirrors[mirror_count++] = optarg;
+                break;
+            case 'b':
+                busy_poll_us = atoi(optarg);
+                if(busy_poll_us > BUSYPOLL_MAX_US) {
+                    busy_poll_us = BUSYPOLL_MAX_US;
+                }
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            case 't':
+                show_latency = 1;
+                break;
+            default:
+                printf(USAGE, argv[0]);
+                return EXIT_SUCCESS;
+        }
+    }
+
     // Check correct number of input arguments
-    if(argc < 4) {
-        printf("usage: %s <IP server> <port number> <loss propability>\n", argv[0]);
+    // A file from several streams is only complete at the end, so it can not be resumed
+    int per_file = streams * (mirror_count + 1);
+    if(argc - optind < 3 || count < 1 || streams < 1 || streams > RDP_MAX_STREAMS
+       || (resume_file != NULL && (count > 1 || per_file > 1))) {
+        printf(USAGE, argv[0]);
         return EXIT_SUCCESS;
     }
 
     // Assign values to variables
-    const char *ip = argv[1];
-    int port = atoi(argv[2]);
-    float prob = atof(argv[3]);
+    const char *ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    float prob = atof(argv[optind + 2]);
     set_loss_probability(prob);
 
-    // Create socket
-    int fd = socket(AF_INET, SOCK_DGRAM, 0);
-    check_error(fd, "socket");
-
-    // Get ip address
-    struct in_addr ip_addr;
-    int wc = inet_pton(AF_INET, ip, &ip_addr.s_addr);
-    check_error(wc, "inet_pton");
-    if(!wc) {
-        fprintf(stderr, "Invalid IP adress: %s\n", ip );
+    // A spinning client gets a core of its own
+    if(cpu >= 0 && busypoll_pin(cpu) == -1) {
         return EXIT_FAILURE;
     }
 
-    // Get server address
-    struct sockaddr_in dest_addr;
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(port);
-    dest_addr.sin_addr = ip_addr;
+    // Seed once for client ids and filenames, also apart from other clients
+    srand((unsigned) time(NULL) ^ (unsigned) getpid());
 
-    // Try to connect to server
-    ssize_t res = rdp_connect(fd, dest_addr);
-    if(res == -1){
-      return EXIT_SUCCESS;
+    // Get server addresses
+    struct source sources[MAX_SOURCES];
+    int source_count = mirror_count + 1;
+    memset(sources, 0, sizeof(sources));
+    if(get_server_address(ip, port, &sources[0].addr) == -1) {
+        return EXIT_FAILURE;
+    }
+    for(int i = 0; i < mirror_count; i++) {
+        if(parse_source(mirrors[i], &sources[i + 1].addr) == -1) {
+            return EXIT_FAILURE;
+        }
     }
 
-    // Generate filename with random number-ending
-    char *filename = generate_unique_filename();
+    struct output_file files[count];
+    struct stream stream_list[count * per_file];
+    for(int i = 0; i < count; i++) {
+
+        // Resume into the partial file, or generate filename with random number-ending
+        // A generated name is reserved right away so the next download gets another one
+        files[i].fp = NULL;
+        files[i].start_chunk = 0;
+        files[i].streams = per_file;
+        files[i].active = 0;
+        files[i].failed = 0;
+        files[i].digest = 0;
+        files[i].total = -1;
+        files[i].pending_count = 0;
+        rdp_latency_init(&files[i].latency);
+        if(resume_file != NULL) {
+            files[i].filename = strdup(resume_file);
+            files[i].start_chunk = get_resume_chunk(files[i].filename);
+        } else {
+            files[i].filename = generate_unique_filename();
+            open_output_file(&files[i]);
+        }
 
-    // Read file packets and write to file using RDP protocol
-    read_and_write_file(fd, filename, dest_addr);
+        // Connect to the servers in turn, asking for the first missing chunk
+        // Streams share a group id so each server sees one download
+        files[i].group = per_file > 1 ? get_random_number() : 0;
+        for(int s = 0; s < per_file; s++) {
+            struct stream *st = &stream_list[i * per_file + s];
+            struct task task = { files[i].start_chunk + s, per_file };
+            st -> out = &files[i];
+            st -> source = &sources[s % source_count];
+            st -> download = NULL;
+            if(start_stream(st, task) == -1) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
 
-    // Prints name of written file
-    printf("%s\n", filename);
-    free(filename);
+    // Receive files using RDP protocol
+    int failed = run_downloads(stream_list, count * per_file);
 
-    // Close socket and exit program
-    close(fd);
-    return EXIT_SUCCESS;
+    for(int i = 0; i < count; i++) {
+        free(files[i].filename);
+    }
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -1,5 +1,8 @@
 #include "common.h"
 
+#include <fcntl.h>
+#include <signal.h>
+
 /******************************************************************************
 ------------------------------ NewFSP-server ----------------------------------
 *******************************************************************************
@@ -20,151 +23,772 @@ ______________________________________________________________________________
 
 
 
+// Set by SIGHUP, the rate file is read again in the main loop
+static volatile sig_atomic_t reload_rates = 0;
+
+// Set by SIGUSR1, the main loop prints the counters of the endpoint
+static volatile sig_atomic_t show_stats = 0;
+
+
+
 /**
- * Function used for multiplexing
- * @param filename: name of file to send
- * @param sockfd: socket file descriptor
- * @param addr: adress to send file
- * @param file_index: index to which part of file to send
+ * What the scheduler callbacks need to know about the file being served
  */
-int send_file_packet( const char *filename,
-                      int sockfd,
-                      struct sockaddr_in addr,
-                      int file_index) {
+struct file_info {
+    struct rdp_ctx *ctx;
+    const char *filename;
+    struct chunk_cache *cache;
+    struct manifest *manifest;
+    struct live_source *live;
+    int hold;
+    int watching;
+    int fd;
+    int file_fd;
+    int64_t max_value;
+    uint32_t digest;
+    int changed;
+};
 
-    FILE *fp;
-    char buffer[BUFSIZE];
-    ssize_t rc, wc;
-    int a;
-    int file_counter = 0;
-    int retry = 0;
-
-    // Open file
-    fp = fopen(filename, "rb");
-    if (fp == NULL){
-        perror("Error: could not read file");
-        exit(EXIT_FAILURE);
-    }
-
-    // Find packet with file_index
-    while((a = fread(buffer,1, BUFSIZE, fp))) {
-        if(file_counter == file_index) {
-            while(1) {
-
-                // Send packet to client
-                wc = rdp_write(sockfd, buffer, addr, retry, a);
-                check_error(wc, "rdp_write");
-
-                // Wait for ack
-                rc = rdp_wait(sockfd);
-                if(rc > 0)  {
-                    break;
-                }
 
-                // Turn on retry mode in rdp_write
-                retry = 1;
+
+/**
+ * Read one chunk of the file
+ * The file is kept open and read with pread at a 64-bit offset, so chunks
+ * of files of any size are read without opening the file for every chunk
+ * @param file_fd: file descriptor of file to read
+ * @param file_index: index to which part of file to read
+ * @param buffer: buffer of BUFSIZE bytes to read into
+ * Returns number of bytes read
+ */
+int read_file_chunk(int file_fd, int64_t file_index, char *buffer) {
+    off_t offset = (off_t) file_index * BUFSIZE;
+    int a = 0;
+
+    // Read the whole chunk, it is only short at the end of the file
+    while(a < BUFSIZE) {
+        ssize_t rc = pread(file_fd, buffer + a, BUFSIZE - a, offset + a);
+        check_error(rc, "pread");
+        if(rc == 0) {
+            break;
+        }
+        a += rc;
+    }
+    return a;
+}
+
+
+
+/**
+ * Check a chunk read from the file against its CRC32C in the manifest
+ * A chunk that does not match means the file changed after the manifest was
+ * made, and what clients get would no longer match the digest sent with EOF
+ * @param info: file being served
+ * @param index: index of chunk in file
+ * @param data: chunk as read
+ * @param len: size of chunk
+ * Returns 0 if the chunk matches, -1 if not
+ */
+int check_file_chunk(struct file_info *info, int64_t index, const char *data, int len) {
+    if(crc32c(0, data, len) != info -> manifest -> chunk_crc[index]) {
+        fprintf(stderr, "Error: %s changed while it was served, chunk %lld does not match its manifest\n",
+                info -> filename, (long long) index);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/**
+ * A chunk of the file no longer matches its manifest: the connection that
+ * needs it is ended, see end_connections, and no more clients are let in.
+ * Other connections go on, and are ended only if they need a changed chunk
+ * @param info: file being served
+ * @param cnt: connection the chunk was read for
+ */
+void file_changed(struct file_info *info, struct connection *cnt) {
+    cnt -> end_reason = RDP_END_CHANGED;
+    if(!info -> changed) {
+        info -> changed = 1;
+        rdp_close_admission(info -> ctx, info -> fd, RDP_END_CHANGED);
+    }
+}
+
+
+
+/**
+ * Get chunk to send to a connection
+ * In compressed transfer mode, clients that can decompress get the cached chunk,
+ * compressed if that made it smaller, and a chunk not in the cache is read and
+ * compressed into its slot. In live mode the chunk is taken from the ring of the live
+ * source. Otherwise the chunk is read from file. Chunks read from file are
+ * checked against the manifest, and one that does not match is not sent
+ * @param info: file being served
+ * @param cnt: connection to send chunk to
+ * @param index: index of chunk in file
+ * @param buffer: buffer of BUFSIZE bytes used when reading from file
+ * @param len: set to size of chunk
+ * @param options: set to RDP_OPT_COMPRESS if chunk is compressed
+ * Returns pointer to chunk data, or NULL with len 0 if the chunk is gone from
+ * the ring of a live source or does not match the manifest
+ */
+char *get_chunk(struct file_info *info,
+                struct connection *cnt,
+                int64_t index,
+                char *buffer,
+                int *len,
+                unsigned char *options) {
+
+    *options = 0;
+    if(info -> live != NULL) {
+        char *data = live_chunk(info -> live, index, len);
+        if(data == NULL) {
+            *len = 0;
+        }
+        return data;
+    }
+
+    if(info -> cache != NULL && (cnt -> options & RDP_OPT_COMPRESS)) {
+        struct chunk *c = find_cached_chunk(info -> cache, index);
+        if(c == NULL) {
+            int a = read_file_chunk(info -> file_fd, index, buffer);
+            if(check_file_chunk(info, index, buffer, a) == -1) {
+                file_changed(info, cnt);
+                *len = 0;
+                return NULL;
             }
+            c = cache_chunk(info -> cache, index, buffer, a);
         }
-         bzero(buffer, BUFSIZE);
-         file_counter++;
+        *len = c -> len;
+        *options = c -> state == CHUNK_COMPRESSED ? RDP_OPT_COMPRESS : 0;
+        return c -> data;
+    }
+
+    *len = read_file_chunk(info -> file_fd, index, buffer);
+    if(check_file_chunk(info, index, buffer, *len) == -1) {
+        file_changed(info, cnt);
+        *len = 0;
+        return NULL;
+    }
+    return buffer;
+}
+
+
+
+/**
+ * Send one chunk of the file to a connection and start its retransmission timer
+ * @param info: file being served
+ * @param cnt: connection to send chunk to
+ * @param index: number of chunk within the range of the connection
+ * @param first: 1 if the chunk is sent for the first time, 0 for a retry
+ * Returns number of bytes sent, header included, 0 if the connection is to
+ * be ended instead
+ */
+int send_file_packet(struct file_info *info, struct connection *cnt, int64_t index, int first) {
+    char buffer[BUFSIZE];
+    int len;
+    unsigned char options;
+
+    char *data = get_chunk(info, cnt, rdp_file_chunk(cnt, index), buffer, &len, &options);
+    if(cnt -> end_reason != 0) {
+        return 0;
+    }
+
+    // Chunks are sent the first time in order, so this is what the client writes
+    if(first && info -> live != NULL) {
+        cnt -> digest = crc32c(cnt -> digest, data, len);
+    }
+    ssize_t wc = rdp_write(info -> ctx, info -> fd, data, cnt, rdp_chunk_seq(index), len, options);
+    check_error(wc, "rdp_write");
+
+    return wc;
+}
+
+
+
+/**
+ * Scheduler callback, a connection can send when its window is open
+ * and, in live mode, its next chunk has been read from the source
+ * A connection that is to be ended sends nothing more
+ */
+int can_send_chunk(struct connection *cnt, void *arg) {
+    struct file_info *info = arg;
+    if(cnt -> end_reason != 0) {
+        return 0;
+    }
+    if(info -> live != NULL && rdp_window_open(cnt)) {
+        return rdp_file_chunk(cnt, cnt -> next_chunk) < info -> live -> head;
+    }
+    return rdp_window_open(cnt);
+}
+
+
+
+/**
+ * Scheduler callback, sends the next new chunk of a connection
+ */
+int send_next_chunk(struct connection *cnt, void *arg) {
+    struct file_info *info = arg;
+    int64_t index = cnt -> next_chunk;
+    int bytes = send_file_packet(info, cnt, index, 1);
+    if(cnt -> end_reason != 0) {
+        return 0;
     }
-    fclose(fp);
-    return 1;
+    cnt -> next_chunk++;
+    rdp_chunk_sent(info -> ctx, cnt, index, 1);
+    return bytes;
 }
 
 
 
 /**
- * Tell the client that the whole file has been sent
- * Wait for confirmation from client
+ * Send again chunks that have not been acked in time, and the EOF
+ * when all chunks are acked but the client has not ended the connection
+ * A peer that has been quiet for RDP_KEEPALIVE ms gets a keepalive probe,
+ * and so does a client that has closed its receive window, sooner
+ * @param info: file being served
+ * @param cnt: connection to check
+ * Returns -1 if the peer has stopped answering or the connection is to be
+ * ended, and it should be evicted, otherwise 0
  */
-int file_EOF(int fd, struct sockaddr_in addr){
-    ssize_t wc, rc;
-    int retry = 0;
+int retransmit(struct file_info *info, struct connection *cnt) {
+    long long now = rdp_now();
+    int64_t chunk;
 
-    while(1) {
+    if(rdp_peer_dead(cnt, now)) {
+        return -1;
+    }
 
-        // Send empty packet which marks end of file
-        wc = rdp_EOF(fd, addr, retry);
+    while((chunk = rdp_next_expired(cnt, now)) != -1) {
+        ratelimit_charge(rdp_ctx_limits(info -> ctx), cnt, send_file_packet(info, cnt, chunk, 0));
+        if(cnt -> end_reason != 0) {
+            return -1;
+        }
+        rdp_chunk_sent(info -> ctx, cnt, chunk, 0);
+    }
+
+    if(cnt -> file_status >= cnt -> chunks && rdp_eof_expired(cnt, now)) {
+        ssize_t wc = rdp_EOF(info -> fd, cnt -> client_addr, info -> live != NULL ? cnt -> digest : info -> digest);
         check_error(wc, "rdp_EOF");
+        rdp_eof_sent(info -> ctx, cnt);
+    }
 
-        // Wait for connection ending
-        rc = rdp_wait(fd);
-        if(rc > 0) {
-            break;
+    if(rdp_probe_expired(cnt, now)) {
+        ssize_t wc = rdp_send_keepalive(info -> fd, cnt -> client_addr, -1);
+        check_error(wc, "rdp_send_keepalive");
+        rdp_probe_sent(info -> ctx, cnt);
+    }
+
+    if(now - cnt -> last_sent_ms >= RDP_KEEPALIVE && now - cnt -> last_heard_ms >= RDP_KEEPALIVE) {
+        ssize_t wc = rdp_send_keepalive(info -> fd, cnt -> client_addr, -1);
+        check_error(wc, "rdp_send_keepalive");
+        cnt -> last_sent_ms = now;
+    }
+    return 0;
+}
+
+
+
+/**
+ * Accept connection with the first chunk of the file in the accept packet
+ * The chunk is then in flight like any other, so if the accept is lost the
+ * chunk is sent again as a normal data packet and the client takes that as
+ * the accept. Also used when a client sends its connection request again
+ * @param info: file being served
+ * @param cnt: connection returned by rdp_accept
+ */
+void accept_connection(struct file_info *info, struct connection *cnt) {
+    char buffer[BUFSIZE];
+    char *data = NULL;
+    int len = 0;
+    int64_t index = cnt -> file_status;
+    unsigned char options = 0;
+
+    // Nothing to piggyback if the whole range has been sent
+    if(index < cnt -> chunks) {
+        data = get_chunk(info, cnt, rdp_file_chunk(cnt, index), buffer, &len, &options);
+    }
+
+    ssize_t wc = rdp_send_accept(info -> fd, cnt, rdp_chunk_seq(index), data, len, options);
+    check_error(wc, "rdp_send_accept");
+
+    // The chunk is now in flight, a first send unless the request is repeated
+    if(len > 0) {
+        int first = cnt -> next_chunk == index;
+        if(first) {
+            cnt -> next_chunk++;
+            if(info -> live != NULL) {
+                cnt -> digest = crc32c(cnt -> digest, data, len);
+            }
         }
+        rdp_chunk_sent(info -> ctx, cnt, index, first);
+    }
+}
+
+
+
+/**
+ * Start a connection on a live stream
+ * The stream is joined at the chunk asked for if it is still in the ring, and
+ * the EOF digest then covers the stream from its start, like the file the
+ * client resumes. Otherwise it is joined at the oldest chunk in the ring, or
+ * at the newest if the client asked for chunks not read yet, and the digest
+ * covers what the connection is sent
+ * @param info: file being served
+ * @param cnt: new connection
+ */
+void live_join(struct file_info *info, struct connection *cnt) {
+    int64_t oldest = live_oldest(info -> live);
+    int64_t start = cnt -> start_chunk;
+
+    if(start >= oldest && start <= info -> live -> head) {
+        cnt -> digest = live_crc_before(info -> live, start);
+        return;
+    }
+
+    int64_t join = start < oldest ? oldest : info -> live -> head;
+    cnt -> chunks -= join - start;
+    cnt -> start_chunk = join;
+    cnt -> digest = 0;
+}
+
 
-        // Turn on retry mode
-        retry = 1;
+
+/**
+ * Start serving a connection that got a connection slot
+ * @param info: file being served
+ * @param cnt: new connection
+ */
+void start_connection(struct file_info *info, struct connection *cnt) {
+    if(info -> live != NULL) {
+        live_join(info, cnt);
     }
-    return 1;
+    scheduler_classify(rdp_ctx_scheduler(info -> ctx), cnt);
+    ratelimit_classify(rdp_ctx_limits(info -> ctx), cnt);
+    add_rdp_connection(info -> ctx, cnt);
+    accept_connection(info, cnt);
 }
 
 
 
 /**
- * Get number of packets to send for file
- * Requires the send_file_packet function to use the same buffersize
- * @param filename: name of file to check
+ * Start serving queued clients while there are free connection slots, and
+ * queued parts of downloads that have been let in
+ * @param info: file being served
  */
-int get_total_file_packets(const char *filename) {
+void admit_queued(struct file_info *info) {
+    struct connection *next;
+    while((next = rdp_admit_next(info -> ctx)) != NULL) {
+        start_connection(info, next);
+    }
+}
 
-    FILE *fp;
-    char buffer[BUFSIZE];
-    int number_of_packets = 0;
 
-    fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        perror("Error: could not read file");
-        exit(EXIT_FAILURE);
+
+/**
+ * Read what the live source has, and end the connections it has left behind
+ * Without -H the source is read as fast as it comes, and a connection that
+ * still needs a chunk that has left the ring is sent an end packet with
+ * RDP_END_BEHIND and evicted. With -H the source is read no further than the
+ * slowest connection allows, so the writer of the pipe waits for it instead,
+ * and with no connections the ring is kept full
+ * When the source ends the file gets its length, so connections get EOF
+ * @param info: file being served
+ */
+void live_pump(struct file_info *info) {
+    struct live_source *src = info -> live;
+    int n;
+    struct connection **connections = rdp_connections(info -> ctx, &n);
+    int64_t needed = INT64_MAX;
+    int64_t keep = INT64_MAX;
+
+    for(int i = 0; i < n; i++) {
+        struct connection *cnt = connections[i];
+        if(cnt != NULL && cnt -> file_status < cnt -> chunks && rdp_file_chunk(cnt, cnt -> file_status) < needed) {
+            needed = rdp_file_chunk(cnt, cnt -> file_status);
+        }
+    }
+    if(info -> hold) {
+        keep = needed != INT64_MAX ? needed : live_oldest(src);
+    }
+    live_read(src, keep);
+
+    int64_t oldest = live_oldest(src);
+    int evicted = 0;
+    for(int i = 0; i < n; i++) {
+        struct connection *cnt = connections[i];
+        if(cnt != NULL && cnt -> file_status < cnt -> chunks && rdp_file_chunk(cnt, cnt -> file_status) < oldest) {
+            ssize_t wc = rdp_end_connection(info -> fd, cnt -> client_addr, RDP_END_BEHIND);
+            check_error(wc, "rdp_end_connection");
+            rdp_evict(info -> ctx, cnt);
+            evicted = 1;
+        }
+    }
+    if(evicted) {
+        admit_queued(info);
+    }
+
+    if(src -> eof && info -> max_value == RDP_CHUNKS_UNKNOWN) {
+        info -> max_value = src -> head;
+        rdp_set_total_chunks(info -> ctx, src -> head);
+        printf("Live stream ended after %lld chunks\n", (long long) src -> head);
     }
-    int a;
-    while((a = fread(buffer,1, BUFSIZE, fp))) {
-        number_of_packets++;
-        bzero(buffer, BUFSIZE);
+
+    // Wake up for the pipe only while there is room to read into
+    int watch = !src -> follow && live_can_read(src, keep);
+    if(watch != info -> watching) {
+        rdp_watch(info -> ctx, src -> fd, watch);
+        info -> watching = watch;
     }
+}
+
+
+
+/**
+ * End the connections the application has given an end reason, with an end
+ * packet carrying it. Done after the scheduler round, which may set it
+ * @param info: file being served
+ */
+void end_connections(struct file_info *info) {
+    int n;
+    struct connection **connections = rdp_connections(info -> ctx, &n);
+    int ended = 0;
+
+    for(int i = 0; i < n; i++) {
+        struct connection *cnt = connections[i];
+        if(cnt != NULL && cnt -> end_reason != 0) {
+            ssize_t wc = rdp_end_connection(info -> fd, cnt -> client_addr, cnt -> end_reason);
+            check_error(wc, "rdp_end_connection");
+            rdp_evict(info -> ctx, cnt);
+            ended = 1;
+        }
+    }
+    if(ended) {
+        admit_queued(info);
+    }
+}
+
+
+
+/**
+ * Timer callback, the timer of a connection is due
+ * @param cnt: connection whose timer fired
+ * @param arg: file being served
+ * Returns -1 if the peer stopped answering or the connection was ended, and
+ * it was evicted, otherwise 0
+ */
+int connection_timer(struct connection *cnt, void *arg) {
+    struct file_info *info = arg;
+
+    if(retransmit(info, cnt) == -1) {
+        if(cnt -> end_reason != 0) {
+            ssize_t wc = rdp_end_connection(info -> fd, cnt -> client_addr, cnt -> end_reason);
+            check_error(wc, "rdp_end_connection");
+        }
+        rdp_evict(info -> ctx, cnt);
+        admit_queued(info);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/**
+ * How long the main loop may wait for packets
+ * Until the next retransmission is due, or until the first connection with
+ * an open send window is allowed to send by the rate limits
+ * @param info: file being served
+ */
+int next_timeout(struct file_info *info) {
+    int timeout = rdp_poll_timeout(info -> ctx);
+    long long now = rdp_now();
+    int n;
+    struct connection **connections = rdp_connections(info -> ctx, &n);
+
+    for(int i = 0; i < n && timeout > 0; i++) {
+        if(connections[i] != NULL && can_send_chunk(connections[i], info)) {
+            int delay = ratelimit_delay(rdp_ctx_limits(info -> ctx), connections[i], now);
+            if(delay < timeout) {
+                timeout = delay;
+            }
+        }
+    }
+
+    // A growing file does not wake up epoll, it is read again every LIVE_FOLLOW_POLL ms
+    if(info -> live != NULL && info -> live -> follow && !info -> live -> eof && timeout > LIVE_FOLLOW_POLL) {
+        timeout = LIVE_FOLLOW_POLL;
+    }
+    return timeout;
+}
+
+
+
+/**
+ * Signal handler for SIGHUP, asks the main loop to read the rate file again
+ */
+void handle_sighup(int sig) {
+    (void) sig;
+    reload_rates = 1;
+}
+
+
+
+/**
+ * Read the rate file again and give every connection its new prefix limit
+ */
+void reload_rate_file(struct rdp_ctx *ctx, const char *rate_file) {
+    struct rate_limits *limits = rdp_ctx_limits(ctx);
+    int n;
+    struct connection **connections = rdp_connections(ctx, &n);
+
+    reload_rates = 0;
+    if(ratelimit_load(limits, rate_file) == -1) {
+        fprintf(stderr, "Rate file %s has errors, valid lines are used\n", rate_file);
+    }
+    for(int i = 0; i < n; i++) {
+        if(connections[i] != NULL) {
+            ratelimit_classify(limits, connections[i]);
+        }
+    }
+}
 
-    fclose(fp);
-    return number_of_packets;
+
+
+/**
+ * Signal handler for SIGUSR1, asks the main loop to print the counters
+ */
+void handle_sigusr1(int sig) {
+    (void) sig;
+    show_stats = 1;
 }
 
 
 
+/**
+ * Print the counters of the endpoint on one line, and a line for each of its
+ * latency histograms
+ * Datagrams dropped by the receive queue of this host are counted apart
+ * from what was lost on the way, as are the retransmits they may have caused
+ */
+void print_stats(struct rdp_ctx *ctx) {
+    struct rdp_stats *stats = rdp_ctx_stats(ctx);
+
+    show_stats = 0;
+    printf("STATS: received %llu, dropped by receive queue %llu, retransmits %llu, after local drops %llu, sndbuf %d, rcvbuf %d\n",
+           (unsigned long long) stats -> received,
+           (unsigned long long) stats -> local_drops,
+           (unsigned long long) stats -> retransmits,
+           (unsigned long long) stats -> local_retransmits,
+           stats -> sndbuf,
+           stats -> rcvbuf);
+    hist_print(stdout, "RTT", &stats -> latency.rtt);
+    hist_print(stdout, "ONE-WAY DELAY", &stats -> latency.owd);
+    fflush(stdout);
+}
+
+
+
+/**
+ * Print counters, wait for zerocopy sends and free everything the server holds
+ * @param info: file being served
+ */
+void stop_server(struct file_info *info) {
+    print_stats(info -> ctx);
+    zerocopy_flush(rdp_ctx_zerocopy(info -> ctx), info -> fd);
+    free_chunk_cache(info -> cache);
+    manifest_close(info -> manifest);
+    live_close(info -> live);
+    if(info -> file_fd != -1) {
+        close(info -> file_fd);
+    }
+    rdp_ctx_free(info -> ctx);
+    close(info -> fd);
+}
+
+
 
 /**
  * Main function for NewFSP-server
  * 1. Create socket and bind address to socket
- * 2. Check if there are any new connection request
- * 3. Accept new connection request
- * 4. Write file datagram to client
- * 5. Check if whole file is sent and close connection
+ * 2. Handle connection requests, acks and connection endings from clients
+ * 3. Send again what has not been acked in time
+ * 4. Let the scheduler send new chunks to connections with open windows
+ * 5. Close connections when the client has received the whole file
+ * 6. End connections that need a chunk that changed, and stop once none are left
  */
 int main(int argc, char const *argv[]) {
 
-    if(argc < 5) {
-        printf("Usage: %s <port> <filename> <number of files> <loss propability>\n", argv[0]);
+    int compress = 0;
+    int zerocopy = 0;
+    size_t zerocopy_min = 0;
+    int max_active = 0;
+    int queue_max = RDP_QUEUE_DEFAULT;
+    const char *rate_file = NULL;
+    int window = RDP_WINDOW;
+    int cookie_rate = RDP_COOKIE_RATE;
+    int live_chunks = 0;
+    int hold = 0;
+    int busy_poll = 0;
+    int cpu = -1;
+    double rate;
+    int opt;
+
+    // Flags are read before the number of files is known, so the scheduler
+    // rules and rate limits are collected here and handed to the endpoint later
+    struct scheduler sched;
+    struct rate_limits limits;
+    scheduler_init(&sched);
+    ratelimit_init(&limits);
+
+    // Optional flags
+    while((opt = getopt(argc, (char * const *) argv, "zZ:m:q:W:P:R:C:L:F:K:l:Hb:c:")) != -1) {
+        switch(opt) {
+            case 'm':
+                max_active = atoi(optarg);
+                break;
+            case 'q':
+                queue_max = atoi(optarg);
+                break;
+            case 'z':
+                compress = 1;
+                break;
+            case 'Z':
+                if(atol(optarg) <= 0) {
+                    fprintf(stderr, "Invalid zerocopy size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                zerocopy = 1;
+                zerocopy_min = atol(optarg);
+                break;
+            case 'W':
+                window = atoi(optarg);
+                break;
+            case 'P':
+                if(scheduler_add_rule(&sched, optarg) == -1) {
+                    fprintf(stderr, "Invalid priority rule: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'R':
+            case 'C':
+                if(ratelimit_parse_rate(optarg, &rate) == -1) {
+                    fprintf(stderr, "Invalid rate: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                if(opt == 'R') {
+                    ratelimit_set_global(&limits, rate);
+                } else {
+                    ratelimit_set_connection(&limits, rate);
+                }
+                break;
+            case 'L':
+                if(ratelimit_add_prefix(&limits, optarg, 0) == -1) {
+                    fprintf(stderr, "Invalid prefix rate limit: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'F':
+                rate_file = optarg;
+                break;
+            case 'K':
+                cookie_rate = atoi(optarg);
+                break;
+            case 'l':
+                live_chunks = atoi(optarg);
+                break;
+            case 'H':
+                hold = 1;
+                break;
+            case 'b':
+                busy_poll = atoi(optarg);
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            default:
+                printf("Usage: %s <port> <filename> <number of files> <loss propability> [-z] [-Z <min bytes>] [-m <max active>] [-q <queue length>] [-W <window>] [-P <ip>[/<bits>]=<class>[,<weight>]] [-R <rate>] [-C <rate>] [-L <ip>[/<bits>]=<rate>] [-F <rate file>] [-K <connects per second>] [-l <ring chunks>] [-H] [-b <busy poll us>] [-c <cpu>]\n", argv[0]);
+                return EXIT_SUCCESS;
+        }
+    }
+
+    if(argc - optind < 4) {
+        printf("Usage: %s <port> <filename> <number of files> <loss propability> [-z] [-Z <min bytes>] [-m <max active>] [-q <queue length>] [-W <window>] [-P <ip>[/<bits>]=<class>[,<weight>]] [-R <rate>] [-C <rate>] [-L <ip>[/<bits>]=<rate>] [-F <rate file>] [-K <connects per second>] [-l <ring chunks>] [-H] [-b <busy poll us>] [-c <cpu>]\n", argv[0]);
         return EXIT_SUCCESS;
     }
 
     // Assign input values to variables
-    int port = atoi(argv[1]);
-    const char *filename = argv[2];
-    N = atoi(argv[3]);
-    float prob = atof(argv[4]);
+    int port = atoi(argv[optind]);
+    const char *filename = argv[optind + 1];
+    int n_files = atoi(argv[optind + 2]);
+    float prob = atof(argv[optind + 3]);
     set_loss_probability(prob);
-    init_connections(N);
 
-    // Get number of packets to send
-    int max_value = get_total_file_packets(filename);
-    int files_written = 0;
-    int addr_index = 0;
+    // One RDP endpoint with a connection slot for each file
+    struct rdp_ctx *ctx = rdp_ctx_new(n_files);
+    rdp_set_window(ctx, window);
+    rdp_set_cookie_rate(ctx, cookie_rate);
+    rdp_set_busy_poll(ctx, busy_poll);
+    *rdp_ctx_scheduler(ctx) = sched;
+    *rdp_ctx_limits(ctx) = limits;
+
+    // Rates from file override the flags, and are read again on SIGHUP
+    if(rate_file != NULL) {
+        if(ratelimit_load(rdp_ctx_limits(ctx), rate_file) == -1) {
+            rdp_ctx_free(ctx);
+            return EXIT_FAILURE;
+        }
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_sighup;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGHUP, &sa, NULL);
+    }
 
-    fd_set fds = { 0 };
-    struct timeval timeout = { 0 };
+    // A spinning server gets a core of its own
+    if(cpu >= 0 && busypoll_pin(cpu) == -1) {
+        rdp_ctx_free(ctx);
+        return EXIT_FAILURE;
+    }
+
+    // Counters are printed on SIGUSR1 and when the server is done
+    struct sigaction usr;
+    memset(&usr, 0, sizeof(usr));
+    usr.sa_handler = handle_sigusr1;
+    sigemptyset(&usr.sa_mask);
+    sigaction(SIGUSR1, &usr, NULL);
+
+    // Get number of packets to send and digest of file from its chunk manifest
+    // A live stream has neither until its source ends
+    struct file_info info = { ctx, filename, NULL, NULL, NULL, hold, 0, -1, -1, 0, 0, 0 };
+    if(live_chunks > 0) {
+        info.live = live_open(filename, live_chunks, BUFSIZE);
+        info.max_value = RDP_CHUNKS_UNKNOWN;
+    } else {
+        info.manifest = manifest_open(filename, BUFSIZE);
+        info.file_fd = open(filename, O_RDONLY);
+        check_error(info.file_fd, "open");
+        info.max_value = info.manifest -> header -> chunk_count;
+        info.digest = info.manifest -> header -> digest;
+    }
+
+    // Serve up to max_active clients at a time, by default all of them, and queue the rest
+    if(max_active <= 0 || max_active > n_files) {
+        max_active = n_files;
+    }
+    init_admission(ctx, max_active, queue_max, info.max_value);
+
+    // Chunks are compressed as they are first sent in compressed transfer mode,
+    // live chunks are sent as they are
+    if(compress && info.live == NULL) {
+        info.cache = new_chunk_cache(filename, info.manifest);
+    }
+    int files_written = 0;
 
     // Create socket
     int fd = socket(AF_INET, SOCK_DGRAM, 0);
     check_error(fd, "socket");
+    info.fd = fd;
 
     // Get address
     struct sockaddr_in my_addr;
@@ -172,61 +796,80 @@ int main(int argc, char const *argv[]) {
     my_addr.sin_port = htons(port);
     my_addr.sin_addr.s_addr = INADDR_ANY;
 
-    // Decleare enough addresses
-    struct sockaddr_in clients[max_addr];
-    for(int x = 0; x < max_addr; x++) {
-        struct sockaddr_in ad = { 0 };
-        clients[x] = ad;
-    }
-
     // Bind address to socket
     int rc = bind(fd, (struct sockaddr*) &my_addr, sizeof(struct sockaddr_in));
     check_error(rc, "bind");
 
+    // Send large data packets without copying them, falls back to copying if unsupported
+    if(zerocopy) {
+        zerocopy_enable(rdp_ctx_zerocopy(ctx), fd, zerocopy_min);
+    }
+
 
     while(1){
 
-        // 1. LISTEN AND ACCEPT CONNECTIONS
-        int listening = rdp_listen(fd, fds, timeout);
-        if(listening) {
-            struct connection *ctn = rdp_accept(fd, &clients[addr_index]);
-            if(ctn != NULL) {
-                addr_index++;
-                add_rdp_connection(ctn);
-            }
+        // 1. WAIT FOR PACKETS, OR UNTIL THERE IS SOMETHING TO SEND
+        rdp_listen(ctx, fd, next_timeout(&info));
+        if(reload_rates) {
+            reload_rate_file(ctx, rate_file);
         }
+        if(show_stats) {
+            print_stats(ctx);
+        }
+
+        // Read what the live source has, before anything is sent from its ring
+        if(info.live != NULL) {
+            live_pump(&info);
+        }
+
+        // 2. HANDLE EVERY PACKET WAITING ON THE SOCKET
+        struct connection *ctn;
+        int event;
+        while((event = rdp_receive(ctx, fd, &ctn)) != RDP_EVENT_NONE) {
 
-        // 2. MULTIPLEXING
-        for(int i = 0; i < N; i++) {
-            if(connections[i] != NULL) {
-                if(connections[i] -> file_status <= max_value) {
-                    int ind = connections[i] -> file_status;
-                    if(ind < max_value) {
-                        int sendt = send_file_packet(filename, fd, connections[i] -> client_addr, ind);
-                        if(sendt) {
-                            connections[i] -> file_status++;
-                        }
-                    } else {
-                        int end = file_EOF(fd, connections[i] -> client_addr);
-                        if(end) {
-                            connections[i] -> file_status++;
-                        }
-                    }
-
-
-                    // 3. CLOSE CONNECTION
-                    if(connections[i] -> file_status > max_value) {
-                        rdp_close(connections[i]);
-                        files_written++;
-
-                        if(files_written == N) {
-                            free_all_rdp_connections();
-                            close(fd);
-                            return EXIT_SUCCESS;
-                        }
-                    }
+            if(event == RDP_EVENT_CONNECT) {
+                start_connection(&info, ctn);
+            }
+
+            // The client sent its request again, the accept was lost
+            else if(event == RDP_EVENT_RECONNECT) {
+                accept_connection(&info, ctn);
+            }
+
+            // 3. CLOSE CONNECTION WHEN CLIENT HAS THE WHOLE FILE
+            else if(event == RDP_EVENT_CLOSE) {
+                // A download split over several connections is written when the last one closes
+                // A client may also end a connection early to fetch its chunks elsewhere
+                if(ctn -> file_status >= ctn -> chunks && rdp_group_size(ctx, ctn) == 1) {
+                    files_written++;
+                }
+                rdp_close(ctx, ctn);
+
+                // Let the next queued client use the free slot
+                admit_queued(&info);
+
+                if(files_written == n_files) {
+                    stop_server(&info);
+                    return EXIT_SUCCESS;
                 }
             }
         }
+
+        // 4. SEND AGAIN WHAT HAS NOT BEEN ACKED, EVICT PEERS THAT STOPPED ANSWERING
+        // Only connections whose timer is due are looked at
+        rdp_expire_timers(ctx, connection_timer, &info);
+
+        // 5. SEND NEW CHUNKS
+        int n;
+        struct connection **connections = rdp_connections(ctx, &n);
+        scheduler_round(rdp_ctx_scheduler(ctx), rdp_ctx_limits(ctx), connections, n, can_send_chunk, send_next_chunk, &info);
+
+        // 6. END CONNECTIONS THAT CAN NOT BE SERVED, STOP WHEN THE FILE CHANGED AND NONE ARE LEFT
+        end_connections(&info);
+        if(info.changed && count_rdp_connections(ctx) == 0) {
+            fprintf(stderr, "Stopped serving %s, it changed while it was served\n", filename);
+            stop_server(&info);
+            return EXIT_FAILURE;
+        }
     }
 }
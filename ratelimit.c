@@ -0,0 +1,305 @@
+#include "common.h"
+
+/*****************************************************************************
+-------------------------------- RATE LIMIT ----------------------------------
+******************************************************************************
+
+  Token buckets limiting how fast the server sends, at three levels: all
+  traffic, each connection, and all clients within an address prefix. A
+  rate of 0 means no limit at that level. Buckets fill at their rate up to
+  a burst of RATE_BURST_MS worth of tokens, and every packet sent takes its
+  size in bytes. A connection may send a new chunk when none of its buckets
+  is in debt, so a packet may overdraw a bucket and the debt is paid back
+  before the next one. Retransmissions are charged but never held back.
+
+  Rates are set with flags at startup and can be changed at runtime from a
+  file with lines like these, read again when the server gets SIGHUP:
+
+      global 10M
+      connection 500k
+      prefix 10.0.0.0/8 2M
+
+******************************************************************************/
+
+/**
+ * Set up rate limits with no limit at any level
+ */
+void ratelimit_init(struct rate_limits *rl) {
+    memset(rl, 0, sizeof(struct rate_limits));
+}
+
+
+
+/**
+ * Largest number of tokens a bucket with this rate holds
+ */
+static double bucket_burst(double rate) {
+    double burst = rate * RATE_BURST_MS / 1000;
+    return burst < RATE_BURST_MIN ? RATE_BURST_MIN : burst;
+}
+
+
+
+/**
+ * Add the tokens a bucket has earned since it was last filled
+ * A bucket without a limit is kept full
+ */
+static void bucket_fill(struct token_bucket *b, double rate, long long now) {
+    if(rate <= 0) {
+        b -> tokens = 0;
+    } else if(b -> last_ms == 0) {
+        b -> tokens = bucket_burst(rate);
+    } else {
+        b -> tokens += rate * (now - b -> last_ms) / 1000;
+        if(b -> tokens > bucket_burst(rate)) {
+            b -> tokens = bucket_burst(rate);
+        }
+    }
+    b -> last_ms = now;
+}
+
+
+
+/**
+ * Time in ms until a bucket is out of debt
+ */
+static int bucket_delay(struct token_bucket *b, double rate) {
+    if(rate <= 0 || b -> tokens >= 0) {
+        return 0;
+    }
+    return (int) (-b -> tokens * 1000 / rate) + 1;
+}
+
+
+
+/**
+ * Parse a rate in bytes per second, with an optional k, M or G suffix
+ * @param str: rate to parse, e.g. 1500k
+ * @param rate: set to the rate in bytes per second
+ * Returns 0 on success, -1 if the rate could not be parsed
+ */
+int ratelimit_parse_rate(const char *str, double *rate) {
+    char *end;
+    double value = strtod(str, &end);
+
+    if(end == str || value < 0) {
+        return -1;
+    }
+    switch(*end) {
+        case 'k': case 'K': value *= 1000; end++; break;
+        case 'm': case 'M': value *= 1000000; end++; break;
+        case 'g': case 'G': value *= 1000000000; end++; break;
+    }
+    if(*end != '\0' && *end != '\n') {
+        return -1;
+    }
+
+    *rate = value;
+    return 0;
+}
+
+
+
+/**
+ * Set the limit for all traffic sent by the server
+ * @param rate: bytes per second, 0 for no limit
+ */
+void ratelimit_set_global(struct rate_limits *rl, double rate) {
+    rl -> global_rate = rate;
+}
+
+
+
+/**
+ * Set the limit for each connection
+ * @param rate: bytes per second, 0 for no limit
+ */
+void ratelimit_set_connection(struct rate_limits *rl, double rate) {
+    rl -> connection_rate = rate;
+}
+
+
+
+/**
+ * Add a limit shared by all clients within an address prefix
+ * @param spec: limit as <ip>[/<bits>]=<rate>, e.g. 10.0.0.0/8=2M
+ * @param from_file: 1 if the limit comes from the rate file, these are
+ *                   replaced when the file is read again
+ * Returns 0 on success, -1 if the limit could not be parsed
+ */
+int ratelimit_add_prefix(struct rate_limits *rl, const char *spec, int from_file) {
+    int bits;
+    double rate;
+    uint32_t addr;
+    uint32_t mask;
+    const char *eq;
+
+    if(rl -> prefix_count == RATE_MAX_PREFIXES) {
+        fprintf(stderr, "Too many prefix rate limits, max is %d\n", RATE_MAX_PREFIXES);
+        return -1;
+    }
+
+    if(parse_prefix(spec, &addr, &mask, &bits, &eq) == -1) {
+        return -1;
+    }
+    if(ratelimit_parse_rate(eq + 1, &rate) == -1) {
+        return -1;
+    }
+
+    struct rate_prefix *p = &rl -> prefixes[rl -> prefix_count++];
+    p -> mask = mask;
+    p -> addr = addr;
+    p -> bits = bits;
+    p -> from_file = from_file;
+    p -> rate = rate;
+    p -> bucket.tokens = 0;
+    p -> bucket.last_ms = 0;
+    return 0;
+}
+
+
+
+/**
+ * Read rate limits from file
+ * Prefix limits from an earlier read of the file are replaced, the global and
+ * connection limits only change if the file sets them. Connections keep their
+ * old prefix until ratelimit_classify is called for them again
+ * @param path: file with one limit per line, # starts a comment
+ * Returns 0 on success, -1 if the file could not be read or has an invalid line
+ */
+int ratelimit_load(struct rate_limits *rl, const char *path) {
+    char line[256];
+    char key[32];
+    char value[200];
+    double rate;
+    int line_number = 0;
+    int rc = 0;
+
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL) {
+        perror("Error: could not read rate file");
+        return -1;
+    }
+
+    /* Drop prefixes from the last read, keep those given as flags */
+    int kept = 0;
+    for(int i = 0; i < rl -> prefix_count; i++) {
+        if(!rl -> prefixes[i].from_file) {
+            rl -> prefixes[kept++] = rl -> prefixes[i];
+        }
+    }
+    rl -> prefix_count = kept;
+
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        line_number++;
+        if(sscanf(line, "%31s", key) != 1 || key[0] == '#') {
+            continue;
+        }
+
+        int ok = 0;
+        if(strcmp(key, "global") == 0 || strcmp(key, "connection") == 0) {
+            if(sscanf(line, "%*s %199s", value) == 1 && ratelimit_parse_rate(value, &rate) == 0) {
+                if(key[0] == 'g') {
+                    rl -> global_rate = rate;
+                } else {
+                    rl -> connection_rate = rate;
+                }
+                ok = 1;
+            }
+        } else if(strcmp(key, "prefix") == 0) {
+            char prefix[64];
+            if(sscanf(line, "%*s %63s %199s", prefix, value) == 2) {
+                char spec[300];
+                snprintf(spec, sizeof(spec), "%s=%s", prefix, value);
+                ok = ratelimit_add_prefix(rl, spec, 1) == 0;
+            }
+        }
+
+        if(!ok) {
+            fprintf(stderr, "%s:%d: invalid rate limit\n", path, line_number);
+            rc = -1;
+        }
+    }
+
+    fclose(fp);
+    return rc;
+}
+
+
+
+/**
+ * Find the prefix limit of a connection, the longest matching prefix is used
+ * @param cnt: connection to classify
+ */
+void ratelimit_classify(struct rate_limits *rl, struct connection *cnt) {
+    struct sockaddr_in addr = cnt -> client_addr;
+    int best = -1;
+
+    for(int i = 0; i < rl -> prefix_count; i++) {
+        struct rate_prefix *p = &rl -> prefixes[i];
+        if((addr.sin_addr.s_addr & p -> mask) == p -> addr
+           && (best == -1 || p -> bits > rl -> prefixes[best].bits)) {
+            best = i;
+        }
+    }
+    cnt -> rate_prefix = best;
+}
+
+
+
+/**
+ * Check if a connection may send a new chunk now
+ * @param cnt: connection to check
+ * @param now: current time from rdp_now
+ * Returns 1 if none of its buckets is in debt, otherwise 0
+ */
+int ratelimit_allow(struct rate_limits *rl, struct connection *cnt, long long now) {
+    return ratelimit_delay(rl, cnt, now) == 0;
+}
+
+
+
+/**
+ * Time until a connection may send a new chunk
+ * @param cnt: connection to check
+ * @param now: current time from rdp_now
+ * Returns ms until all its buckets are out of debt, 0 if it may send now
+ */
+int ratelimit_delay(struct rate_limits *rl, struct connection *cnt, long long now) {
+    int delay = 0;
+    int d;
+
+    bucket_fill(&rl -> global_bucket, rl -> global_rate, now);
+    delay = bucket_delay(&rl -> global_bucket, rl -> global_rate);
+
+    bucket_fill(&cnt -> bucket, rl -> connection_rate, now);
+    d = bucket_delay(&cnt -> bucket, rl -> connection_rate);
+    delay = d > delay ? d : delay;
+
+    if(cnt -> rate_prefix >= 0) {
+        struct rate_prefix *p = &rl -> prefixes[cnt -> rate_prefix];
+        bucket_fill(&p -> bucket, p -> rate, now);
+        d = bucket_delay(&p -> bucket, p -> rate);
+        delay = d > delay ? d : delay;
+    }
+    return delay;
+}
+
+
+
+/**
+ * Take the size of a sent packet from the buckets of a connection
+ * @param cnt: connection the packet was sent to
+ * @param bytes: size of packet
+ */
+void ratelimit_charge(struct rate_limits *rl, struct connection *cnt, int bytes) {
+    if(rl -> global_rate > 0) {
+        rl -> global_bucket.tokens -= bytes;
+    }
+    if(rl -> connection_rate > 0) {
+        cnt -> bucket.tokens -= bytes;
+    }
+    if(cnt -> rate_prefix >= 0 && rl -> prefixes[cnt -> rate_prefix].rate > 0) {
+        rl -> prefixes[cnt -> rate_prefix].bucket.tokens -= bytes;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// How much a bucket may save up, in ms of its rate
+#define RATE_BURST_MS 50
+
+// Smallest burst, a bucket must hold at least a couple of full packets
+#define RATE_BURST_MIN 4000
+
+// Max number of address prefix limits
+#define RATE_MAX_PREFIXES 32
+
+
+// Token bucket, the rate in bytes per second is kept by the owner of the bucket
+// so it can be changed without touching every bucket
+struct token_bucket {
+  double tokens;
+  long long last_ms;
+};
+
+struct rate_prefix {
+  uint32_t addr;
+  uint32_t mask;
+  int bits;
+  int from_file;
+  double rate;
+  struct token_bucket bucket;
+};
+
+// Limits of one RDP endpoint, rates in bytes per second, 0 for no limit
+struct rate_limits {
+  double global_rate;
+  double connection_rate;
+  struct token_bucket global_bucket;
+  struct rate_prefix prefixes[RATE_MAX_PREFIXES];
+  int prefix_count;
+};
+
+
+struct connection;
+
+void ratelimit_init(struct rate_limits *rl);
+
+int ratelimit_parse_rate(const char *str, double *rate);
+
+void ratelimit_set_global(struct rate_limits *rl, double rate);
+
+void ratelimit_set_connection(struct rate_limits *rl, double rate);
+
+int ratelimit_add_prefix(struct rate_limits *rl, const char *spec, int from_file);
+
+int ratelimit_load(struct rate_limits *rl, const char *path);
+
+void ratelimit_classify(struct rate_limits *rl, struct connection *cnt);
+
+int ratelimit_allow(struct rate_limits *rl, struct connection *cnt, long long now);
+
+int ratelimit_delay(struct rate_limits *rl, struct connection *cnt, long long now);
+
+void ratelimit_charge(struct rate_limits *rl, struct connection *cnt, int bytes);
+
+
+#endif
@@ -1,5 +1,10 @@
 #include "common.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+
 /*****************************************************************************
 ------------------------------- RDP Protocol ---------------------------------
 ******************************************************************************
@@ -11,362 +16,1502 @@
 ******************************************************************************/
 
 
+/* State of one RDP endpoint, a process can have as many as it likes */
+struct rdp_ctx {
+    int n;
+    int n_counter;
+    int max_files;
+    struct connection **connections;
+
+    /* Send window given to new connections */
+    int send_window;
+
+    /* Admission queue for clients waiting for a free connection slot */
+    struct connection **queue;
+    int queue_len;
+    int queue_max;
+    int max_active;
+    int64_t total_chunks;
+
+    /* Reject reason for every new client once admission is closed, 0 while open */
+    int closed_reason;
+
+    /* Time left of each active connection, scratch space for estimate_wait */
+    long long *remaining;
+    int remaining_len;
+
+    struct scheduler sched;
+    struct rate_limits limits;
+    struct zerocopy zc;
+    struct sockbuf sockbuf;
+    struct rdp_stats stats;
+
+    /* Packets read by rdp_receive and not handled yet */
+    struct rdp_batch batch;
+
+    /* One timer per active connection, see rdp_timer_update */
+    struct timer_wheel timers;
+
+    /* epoll set of rdp_listen, made on first use, with the socket it listens on */
+    int epfd;
+    int listen_fd;
+
+    /* Time rdp_listen spins before it sleeps, 0 to not spin */
+    int busy_poll_us;
+
+    /* Secret for cookies and connection ids, and the next id to make */
+    uint64_t key[2];
+    uint64_t id_counter;
+
+    /* New connection requests without a cookie taken this second */
+    int cookie_rate;
+    long long cookie_second;
+    int cookie_count;
+};
+
+
+
 
 
 /*                      RDP CONNECTION FUNCTIONS                            */
 /****************************************************************************/
 
 /**
- * rdp connection function used by client for establishing connection
- * @param fd: socket used for sending connection
- * @param dest_addr: destination address of server
- * Function gives client a random id number
- * Makes an rdp packet and request connection by using flag 0x01
- * The function calls help method rdp_confirmation, waiting for final confirmation by server
+ * Add a file descriptor to the epoll set of an endpoint, or change what it is
+ * waited for, the set is made on first use
+ * @param events: events to wait for
+ */
+static void rdp_epoll_set(struct rdp_ctx *ctx, int fd, unsigned int events) {
+    struct epoll_event ev;
+
+    if(ctx -> epfd == -1) {
+        ctx -> epfd = epoll_create1(0);
+        check_error(ctx -> epfd, "epoll_create1");
+    }
+    ev.events = events;
+    ev.data.fd = fd;
+    if(epoll_ctl(ctx -> epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        check_error(epoll_ctl(ctx -> epfd, EPOLL_CTL_ADD, fd, &ev), "epoll_ctl");
+    }
+}
+
+
+
+/**
+ * Make rdp_listen also stop waiting when another file descriptor is readable,
+ * e.g. the pipe a live stream is read from
+ * @param fd: file descriptor to watch
+ * @param on: 1 to wait for fd, 0 to stop waiting for it until it is turned on again
  */
-ssize_t rdp_connect(int fd, struct sockaddr_in dest_addr) {
+void rdp_watch(struct rdp_ctx *ctx, int fd, int on) {
+    if(on) {
+        rdp_epoll_set(ctx, fd, EPOLLIN);
+    }
 
-    /* Generate random client id and make rdp connection packet*/
-    int id = get_random_number();
-    struct rdp_packet *pkt = make_rdp_packet(0x01, 0, 0, 0, id, 0, 0, NULL);
+    /* Taken out of the set, a closed pipe would wake epoll up all the time */
+    else if(ctx -> epfd != -1) {
+        epoll_ctl(ctx -> epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
 
-    /* Convert packet for sending */
-    unsigned int size = sizeof(struct rdp_packet);
-    char* convert = get_packet(pkt, &size);
 
-    /* Send connection packet to server*/
-    ssize_t wc = send_packet(fd, convert, size, 0, (struct sockaddr*)&dest_addr, sizeof(dest_addr));
-    check_error(wc, "send_packet");
 
-    /* Free allocated memory */
-    free(pkt);
-    free(convert);
+/**
+ * Size the socket buffers for the windows of the active connections, and
+ * make the receive buffer larger if its queue has dropped datagrams
+ */
+static void rdp_autotune(struct rdp_ctx *ctx, int fd) {
+    int packets = 0;
+    for(int i = 0; i < ctx -> n; i++) {
+        if(ctx -> connections[i] != NULL) {
+            packets += ctx -> connections[i] -> window;
+        }
+    }
+
+    if(sockbuf_tune(&ctx -> sockbuf, fd, packets, ctx -> batch.dropped)) {
+        fprintf(stderr, "Receive queue overflowed, %llu datagrams dropped on this host, receive buffer now %d bytes\n",
+                (unsigned long long) ctx -> batch.dropped, ctx -> sockbuf.rcvbuf);
+    }
+}
+
+
+
+/**
+ * Check the epoll set of an endpoint without waiting, see busypoll_spin
+ */
+static int rdp_epoll_ready(void *arg) {
+    struct rdp_ctx *ctx = arg;
+    struct epoll_event ev;
+    return epoll_wait(ctx -> epfd, &ev, 1, 0);
+}
+
+
+
+/**
+ * Rdp_listen function turn socket into a listening socket
+ * Waits in epoll, the socket is added to the epoll set of the endpoint on
+ * the first call, and gets drop counting and buffers sized by sockbuf. The
+ * server waits no longer than until its next timer is due
+ * Zerocopy notifications and file descriptors from rdp_watch also wake up
+ * epoll, so only a waiting datagram counts as activity. In busy poll mode
+ * the set is checked without sleeping for a while first
+ * @param timeout_ms: longest time to wait for a packet
+ * Returns 1 if there is activity on socket
+ * Returns 0 if time runs out
+ */
+int rdp_listen(struct rdp_ctx *ctx, int fd, int timeout_ms) {
+    struct epoll_event ev;
+
+    if(ctx -> listen_fd != fd) {
+        rdp_epoll_set(ctx, fd, EPOLLIN);
+        sockbuf_enable(&ctx -> sockbuf, fd);
+        rdp_enable_timestamps(fd);
+        if(ctx -> busy_poll_us > 0) {
+            busypoll_enable(fd, ctx -> busy_poll_us);
+        }
+        ctx -> listen_fd = fd;
+    }
+    rdp_autotune(ctx, fd);
+
+    /* Listen for packets from clients, a signal only ends the wait early */
+    int rc = busypoll_spin(ctx -> busy_poll_us, &timeout_ms, rdp_epoll_ready, ctx);
+    if(rc == 0) {
+        rc = epoll_wait(ctx -> epfd, &ev, 1, timeout_ms);
+    }
+    if(rc == -1 && errno == EINTR) {
+        return 0;
+    }
+    check_error(rc, "epoll_wait");
+
+    /* If a packet is received */
+    if(rc == 1) {
+        char c;
+        zerocopy_reap(&ctx -> zc, fd);
+        if(recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1) {
+            return 0;
+        }
+        return 1;
+    }
+
+    /* If noe activity on socket*/
+    return 0;
+}
+
+
+
+
+/**
+ * Time to wait for an ack after a packet has been sent tries times
+ * @param rto: retransmission timeout of the connection in ms
+ */
+static long long rdp_backoff(int rto, int tries) {
+    if(tries <= 0) {
+        return 0;
+    }
+    return (long long) rto << (tries - 1 < RDP_BACKOFF_MAX ? tries - 1 : RDP_BACKOFF_MAX);
+}
+
+
+
+/**
+ * When a chunk in flight is to be sent again if it is not acked
+ */
+static long long rdp_chunk_due(struct connection *cnt, int64_t chunk) {
+    return cnt -> sent_ms[chunk % RDP_MAX_WINDOW] + rdp_backoff(cnt -> rto, cnt -> tries[chunk % RDP_MAX_WINDOW]);
+}
+
+
+
+/**
+ * When the EOF is to be sent (again), right away if it has not been sent
+ */
+static long long rdp_eof_due(struct connection *cnt) {
+    return cnt -> eof_ms + rdp_backoff(cnt -> rto, cnt -> eof_tries);
+}
+
+
+
+
+/**
+ * Check if the client has closed its receive window with nothing in flight,
+ * so no ack is coming that could open it again
+ */
+static int rdp_window_closed(struct connection *cnt) {
+    return cnt -> rwnd == 0 && cnt -> next_chunk == cnt -> file_status && cnt -> file_status < cnt -> chunks;
+}
+
+
+
+/**
+ * When the next zero window probe is to be sent
+ * The first goes one retransmission timeout after the last packet, later
+ * ones back off like retries, but never wait longer than a keepalive
+ */
+static long long rdp_probe_due(struct connection *cnt) {
+    long long wait = rdp_backoff(cnt -> rto, cnt -> probe_tries + 1);
+    return cnt -> last_sent_ms + (wait < RDP_KEEPALIVE ? wait : RDP_KEEPALIVE);
+}
+
+
+
+
+/**
+ * When a connection next needs attention: a chunk, the EOF or a zero window
+ * probe is due to be sent, a keepalive is due, or the peer is to be given up on
+ * The first chunk in flight not acked is not always the first one due, as
+ * retries back off, so every chunk in flight is looked at
+ */
+static long long rdp_deadline(struct connection *cnt) {
+    long long heard = cnt -> last_heard_ms;
+    long long quiet = cnt -> last_sent_ms > heard ? cnt -> last_sent_ms : heard;
+    long long due = heard + RDP_IDLE_TIMEOUT + 1;
+
+    if(quiet + RDP_KEEPALIVE < due) {
+        due = quiet + RDP_KEEPALIVE;
+    }
+    if(cnt -> file_status >= cnt -> chunks) {
+        return rdp_eof_due(cnt) < due ? rdp_eof_due(cnt) : due;
+    }
+    if(rdp_window_closed(cnt)) {
+        return rdp_probe_due(cnt) < due ? rdp_probe_due(cnt) : due;
+    }
+    for(int64_t chunk = cnt -> file_status; chunk < cnt -> next_chunk; chunk++) {
+        if(!(cnt -> acked & (1ULL << (chunk - cnt -> file_status)))
+           && rdp_chunk_due(cnt, chunk) < due) {
+            due = rdp_chunk_due(cnt, chunk);
+        }
+    }
+    return due;
+}
+
+
+
+
+/**
+ * Arm the timer of a connection for when it next needs attention
+ * Called whenever that may have moved earlier: a chunk or EOF was sent, or
+ * the last chunk was acked so the EOF is due. A timer that fires before
+ * anything is due does no harm, the connection is looked at and armed again
+ * @param cnt: active connection
+ */
+void rdp_timer_update(struct rdp_ctx *ctx, struct connection *cnt) {
+    timer_arm(&ctx -> timers, &cnt -> timer, rdp_deadline(cnt));
+}
+
+
+
+
+/**
+ * Context of rdp_timer_fired
+ */
+struct rdp_expiry {
+    struct rdp_ctx *ctx;
+    int (*fire)(struct connection *cnt, void *arg);
+    void *arg;
+};
+
+/**
+ * Timer callback, hands the connection to the caller of rdp_expire_timers
+ * and arms its timer again unless the connection is gone
+ */
+static void rdp_timer_fired(struct timer *t, void *arg) {
+    struct rdp_expiry *e = arg;
+    struct connection *cnt = t -> data;
+
+    if(e -> fire(cnt, e -> arg) == 0) {
+        rdp_timer_update(e -> ctx, cnt);
+    }
+}
+
+
+
+
+/**
+ * Hand every connection whose timer is due to fire
+ * @param fire: called with each connection, returns -1 if it removed the
+ *              connection, otherwise 0 and the timer is armed again
+ * @param arg: passed on to fire
+ * Returns number of connections handed to fire
+ */
+int rdp_expire_timers(struct rdp_ctx *ctx, int (*fire)(struct connection *cnt, void *arg), void *arg) {
+    struct rdp_expiry e = { ctx, fire, arg };
+    return timer_wheel_expire(&ctx -> timers, rdp_now(), rdp_timer_fired, &e);
+}
+
+
+
+
+/**
+ * How long the server may wait in rdp_listen before a timer is due
+ * Returns 0 if a timer is due now, otherwise the time until the first one
+ * is due, at most RDP_POLL_MAX ms. Open send windows are left to the caller
+ */
+int rdp_poll_timeout(struct rdp_ctx *ctx) {
+    long long now = rdp_now();
+    long long due = timer_wheel_next(&ctx -> timers);
+
+    if(due == -1 || due > now + RDP_POLL_MAX) {
+        return RDP_POLL_MAX;
+    }
+    return due <= now ? 0 : (int) (due - now);
+}
+
+
+
+
+/**
+ * Connection a packet without ids comes from, found by its address
+ * Any packet shows that the peer is alive
+ */
+static struct connection *rdp_peer(struct rdp_ctx *ctx, struct sockaddr_in *addr) {
+    struct connection *cnt = find_connection_by_address(ctx, *addr);
+    if(cnt != NULL) {
+        cnt -> last_heard_ms = rdp_now();
+    }
+    return cnt;
+}
+
+
+
+/**
+ * Take the timestamps of an ack: an RTT sample for the retransmission
+ * timeout of the connection, and the timestamp to echo in the next data packet
+ * Every data packet has a timestamp of its own, so a retry gives a sample
+ * as good as the first send. The timeout is the smoothed RTT plus four times
+ * its variation, as in TCP
+ * @param pk: ack from the peer of cnt
+ */
+static void rdp_ack_tstamp(struct rdp_ctx *ctx, struct connection *cnt, struct rdp_packet *pk) {
+    if(!(pk -> unnassigned & RDP_OPT_TSTAMP)) {
+        return;
+    }
+    uint32_t stamp = ctx -> batch.last_stamp;
+    cnt -> ts_recent = pk -> tsval;
+    cnt -> ts_recent_rx = stamp;
+
+    long rtt = rdp_latency_sample(&ctx -> stats.latency, pk, stamp);
+    if(rtt < 0) {
+        return;
+    }
+    if(cnt -> srtt_us == 0) {
+        cnt -> srtt_us = rtt;
+        cnt -> rttvar_us = rtt / 2;
+    } else {
+        long err = rtt > cnt -> srtt_us ? rtt - cnt -> srtt_us : cnt -> srtt_us - rtt;
+        cnt -> rttvar_us += (err - cnt -> rttvar_us) / 4;
+        cnt -> srtt_us += (rtt - cnt -> srtt_us) / 8;
+    }
+
+    long rto = (cnt -> srtt_us + 4 * cnt -> rttvar_us + 999) / 1000;
+    cnt -> rto = rto < RDP_RTO_MIN ? RDP_RTO_MIN : rto > RDP_RTO_MAX ? RDP_RTO_MAX : (int) rto;
+}
+
+
+
+/**
+ * Take the receive window a client advertises in an ack or keepalive
+ * A client that does not send one is only held back by the send window
+ * A negative window is taken as closed, so the connection is probed
+ * @param pk: ack or keepalive from the peer of cnt
+ */
+static void rdp_ack_window(struct connection *cnt, struct rdp_packet *pk) {
+    if(!(pk -> unnassigned & RDP_OPT_WINDOW)) {
+        return;
+    }
+    cnt -> rwnd = pk -> metadata < 0 ? 0 : pk -> metadata < RDP_MAX_WINDOW ? (int) pk -> metadata : RDP_MAX_WINDOW;
+    if(cnt -> rwnd > 0) {
+        cnt -> probe_tries = 0;
+    }
+}
+
+
+
+/**
+ * Handlers for the packet types a server receives, see rdp_receive
+ * Each sets cnt to the connection the packet belongs to and returns an RDP_EVENT_
+ */
+static int rdp_on_connect(struct rdp_ctx *ctx, int fd, struct rdp_packet *pk, struct sockaddr_in *addr, struct connection **cnt) {
+
+    /* The client sent its request again, the accept was lost */
+    *cnt = find_rdp_connection(ctx, *addr, pk -> senderid);
+    if(*cnt != NULL) {
+        (*cnt) -> last_heard_ms = rdp_now();
+        return RDP_EVENT_RECONNECT;
+    }
+
+    *cnt = rdp_accept(ctx, fd, pk, addr);
+    return *cnt != NULL ? RDP_EVENT_CONNECT : RDP_EVENT_IGNORED;
+}
+
+static int rdp_on_close(struct rdp_ctx *ctx, int fd, struct rdp_packet *pk, struct sockaddr_in *addr, struct connection **cnt) {
+    (void) fd; (void) pk;
+    *cnt = rdp_peer(ctx, addr);
+    return *cnt != NULL ? RDP_EVENT_CLOSE : RDP_EVENT_IGNORED;
+}
+
+static int rdp_on_ack(struct rdp_ctx *ctx, int fd, struct rdp_packet *pk, struct sockaddr_in *addr, struct connection **cnt) {
+    (void) fd;
+    *cnt = rdp_peer(ctx, addr);
+    if(*cnt == NULL) {
+        return RDP_EVENT_IGNORED;
+    }
+    rdp_ack_tstamp(ctx, *cnt, pk);
+    rdp_ack_chunk(*cnt, pk -> ackseq);
+    rdp_ack_window(*cnt, pk);
+    if((*cnt) -> file_status >= (*cnt) -> chunks || rdp_window_closed(*cnt)) {
+        rdp_timer_update(ctx, *cnt);
+    }
+    return RDP_EVENT_ACK;
+}
+
+static int rdp_on_keepalive(struct rdp_ctx *ctx, int fd, struct rdp_packet *pk, struct sockaddr_in *addr, struct connection **cnt) {
+    (void) fd;
+    *cnt = rdp_peer(ctx, addr);
+    if(*cnt == NULL) {
+        return RDP_EVENT_IGNORED;
+    }
+    rdp_ack_window(*cnt, pk);
+    return RDP_EVENT_KEEPALIVE;
+}
+
+typedef int (*rdp_handler)(struct rdp_ctx *ctx, int fd, struct rdp_packet *pk, struct sockaddr_in *addr, struct connection **cnt);
+
+// Indexed by rdp_packet_type, packets a server does not expect have no handler
+static const rdp_handler rdp_handlers[8] = {
+    [0] = rdp_on_connect,       /* 0x01 */
+    [1] = rdp_on_close,         /* 0x02 */
+    [3] = rdp_on_ack,           /* 0x08 */
+    [7] = rdp_on_keepalive,     /* 0x80 */
+};
+
+
+
+/**
+ * Receive one packet without blocking and tell the server what happened
+ * Packets are read RDP_RECV_BATCH at a time with recvmmsg and their headers
+ * validated together, then handed out one per call
+ * Connection requests are handled by rdp_accept, acks slide the send window
+ * of the connection they come from, and a connection ending closes it
+ * Acks, keepalive answers and connection endings carry no ids, so the
+ * connection is found by address. Any of them shows that the peer is alive
+ * @param fd: socket for receiving messages from clients
+ * @param cnt: set to the connection the packet belongs to
+ * Returns RDP_EVENT_NONE if no packet is waiting, otherwise the RDP_EVENT_ of the packet
+ */
+int rdp_receive(struct rdp_ctx *ctx, int fd, struct connection **cnt) {
+    struct sockaddr_in addr;
+    struct rdp_packet *pk;
+
+    *cnt = NULL;
+    while((pk = rdp_batch_next(&ctx -> batch, &addr)) == NULL) {
+        if(rdp_batch_recv(&ctx -> batch, fd) == -1) {
+            return RDP_EVENT_NONE;
+        }
+    }
+
+    ctx -> stats.received++;
+    int event = RDP_EVENT_IGNORED;
+    rdp_handler handler = rdp_handlers[rdp_packet_type(pk -> flag)];
+    if(handler != NULL) {
+        event = handler(ctx, fd, pk, &addr, cnt);
+    }
+
+    free(pk);
+    return event;
+}
+
+
+
+
+/**
+ * Check if two connections are parts of the same download
+ * Group ids are picked by clients, so they only count from the same host
+ */
+static int same_group(struct connection *a, struct connection *b) {
+    return a -> group != 0 && a -> group == b -> group
+           && a -> client_addr.sin_addr.s_addr == b -> client_addr.sin_addr.s_addr;
+}
+
+
+
+/**
+ * Number of active connections that are cnt or parts of the same download
+ */
+static int group_active(struct rdp_ctx *ctx, struct connection *cnt) {
+    int count = 0;
+    for(int i = 0; i < ctx -> n; i++) {
+        struct connection *other = ctx -> connections[i];
+        if(other != NULL && (other == cnt || same_group(other, cnt))) {
+            count++;
+        }
+    }
+    return count;
+}
 
-    /* Wait for confirmation of established connection */
-    ssize_t rc = rdp_confirmation(fd, &dest_addr);
-    return rc;
+
+
+/**
+ * Number of queued connections that are parts of the same download as cnt
+ */
+static int group_queued(struct rdp_ctx *ctx, struct connection *cnt) {
+    int count = 0;
+    for(int i = 0; i < ctx -> queue_len; i++) {
+        if(same_group(ctx -> queue[i], cnt)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+
+
+/**
+ * Check if the connection list has no room for another connection
+ */
+static int table_full(struct rdp_ctx *ctx) {
+    for(int i = 0; i < ctx -> n; i++) {
+        if(ctx -> connections[i] == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+
+/**
+ * Limit a new connection to the range it asked for
+ * @param cnt: connection made for the request, starting at the first chunk
+ * @param range: range from the connect packet
+ */
+static void set_range(struct rdp_ctx *ctx, struct connection *cnt, struct rdp_range *range) {
+    int64_t end = range -> end <= 0 || range -> end > ctx -> total_chunks ? ctx -> total_chunks : range -> end;
+
+    cnt -> stride = range -> stride < 1 ? 1 : range -> stride;
+    cnt -> group = range -> group;
+    cnt -> chunks = cnt -> start_chunk >= end ? 0 : (end - cnt -> start_chunk + cnt -> stride - 1) / cnt -> stride;
 }
 
 
 
 
 /**
- * Rdp_confirmation function  used as help method in rdp_accept
- * Wait for confirmation by server and check that packet received is valid
- * @param fd: socket used for receiving packets from server
- * @param server_addr: address of server
- * If packet is received successfuly it will check that flag in packet
- * If flag == 20 than connection request has been declined
- * If flag == 0x10 than server has accepted connection request
+ * One SipHash round
+ */
+static void sip_round(uint64_t v[4]) {
+    v[0] += v[1]; v[1] = v[1] << 13 | v[1] >> 51; v[1] ^= v[0]; v[0] = v[0] << 32 | v[0] >> 32;
+    v[2] += v[3]; v[3] = v[3] << 16 | v[3] >> 48; v[3] ^= v[2];
+    v[0] += v[3]; v[3] = v[3] << 21 | v[3] >> 43; v[3] ^= v[0];
+    v[2] += v[1]; v[1] = v[1] << 17 | v[1] >> 47; v[1] ^= v[2]; v[2] = v[2] << 32 | v[2] >> 32;
+}
+
+
+
+/**
+ * SipHash-2-4 of a message with the secret key of the endpoint
+ * Without the key nobody can tell what the hash of a message will be, so
+ * cookies can not be forged and connection ids not guessed
+ * @param m: message
+ * @param len: length of message
  */
-ssize_t rdp_confirmation(int fd, struct sockaddr_in *server_addr) {
-    char buf[BUFSIZE];
+static uint64_t rdp_siphash(struct rdp_ctx *ctx, const unsigned char *m, int len) {
+    uint64_t v[4] = {
+        0x736f6d6570736575ULL ^ ctx -> key[0],
+        0x646f72616e646f6dULL ^ ctx -> key[1],
+        0x6c7967656e657261ULL ^ ctx -> key[0],
+        0x7465646279746573ULL ^ ctx -> key[1],
+    };
+    uint64_t last = (uint64_t) len << 56;
+    int full = len & ~7;
+
+    for(int i = 0; i < full; i += 8) {
+        uint64_t w = 0;
+        for(int j = 7; j >= 0; j--) {
+            w = w << 8 | m[i + j];
+        }
+        v[3] ^= w;
+        sip_round(v);
+        sip_round(v);
+        v[0] ^= w;
+    }
+    for(int j = 0; j < len - full; j++) {
+        last |= (uint64_t) m[full + j] << (8 * j);
+    }
+    v[3] ^= last;
+    sip_round(v);
+    sip_round(v);
+    v[0] ^= last;
+    v[2] ^= 0xff;
+    for(int r = 0; r < 4; r++) {
+        sip_round(v);
+    }
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
 
-    /* Set a timout to 1 second for receiving confirmation */
-    struct timeval timeout = { 1, 0 };
-    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,(char*)&timeout,sizeof(struct timeval));
 
-    /* Try to receive packet from server */
-    socklen_t addr_len = sizeof(struct sockaddr_in);
-    ssize_t rc = recvfrom(fd, buf, BUFSIZE-1, 0 , (struct sockaddr*) server_addr, &addr_len);
 
-    /* If there is no response from server within 1 second */
-    if (rc < 0) {
-        printf("No response from server. Please try again!\n");
-        return rc;
+/**
+ * Make a connection id, never 0 and not to be guessed from earlier ones
+ */
+static uint64_t rdp_new_id(struct rdp_ctx *ctx) {
+    unsigned char m[8];
+    uint64_t id;
+
+    do {
+        for(int i = 0; i < 8; i++) {
+            m[i] = ctx -> id_counter >> (8 * i);
+        }
+        ctx -> id_counter++;
+        id = rdp_siphash(ctx, m, sizeof(m));
+    } while(id == 0);
+    return id;
+}
+
+
+
+/**
+ * Cookie for a client: a hash of its address, its client id and the period
+ * of RDP_COOKIE_PERIOD ms, so the server can check it without keeping anything
+ * @param addr: address of client
+ * @param client_id: id from the connection request
+ * @param back: 0 for the current period, 1 for the one before
+ */
+static uint64_t rdp_cookie(struct rdp_ctx *ctx, struct sockaddr_in *addr, int client_id, int back) {
+    uint32_t period = rdp_now() / RDP_COOKIE_PERIOD - back;
+    uint32_t ip = ntohl(addr -> sin_addr.s_addr);
+    uint16_t port = ntohs(addr -> sin_port);
+    uint32_t id = client_id;
+    unsigned char m[14];
+
+    for(int i = 0; i < 4; i++) {
+        m[i] = ip >> (8 * i);
+        m[6 + i] = id >> (8 * i);
+        m[10 + i] = period >> (8 * i);
+    }
+    m[4] = port;
+    m[5] = port >> 8;
+    return rdp_siphash(ctx, m, sizeof(m));
+}
+
+
+
+/**
+ * Check if a new connection request may be taken
+ * It may if it carries a cookie from this period or the one before, or
+ * if it is one of the first RDP_COOKIE_RATE requests without one this second
+ * @param pk: connection request
+ * @param addr: address it came from
+ */
+static int rdp_cookie_valid(struct rdp_ctx *ctx, struct rdp_packet *pk, struct sockaddr_in *addr) {
+    if(pk -> unnassigned & RDP_OPT_COOKIE) {
+        return pk -> cookie == rdp_cookie(ctx, addr, pk -> senderid, 0)
+               || pk -> cookie == rdp_cookie(ctx, addr, pk -> senderid, 1);
+    }
+
+    long long second = rdp_now() / 1000;
+    if(second != ctx -> cookie_second) {
+        ctx -> cookie_second = second;
+        ctx -> cookie_count = 0;
+    }
+    return ++ctx -> cookie_count <= ctx -> cookie_rate;
+}
+
+
+
+
+/**
+ * @param fd: socket for sending answers to clients
+ * @param pk: connection request received by rdp_receive, freed by the caller
+ * @param client_addr: pointer to client address
+ * Create a connection for a new connection request, see rdp_on_connect for
+ * requests sent again by connected clients
+ * The caller sends the accept packet with rdp_send_accept, so it can carry data
+ * When more requests come in than RDP_COOKIE_RATE per second, a request without
+ * a valid cookie is answered with one and nothing is allocated. Only a client
+ * that gets packets at its address can send the cookie back
+ * If all connection slots are in use the client is put in the admission queue
+ * and told how long it can expect to wait. Only a full queue gives a reject
+ * Connections for parts of the same download share one slot and count as one file
+ */
+struct connection *rdp_accept(struct rdp_ctx *ctx, int fd, struct rdp_packet *pk, struct sockaddr_in *client_addr) {
+
+    /* Client is already queued, tell it again how long to wait */
+    int position = find_queued_connection(ctx, *client_addr, pk -> senderid);
+    if(position != -1) {
+        ssize_t wc = rdp_send_wait(fd, *client_addr, pk -> senderid, estimate_wait(ctx, position));
+        check_error(wc, "rdp_send_wait");
+        return NULL;
+    }
+
+    /* Nothing is allocated for a client that has not proved its address */
+    if(!rdp_cookie_valid(ctx, pk, client_addr)) {
+        ssize_t wc = rdp_send_cookie(fd, *client_addr, pk -> senderid, rdp_cookie(ctx, client_addr, pk -> senderid, 0));
+        check_error(wc, "rdp_send_cookie");
+        return NULL;
+    }
+
+    /* Metadata holds the first chunk the client wants, and a range the rest
+     * A resumed transfer can not start past the end of file */
+    int64_t start_chunk = pk -> metadata < 0 ? 0 : pk -> metadata;
+    if(start_chunk > ctx -> total_chunks) {
+        start_chunk = ctx -> total_chunks;
+    }
+    struct connection *connection = get_connection(ctx, pk -> senderid, rdp_new_id(ctx), *client_addr, start_chunk);
+    connection -> options = pk -> unnassigned;
+    if(pk -> unnassigned & RDP_OPT_RANGE) {
+        set_range(ctx, connection, (struct rdp_range *) pk -> payload);
+    }
+
+    /* Other parts of the same download may already have a slot, or wait for one */
+    int joins = group_active(ctx, connection) > 0;
+    int waits = !joins && group_queued(ctx, connection) > 0;
+    int reason = 0;
+
+    /* The file can not be served any longer */
+    if(ctx -> closed_reason != 0) {
+        reason = ctx -> closed_reason;
+    }
+
+    /* A live stream has no known end to split it by */
+    else if((connection -> options & RDP_OPT_RANGE) && ctx -> total_chunks == RDP_CHUNKS_UNKNOWN) {
+        reason = 4;
+    }
+
+    /* Check that not maximum number of files have been written, a download counts once */
+    else if(!joins && !waits && ctx -> n_counter >= ctx -> max_files) {
+        reason = 2;
+    }
+
+    /* Free connection slot, or a slot the download already has */
+    else if(joins || (!waits && count_rdp_connections(ctx) < ctx -> max_active)) {
+        if(table_full(ctx)) {
+            reason = 3;
+        } else {
+            printf("CONNECTED %d %016llx\n", connection -> client_id, (unsigned long long) connection -> server_id);
+            if(!joins) {
+                ctx -> n_counter++;
+            }
+            return connection;
+        }
+    }
+
+    /* All slots in use, wait in queue */
+    else if(ctx -> queue_len < ctx -> queue_max) {
+        ctx -> queue[ctx -> queue_len++] = connection;
+        if(!waits) {
+            ctx -> n_counter++;
+        }
+        ssize_t wc = rdp_send_wait(fd, *client_addr, connection -> client_id, estimate_wait(ctx, ctx -> queue_len - 1));
+        check_error(wc, "rdp_send_wait");
+        return NULL;
+    }
+
+    /* Queue is full */
+    else {
+        reason = 3;
+    }
+
+    ssize_t wc = rdp_send_reject(fd, *client_addr, connection -> client_id, reason);
+    check_error(wc, "rdp_send_reject");
+    free_connection(connection);
+    return NULL;
+}
+
+
+
+
+/**
+ * Function for sending accept packet to clients
+ * The function makes an accept packet with flag 0x10 and send to client
+ * The accept can carry the first chunk of the file, so the client gets data
+ * after one round trip
+ * @param cnt: connection returned by rdp_accept
+ * @param seq: sequence number of the chunk, see rdp_chunk_seq
+ * @param payload: first chunk to send, or NULL
+ * @param len: size of payload
+ * @param options: RDP_OPT_COMPRESS if payload is compressed
+ */
+ssize_t rdp_send_accept(int fd, struct connection *cnt, unsigned char seq, char *payload, int len, unsigned char options) {
+
+    /* Makes a rdp_packet with flag 0x10 which accept request from client */
+    struct rdp_packet *pkt = make_rdp_packet(0x10, seq, 0, options, cnt -> client_id, cnt -> server_id, len, payload);
+    unsigned int size;
+
+    /* Convert packet for sending */
+    char* convert = get_packet(pkt, &size);
+
+    /* Send packet to client */
+    struct sockaddr_in dest_addr = cnt -> client_addr;
+    ssize_t wc = send_packet(fd, convert, size, 0, (struct sockaddr*) &dest_addr, sizeof(dest_addr));
+
+    /* Free used packets */
+    free(pkt);
+    free(convert);
+
+    /* Return write count from send_packet */
+    return wc;
+}
+
+
+
+
+/**
+ * Function rdp_send_wait for telling a queued client to wait
+ * Help method in rdp protocol called by rdp_accept
+ * Uses flag 0x40, the client keeps waiting for the accept packet
+ * @param id: id of queued client
+ * @param wait_ms: estimated time until the client gets a connection slot
+ */
+ssize_t rdp_send_wait(int fd, struct sockaddr_in addr, int id, int wait_ms) {
+    ssize_t wc;
+
+    /* Make rdp_packet with flag 0x40 and the estimated wait in metadata */
+    struct rdp_packet *pkt = make_rdp_packet(0x40, 0, 0, 0, 0, id, wait_ms, NULL);
+
+    /* Convert packet for sending */
+    unsigned int size;
+    char* convert = get_packet(pkt, &size);
+
+    /* Send wait packet to client */
+    wc = send_packet(fd, convert, size, 0, (struct sockaddr*)&addr, sizeof(addr));
+    check_error(wc, "send_packet");
+
+    /* Free used packets */
+    free(pkt);
+    free(convert);
+
+    /* Return write count from send_packet*/
+    return wc;
+}
+
+
+
+
+/**
+ * Function rdp_send_cookie for asking a client to prove its address
+ * Help method in rdp protocol called by rdp_accept
+ * Uses flag 0x40 with RDP_OPT_COOKIE and no wait, the client sends its
+ * connection request again right away with the cookie
+ * @param id: id of client
+ * @param cookie: cookie for the client, see rdp_cookie
+ */
+ssize_t rdp_send_cookie(int fd, struct sockaddr_in addr, int id, uint64_t cookie) {
+    ssize_t wc;
+
+    /* Make rdp_packet with flag 0x40 carrying the cookie */
+    struct rdp_packet *pkt = make_rdp_packet(0x40, 0, 0, RDP_OPT_COOKIE, 0, id, 0, NULL);
+    pkt -> cookie = cookie;
+
+    /* Convert packet for sending */
+    unsigned int size;
+    char* convert = get_packet(pkt, &size);
+
+    /* Send cookie to client */
+    wc = send_packet(fd, convert, size, 0, (struct sockaddr*)&addr, sizeof(addr));
+
+    /* Free used packets */
+    free(pkt);
+    free(convert);
+
+    /* Return write count from send_packet*/
+    return wc;
+}
+
+
+
+
+/**
+ * Function rdp_send_reject for rejection connection request
+ * Help method in rdp protocol called by rdp_accept
+ * Uses flag 0x20 which tells client request has been rejected
+ * @param id: id of client sending rejection
+ * @param meta: number representing the reason for rejecting request
+ */
+ssize_t rdp_send_reject(int fd, struct sockaddr_in addr, int id, int meta) {
+    ssize_t wc;
+    int client_id = id;
+
+    /* Make rdp_packet with flag 0x20 which reject connection request*/
+    struct rdp_packet *pkt = make_rdp_packet(0x20, 0, 0, 0, 0, client_id, meta, NULL);
+
+    /* Convert packet for sending */
+    unsigned int size;
+    char* convert = get_packet(pkt, &size);
+
+    /* Send rejection packet to client */
+    wc = send_packet(fd, convert, size, 0, (struct sockaddr*)&addr, sizeof(addr));
+    check_error(wc, "send_packet");
+
+    /* Free used packets */
+    free(pkt);
+    free(convert);
+
+    /* Return write count from send_packet*/
+    return wc;
+}
+
+
+
+
+/**
+ * Creates a rdp_connection and returns it
+ * @param client_id: id the client picked for the connection
+ * @param server_id: id from rdp_new_id
+ * @param client_addr: destination address for client
+ * @param start_chunk: first chunk of the file to send, 0 unless resuming
+ * The connection sends the rest of the file, see rdp_accept for ranges
+ */
+struct connection *get_connection(struct rdp_ctx *ctx, int client_id, uint64_t server_id, struct sockaddr_in client_addr, int64_t start_chunk) {
+
+    /* Allocate memory for a connection */
+    struct connection * cnt = malloc(sizeof(struct connection));
+
+    /* Check that connection was successfull */
+    if (cnt == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in get_connection()\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Assign arguments to variables in struct */
+    cnt -> client_id = client_id;
+    cnt -> server_id = server_id;
+    cnt -> file_status = 0;
+    cnt -> next_chunk = 0;
+    cnt -> window = ctx -> send_window;
+    cnt -> acked = 0;
+    cnt -> eof_ms = 0;
+    cnt -> eof_tries = 0;
+    cnt -> start_ms = rdp_now();
+    cnt -> last_heard_ms = cnt -> start_ms;
+    cnt -> last_sent_ms = cnt -> start_ms;
+    cnt -> start_chunk = start_chunk;
+    cnt -> stride = 1;
+    cnt -> chunks = ctx -> total_chunks - start_chunk;
+    cnt -> group = 0;
+    cnt -> priority = 0;
+    cnt -> weight = 1;
+    cnt -> deficit = 0;
+    cnt -> bucket.tokens = 0;
+    cnt -> bucket.last_ms = 0;
+    cnt -> rate_prefix = -1;
+    cnt -> options = 0;
+    cnt -> client_addr = client_addr;
+    cnt -> digest = 0;
+    cnt -> end_reason = 0;
+    cnt -> ts_recent = 0;
+    cnt -> ts_recent_rx = 0;
+    cnt -> srtt_us = 0;
+    cnt -> rttvar_us = 0;
+    cnt -> rto = RDP_RTO;
+    cnt -> rwnd = RDP_MAX_WINDOW;
+    cnt -> probe_tries = 0;
+    timer_init(&cnt -> timer, cnt);
+
+    /* Return connection */
+    return cnt;
+}
+
+
+
+
+/**
+ * Chunk of the file that is chunk number chunk of a connection
+ */
+int64_t rdp_file_chunk(struct connection *cnt, int64_t chunk) {
+    return cnt -> start_chunk + chunk * cnt -> stride;
+}
+
+
+
+
+/**
+ * Number of active connections of the download a connection is part of
+ * Returns 1 for a connection that is not part of a larger download
+ */
+int rdp_group_size(struct rdp_ctx *ctx, struct connection *cnt) {
+    return group_active(ctx, cnt);
+}
+
+
+
+
+/**
+ * Find connection with client id from a client address
+ * Client ids are picked by clients, so they only tell connections from the same address apart
+ * Returns NULL if client is not connected
+ */
+struct connection *find_rdp_connection(struct rdp_ctx *ctx, struct sockaddr_in addr, int client_id){
+    for(int i = 0; i < ctx -> n; i++){
+        if(ctx -> connections[i] != NULL){
+            if(ctx -> connections[i] -> client_id == client_id && same_address(ctx -> connections[i] -> client_addr, addr)){
+              return ctx -> connections[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+
+
+
+/**
+ * Find connection with client address
+ * Returns NULL if no client is connected from the address
+ */
+struct connection *find_connection_by_address(struct rdp_ctx *ctx, struct sockaddr_in addr) {
+    for(int i = 0; i < ctx -> n; i++) {
+        if(ctx -> connections[i] != NULL && same_address(ctx -> connections[i] -> client_addr, addr)) {
+            return ctx -> connections[i];
+        }
+    }
+    return NULL;
+}
+
+
+
+
+/**
+ * Set the send window of new connections
+ * @param window: chunks in flight per connection, at most half of RDP_MAX_WINDOW
+ */
+void rdp_set_window(struct rdp_ctx *ctx, int window) {
+    if(window < 1) {
+        window = 1;
+    }
+    if(window > RDP_MAX_WINDOW / 2) {
+        window = RDP_MAX_WINDOW / 2;
+    }
+    ctx -> send_window = window;
+}
+
+
+
+
+/**
+ * Set the number of chunks in the file once it is known, for a live stream
+ * when its source ends. Connections are cut short to it and their timers
+ * updated, so the EOF goes out to those that have everything
+ * @param chunks: number of chunks in the file
+ */
+void rdp_set_total_chunks(struct rdp_ctx *ctx, int64_t chunks) {
+    ctx -> total_chunks = chunks;
+
+    for(int i = 0; i < ctx -> n + ctx -> queue_len; i++) {
+        struct connection *cnt = i < ctx -> n ? ctx -> connections[i] : ctx -> queue[i - ctx -> n];
+        if(cnt == NULL) {
+            continue;
+        }
+        int64_t left = cnt -> start_chunk >= chunks ? 0 : (chunks - cnt -> start_chunk + cnt -> stride - 1) / cnt -> stride;
+        if(left < cnt -> chunks) {
+            cnt -> chunks = left;
+        }
+        if(i < ctx -> n) {
+            rdp_timer_update(ctx, cnt);
+        }
+    }
+}
+
+
+
+
+/**
+ * Make rdp_listen spin before it sleeps, for lower latency at the cost of a busy core
+ * @param budget_us: time to spin in microseconds, 0 to sleep right away
+ */
+void rdp_set_busy_poll(struct rdp_ctx *ctx, int budget_us) {
+    if(budget_us > BUSYPOLL_MAX_US) {
+        budget_us = BUSYPOLL_MAX_US;
+    }
+    ctx -> busy_poll_us = budget_us < 0 ? 0 : budget_us;
+}
+
+
+
+
+/**
+ * Set how many new connection requests without a cookie are taken per second
+ * @param rate: requests per second, 0 to ask every new client for a cookie
+ */
+void rdp_set_cookie_rate(struct rdp_ctx *ctx, int rate) {
+    ctx -> cookie_rate = rate < 0 ? 0 : rate;
+}
+
+
+
+
+/**
+ * Check if two addresses are the same ip and port
+ */
+int same_address(struct sockaddr_in a, struct sockaddr_in b) {
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+
+
+
+/**
+ * Count connections in use
+ */
+int count_rdp_connections(struct rdp_ctx *ctx) {
+    int count = 0;
+    for(int i = 0; i < ctx -> n; i++) {
+        struct connection *cnt = ctx -> connections[i];
+        if(cnt == NULL) {
+            continue;
+        }
+
+        /* Parts of a download are counted at the first of them */
+        int first = 1;
+        for(int j = 0; j < i && first; j++) {
+            if(ctx -> connections[j] != NULL && same_group(ctx -> connections[j], cnt)) {
+                first = 0;
+            }
+        }
+        count += first;
+    }
+    return count;
+}
+
+
+
+
+/**
+ * Make a new RDP endpoint
+ * Allocate memory for n downloads, each of them split over up to
+ * RDP_MAX_STREAMS connections, and initialize each connection with NULL pointer
+ * All other state starts empty: no admission queue, no scheduler rules,
+ * no rate limits and zerocopy turned off
+ * @param max_connections: max number of connections, also number of files to send
+ * Returns the endpoint, free it with rdp_ctx_free
+ */
+struct rdp_ctx *rdp_ctx_new(int max_connections) {
+    struct rdp_ctx *ctx = calloc(1, sizeof(struct rdp_ctx));
+    int slots = (max_connections > 0 ? max_connections : 1) * RDP_MAX_STREAMS;
+    if(ctx != NULL) {
+        ctx -> connections = calloc(slots, sizeof(struct connection *));
+    }
+    if(ctx == NULL || ctx -> connections == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in rdp_ctx_new()\n");
+        exit(EXIT_FAILURE);
     }
 
-    /* Try to open packet an check that flag is valid
-     * It will first check each bit in flag-byte and that there is a maximum of 1 digit equal 1 */
-    struct rdp_packet *pkt = open_rdp_packet(buf, rc);
-    int flag_check = check_bits_flag(&pkt -> flag, sizeof(char));
-    if(flag_check == -1){
-        printf("Received unavailable flag in rdp_connect(). Program exit!\n");
-        free(pkt);
-        return -1;
+    ctx -> n = slots;
+    ctx -> max_files = max_connections;
+    ctx -> send_window = RDP_WINDOW;
+    ctx -> max_active = max_connections;
+    scheduler_init(&ctx -> sched);
+    ratelimit_init(&ctx -> limits);
+    zerocopy_init(&ctx -> zc);
+    sockbuf_init(&ctx -> sockbuf);
+    rdp_latency_init(&ctx -> stats.latency);
+    timer_wheel_init(&ctx -> timers, rdp_now());
+    ctx -> epfd = -1;
+    ctx -> listen_fd = -1;
+    ctx -> cookie_rate = RDP_COOKIE_RATE;
+
+    /* Secret key, from the clock and pid only if the kernel has no random bytes */
+    if(getrandom(ctx -> key, sizeof(ctx -> key), 0) != sizeof(ctx -> key)) {
+        ctx -> key[0] = (uint64_t) rdp_now() << 20 ^ (uint64_t) getpid();
+        ctx -> key[1] = (uint64_t) rand() << 32 ^ (uint64_t) time(NULL);
     }
+    return ctx;
+}
 
-    /* Check if connection request have been declined */
-    if(pkt -> flag == 0x20) {
-        printf("NOT CONNECTED: %d %d\n", pkt -> recvid,  pkt -> senderid);
 
-        /* Use metadata to check the reason for rejecting connection request */
-        /* If client id already exists */
-        if(pkt -> metadata == 1){
-            printf(" - Client-id is already connected to server\n");
-        }
 
-        /* If max files have been written*/
-        else if (pkt -> metadata == 2){
-            printf(" - Server has no more files to send\n");
-        }
 
-        /* Free packet and return -1 */
-        free(pkt);
-        return -1;
-    }
+/**
+ * Connection list of an endpoint, for going through all connections
+ * @param n: set to length of list, unused entries are NULL
+ */
+struct connection **rdp_connections(struct rdp_ctx *ctx, int *n) {
+    *n = ctx -> n;
+    return ctx -> connections;
+}
 
-    /* If connection request have been accepted packet contains flag 0x10 */
-    if(pkt -> flag == 0x10) {
-        printf("CONNECTED: %d %d\n", pkt -> senderid, pkt -> recvid);
-        free(pkt);
-        return rc;
-    }
 
-      /* If there is a valid flag but not an expected one */
-    else {
-        printf("Received unexpected packet in rdp_connect(). Exit program\n");
-        free(pkt);
-        return -1;
-    }
+
+
+/**
+ * Transmit scheduler of an endpoint, see scheduler.c
+ */
+struct scheduler *rdp_ctx_scheduler(struct rdp_ctx *ctx) {
+    return &ctx -> sched;
 }
 
 
 
 
 /**
- * Rdp_listen function turn socket into a listening socket
- * Uses select funstion for listening
- * Uses a timout of 150ms to listen for new connection requests
- * Returns 1 if there is activity on socket
- * Returns 0 if time runs out
+ * Rate limits of an endpoint, see ratelimit.c
  */
-int rdp_listen(int fd, fd_set fds, struct timeval timeout) {
-    FD_ZERO(&fds);
-
-    /* Set timeout to 100ms*/
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 150000;
+struct rate_limits *rdp_ctx_limits(struct rdp_ctx *ctx) {
+    return &ctx -> limits;
+}
 
-    FD_SET(fd, &fds);
 
-    /* Listen for connection request */
-    int rc = select(FD_SETSIZE, &fds, NULL, NULL, &timeout);
-    check_error(rc, "select");
 
-    /* If connection is received */
-    if(FD_ISSET(fd, &fds)) {
-        return 1;
-    }
 
-    /* If noe activity on socket*/
-    return 0;
+/**
+ * Zerocopy state of the socket of an endpoint, see zerocopy.c
+ */
+struct zerocopy *rdp_ctx_zerocopy(struct rdp_ctx *ctx) {
+    return &ctx -> zc;
 }
 
 
 
 
 /**
- * @param fd: socket for receiving messages from clients
- * @param client_addr: pointer to client address
- * Check if packet is a connection request and establish connection
- * Uses rdp_send_accept as a help method for sending confirmation to client
+ * Empty the latency histograms of an endpoint or a download
  */
-struct connection *rdp_accept(int fd, struct sockaddr_in *client_addr) {
-    char buf[BUFSIZE];
-
-    /* Receive packet from client */
-    socklen_t addr_len = sizeof(struct sockaddr_in);
-    int rc = recvfrom(fd, buf, BUFSIZE -1, 0,(struct sockaddr*) client_addr, &addr_len);
-    check_error(rc, "recvfrom");
+void rdp_latency_init(struct rdp_latency *lat) {
+    hist_init(&lat -> rtt);
+    hist_init(&lat -> owd);
+}
 
-    /* Open rdp_packet and store in struct */
-    struct rdp_packet *pk = open_rdp_packet(buf, rc);
 
-    /* Check if flag is valid */
-    int flag_check = check_bits_flag(&pk -> flag, sizeof(char));
-    if(flag_check == -1){
-        printf("Received unavailable flag in rdp_accept(). Program exit!\n");
-        free(pk);
-        return NULL;
-    }
 
-    /* Check that id is unique and not already connected */
-    int id_status = check_client_id(pk -> senderid);
-    if(id_status == -1){
-        ssize_t wc = rdp_send_reject(fd, *client_addr, pk -> senderid, 1);
-        check_error(wc, "rdp_send_reject");
-        free(pk);
-        return NULL;
-    }
+/**
+ * Add the latency samples a packet with timestamps gives
+ * A sample below 0 or above RDP_IDLE_TIMEOUT is left out, the one-way delay
+ * is that when the clocks of the hosts do not agree
+ * @param pk: packet with RDP_OPT_TSTAMP
+ * @param stamp: when the packet came in, see struct rdp_batch
+ * Returns the RTT sample in microseconds, -1 if the packet gives none
+ */
+int rdp_latency_sample(struct rdp_latency *lat, struct rdp_packet *pk, uint32_t stamp) {
+    int32_t owd = (int32_t) (stamp - pk -> tsval);
+    int32_t rtt = (int32_t) (stamp - pk -> tsecr);
 
-    /* Check that not maximum number of files have been written */
-    if(n_counter >= N){
-        ssize_t wc = rdp_send_reject(fd, *client_addr, pk -> senderid, 2);
-        check_error(wc, "rdp_send_reject");
-        free(pk);
-        return NULL;
+    if(pk -> tsval != 0 && owd >= 0 && owd <= RDP_IDLE_TIMEOUT * 1000) {
+        hist_add(&lat -> owd, owd);
     }
-
-    /* Check that packet is a connection request - if so, flag == 0x01 */
-    if(pk -> flag == 0x01) {
-        struct connection *connection = rdp_send_accept(fd, *client_addr, pk -> senderid);
-        n_counter++;
-        free(pk);
-        return connection;
+    if(pk -> tsecr == 0 || rtt < 0 || rtt > RDP_IDLE_TIMEOUT * 1000) {
+        return -1;
     }
-
-    /* Free packet and return 0 if flag not is a connection request */
-    free(pk);
-    return NULL;
+    hist_add(&lat -> rtt, rtt);
+    return rtt;
 }
 
 
 
 
 /**
- * Function for sending accept packet to clients
- * Help method called by rdp_accept
- * The function makes an accept packet with flag 0x10 and send to client
- * It also calls function get_connection which returns a pointer to a connection
+ * Counters of an endpoint, with its drop count and buffer sizes as they are now
  */
-struct connection *rdp_send_accept(int fd, struct sockaddr_in dest_addr, int id) {
+struct rdp_stats *rdp_ctx_stats(struct rdp_ctx *ctx) {
+    ctx -> stats.local_drops = ctx -> batch.dropped;
+    ctx -> stats.sndbuf = ctx -> sockbuf.sndbuf;
+    ctx -> stats.rcvbuf = ctx -> sockbuf.rcvbuf;
+    return &ctx -> stats;
+}
 
-    /* ID's for printing og connection to stdout */
-    int client_id = id;
-    int server_id = 0;
 
-    /* Makes a rdp_packet with flag 0x10 which accept request from client */
-    struct rdp_packet *pkt = make_rdp_packet(0x10, 0, 0, 0, client_id, 0, 0, NULL);
-    unsigned int size = sizeof(struct rdp_packet);
 
-    /* Convert packet for sending */
-    char* convert = get_packet(pkt, &size);
 
-    /* Send packet to client */
-    ssize_t wc = send_packet(fd, convert, size, 0, (struct sockaddr*) &dest_addr, sizeof(dest_addr));
-    check_error(wc, "send_packet");
+/**
+ * Add connection to the connection list of the endpoint
+ * @param connection: pointer to connection
+ */
+void add_rdp_connection(struct rdp_ctx *ctx, struct connection *connection) {
+    for(int i = 0; i < ctx -> n; i++) {
+        if(ctx -> connections[i] == NULL) {
+          ctx -> connections[i] = connection;
+          rdp_timer_update(ctx, connection);
+          return;
+        }
+    }
+}
 
-    /* Create a connection pointer and return */
-    struct connection *connection = get_connection(client_id, server_id, dest_addr);
-    printf("CONNECTED %d %d\n", client_id, server_id);
 
-    /* Free used packets */
-    free(pkt);
-    free(convert);
+/****************************************************************************/
 
-    /* Return established connection */
-    return connection;
-}
 
 
 
 
-/**
- * Function rdp_send_reject for rejection connection request
- * Help method in rdp protocol called by rdp_accept
- * Uses flag 0x20 which tells client request has been rejected
- * @param id: id of client sending rejection
- * @param meta: number representing the reason for rejecting request
- */
-ssize_t rdp_send_reject(int fd, struct sockaddr_in addr, int id, int meta) {
-    ssize_t wc;
-    int client_id = id;
 
-    /* Make rdp_packet with flag 0x20 which reject connection request*/
-    struct rdp_packet *pkt = make_rdp_packet(0x20, 0, 0, 0, 0, client_id, meta, NULL);
 
-    /* Convert packet for sending */
-    unsigned int size = sizeof(struct rdp_packet);
-    char* convert = get_packet(pkt, &size);
 
-    /* Send rejection packet to client */
-    wc = send_packet(fd, convert, size, 0, (struct sockaddr*)&addr, sizeof(addr));
-    check_error(wc, "send_packet");
 
-    /* Free used packets */
-    free(pkt);
-    free(convert);
 
-    /* Return write count from send_packet*/
-    return wc;
+/*                        RDP ADMISSION QUEUE                               */
+/****************************************************************************/
+
+/**
+ * Initialize admission queue
+ * @param active: max number of connections served at the same time
+ * @param queued: max number of clients waiting for a connection slot
+ * @param chunks: number of chunks in the file, used for estimating wait
+ */
+void init_admission(struct rdp_ctx *ctx, int active, int queued, int64_t chunks) {
+    ctx -> max_active = active;
+    ctx -> queue_max = queued;
+    ctx -> total_chunks = chunks;
+    ctx -> queue_len = 0;
+    free(ctx -> queue);
+    ctx -> queue = malloc(sizeof(struct connection *) * (queued > 0 ? queued : 1));
+
+    /* Each active download has at most RDP_MAX_STREAMS connections */
+    free(ctx -> remaining);
+    ctx -> remaining_len = active > 0 && active < ctx -> n / RDP_MAX_STREAMS ? active * RDP_MAX_STREAMS : ctx -> n;
+    ctx -> remaining = malloc(sizeof(long long) * ctx -> remaining_len);
+    if (ctx -> queue == NULL || ctx -> remaining == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in init_admission()\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 
 
 
 /**
- * Creates a rdp_connection and returns it
- * @param client_id: unique id for each client
- * @param server_ id: always 0
- * @param client_addr: destination address for client
- * Sets variable file_status to 0 - used for multiplexing
+ * Find client in admission queue by address and client id
+ * Returns position in queue, or -1 if client is not queued
  */
-struct connection *get_connection(int client_id, int server_id, struct sockaddr_in client_addr) {
+int find_queued_connection(struct rdp_ctx *ctx, struct sockaddr_in addr, int client_id) {
+    for(int i = 0; i < ctx -> queue_len; i++) {
+        if(ctx -> queue[i] -> client_id == client_id && same_address(ctx -> queue[i] -> client_addr, addr)) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    /* Allocate memory for a connection */
-    struct connection * cnt = malloc(sizeof(int) * 3 + sizeof(struct sockaddr_in));
 
-    /* Check that connection was successfull */
-    if (cnt == NULL) {
-        fprintf(stderr, "malloc: could not allocate memory in get_connection()\n");
-        free_all_rdp_connections();
-        exit(EXIT_FAILURE);
-    }
 
-    /* Assign arguments to variables in struct */
-    cnt -> client_id = client_id;
-    cnt -> server_id = server_id;
-    cnt -> file_status = 0;
-    cnt -> client_addr = client_addr;
 
-    /* Return connection */
-    return cnt;
+/**
+ * Find the k-th smallest of n values, moving them around while doing so
+ * @param v: values, at least k + 1 of them
+ * Returns the value that would be v[k] if v was sorted
+ */
+static long long select_nth(long long *v, int n, int k) {
+    int lo = 0;
+    int hi = n - 1;
+
+    while(lo < hi) {
+        long long pivot = v[lo + (hi - lo) / 2];
+        int i = lo;
+        int j = hi;
+        while(i <= j) {
+            while(v[i] < pivot) {
+                i++;
+            }
+            while(v[j] > pivot) {
+                j--;
+            }
+            if(i <= j) {
+                long long t = v[i];
+                v[i++] = v[j];
+                v[j--] = t;
+            }
+        }
+        if(k <= j) {
+            hi = j;
+        } else if(k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+    return v[k];
 }
 
 
 
 
 /**
- * Check that client id is unique and not already connected
- * Iterate through connections and check if connection is not NULL
- * If a connection with the same client_id already is connected - return -1
- * If client_id not is in connections - return 0
+ * Estimate how long a queued client has to wait for a connection slot
+ * Each active connection has so far sent its chunks at some rate, so a slot is
+ * free when its remaining chunks have been sent at that rate. Clients further
+ * back than the number of slots also wait for the whole file to be sent once
+ * @param position: position in queue, 0 is next
+ * Returns estimated wait in ms
  */
-int check_client_id(int client_id){
-    for(int i = 0; i < N; i++){
-        if(connections[i] != NULL){
-            if(connections[i] -> client_id == client_id){
-              return -1;
+int estimate_wait(struct rdp_ctx *ctx, int position) {
+    long long *remaining = ctx -> remaining;
+    int count = 0;
+    long long now = rdp_now();
+    long long ms_per_file = 0;
+
+    /* A live stream has no known end, the client asks again later */
+    if(ctx -> total_chunks == RDP_CHUNKS_UNKNOWN) {
+        return RDP_QUEUE_POLL_MAX;
+    }
+
+    /* Time left for each active connection */
+    for(int i = 0; i < ctx -> n && count < ctx -> remaining_len; i++) {
+        struct connection *cnt = ctx -> connections[i];
+        if(cnt != NULL) {
+            long long elapsed = now - cnt -> start_ms;
+            long long sent = cnt -> file_status;
+            if(elapsed < 1 || sent < 1) {
+                elapsed = 1;
+                sent = 1;
             }
+            long long left = (cnt -> chunks + 1 - cnt -> file_status) * elapsed / sent;
+            ms_per_file += (ctx -> total_chunks + 1) * elapsed / sent;
+            remaining[count++] = left;
         }
     }
-    return 0;
+
+    if(count == 0) {
+        return 1;
+    }
+
+    int laps = position / count;
+    long long wait = select_nth(remaining, count, position % count) + laps * (ms_per_file / count);
+    return wait < 1 ? 1 : wait > INT_MAX ? INT_MAX : wait;
 }
 
 
 
 
 /**
- * Initialize connection list
- * Allocate memory for n connection and
- * initialize each connection with NULL pointer
- * @param max_connections: max number of connections
+ * Take the first client out of the admission queue if a connection slot is free
+ * or its download already has one
+ * The caller adds the connection and sends the accept packet, and calls again
+ * until NULL so all queued parts of an admitted download follow it
+ * Returns NULL if queue is empty or all slots are in use
  */
-void init_connections(int max_connections) {
-    n_counter = 0;
-    max_addr = max_connections + 20;
-    connections = malloc(sizeof(struct connection) * max_connections);
-    for(int i = 0; i < max_connections; i++) {
-        connections[i] = NULL;
+struct connection *rdp_admit_next(struct rdp_ctx *ctx) {
+    if(ctx -> queue_len == 0 || table_full(ctx)) {
+        return NULL;
     }
+    if(count_rdp_connections(ctx) >= ctx -> max_active && group_active(ctx, ctx -> queue[0]) == 0) {
+        return NULL;
+    }
+
+    struct connection *connection = ctx -> queue[0];
+    ctx -> queue_len--;
+    memmove(ctx -> queue, ctx -> queue + 1, sizeof(struct connection *) * ctx -> queue_len);
+    connection -> start_ms = rdp_now();
+    connection -> last_heard_ms = connection -> start_ms;
+
+    printf("CONNECTED %d %016llx\n", connection -> client_id, (unsigned long long) connection -> server_id);
+    return connection;
 }
 
 
 
 
 /**
- * Add connection to global list connections
- * Update index_counter for correct indexing in global list
- * @param connection: pointer to connection
+ * Stop letting clients in, for when the file can no longer be served
+ * Queued clients are rejected with reason, and so is every new connection
+ * request. Active connections go on until the application ends them
+ * @param fd: socket of the endpoint
+ * @param reason: reject reason sent to clients, e.g. RDP_END_CHANGED
  */
-void add_rdp_connection(struct connection *connection) {
-    for(int i = 0; i < N; i++) {
-        if(connections[i] == NULL) {
-          connections[i] = connection;
-          return;
-        }
+void rdp_close_admission(struct rdp_ctx *ctx, int fd, int reason) {
+    ctx -> closed_reason = reason;
+    for(int i = 0; i < ctx -> queue_len; i++) {
+        ssize_t wc = rdp_send_reject(fd, ctx -> queue[i] -> client_addr, ctx -> queue[i] -> client_id, reason);
+        check_error(wc, "rdp_send_reject");
+        free_connection(ctx -> queue[i]);
     }
+    ctx -> queue_len = 0;
 }
 
 
@@ -387,30 +1532,44 @@ void add_rdp_connection(struct connection *connection) {
 /**
  * rdp_write function used for sending packet containing payload
  * Uses flag 0x04 for telling receiver that packet contain payload
+ * A client that echoes timestamps gets the time of sending, and the last
+ * timestamp it sent moved on by the time it waited here
  * @param sockfd: socket used for sending packet
  * @param buffer: buffer to read payload from
- * @param addr: destinations address for sending packet
- * @param retry: used for deciding pktseq in case of packet loss
+ * @param cnt: connection to send to
+ * @param seq: sequence number of packet, the same when a lost packet is sent again
  * @param len: size of payload to send
+ * @param options: RDP_OPT_COMPRESS if payload is compressed, otherwise 0
+ * Large packets are sent with MSG_ZEROCOPY when enabled, see zerocopy.c
  */
-ssize_t rdp_write(int sockfd, void *buffer, struct sockaddr_in addr, int retry, int len) {
+ssize_t rdp_write(struct rdp_ctx *ctx, int sockfd, void *buffer, struct connection *cnt, unsigned char seq, int len, unsigned char options) {
+    struct sockaddr_in addr = cnt -> client_addr;
     ssize_t wc;
 
-    /* Get pktseq of packet. Check retry mode to account for packet loss */
-    char pk = get_pktseq(retry);
-
     /* Make rdp_packet for sending */
-    struct rdp_packet *pkt = make_rdp_packet(0x04, pk, 0, 0, 0, 0, len, buffer);
+    options |= cnt -> options & RDP_OPT_TSTAMP;
+    struct rdp_packet *pkt = make_rdp_packet(0x04, seq, 0, options, 0, 0, len, buffer);
+    if(options & RDP_OPT_TSTAMP) {
+        pkt -> tsval = rdp_tstamp_now();
+        if(cnt -> ts_recent != 0) {
+            pkt -> tsecr = cnt -> ts_recent + (pkt -> tsval - cnt -> ts_recent_rx);
+        }
+    }
 
     /* Get size of rdp packet and convert it for sending */
-    unsigned int size = sizeof(struct rdp_packet) + len;
+    unsigned int size;
     char* convert = get_packet(pkt, &size);
+    free(pkt);
+
+    /* Kernel sends straight from the buffer and zerocopy frees it when done */
+    if(zerocopy_wanted(&ctx -> zc, size)) {
+        return zerocopy_send(&ctx -> zc, sockfd, convert, size, (struct sockaddr*)&addr, sizeof(addr));
+    }
 
     /* Send rdp_packet to receiver */
     wc = send_packet(sockfd, convert, size, 0, (struct sockaddr*)&addr, sizeof(addr));
 
     /* Free used packets */
-    free(pkt);
     free(convert);
 
     /* Return write count */
@@ -425,19 +1584,17 @@ ssize_t rdp_write(int sockfd, void *buffer, struct sockaddr_in addr, int retry,
  * Uses flag 0x20 for telling receiver that the whole file is sendt
  * @param fd: socket used for sending packet
  * @param addr: destinations address for sending packet
- * @param retry: used for deciding pktseq in case of packet loss
+ * @param digest: CRC32C of the whole file, carried in metadata
+ * The EOF is sent again until the client ends the connection
  */
-ssize_t rdp_EOF(int fd, struct sockaddr_in addr, int retry) {
+ssize_t rdp_EOF(int fd, struct sockaddr_in addr, uint32_t digest) {
     ssize_t wc;
 
-    /* Get pktseq of packet. Check retry mode to account for packet loss */
-    char pk = get_pktseq(retry);
-
     /* Make rdp_packet for sending */
-    struct rdp_packet *pkt = make_rdp_packet(0x20, pk, 0, 0, 0, 0, 0, NULL);
+    struct rdp_packet *pkt = make_rdp_packet(0x20, 0, 0, 0, 0, 0, (int64_t) digest, NULL);
 
     /* Get size of rdp packet and convert it for sending */
-    unsigned int size = sizeof(struct rdp_packet);
+    unsigned int size;
     char* convert = get_packet(pkt, &size);
 
     /* Send rdp_packet to receiver */
@@ -459,15 +1616,52 @@ ssize_t rdp_EOF(int fd, struct sockaddr_in addr, int retry) {
  * Uses flag 0x08 for telling receiver that packet contain ack
  * @param fd: socket used for sending packet
  * @param addr: destinations address for sending packet
+ * @param tsecr: timestamp to echo, 0 to send the ack without timestamps
+ * @param window: free receive window to advertise in metadata, -1 for none
+ */
+ssize_t rdp_send_ack(int fd, struct sockaddr_in addr, unsigned char ack, uint32_t tsecr, int window) {
+    ssize_t wc;
+
+    /* Make rdp_packet for sending */
+    unsigned char options = (tsecr ? RDP_OPT_TSTAMP : 0) | (window >= 0 ? RDP_OPT_WINDOW : 0);
+    struct rdp_packet *pkt = make_rdp_packet(0x08, 0, ack, options, 0, 0, window >= 0 ? window : 0, NULL);
+    pkt -> tsval = rdp_tstamp_now();
+    pkt -> tsecr = tsecr;
+
+    /* Get size of rdp packet and convert it for sending */
+    unsigned int size;
+    char* convert = get_packet(pkt, &size);
+
+    /* Send rdp_packet to receiver */
+    wc = send_packet(fd, convert, size, 0, (struct sockaddr*)&addr, sizeof(addr));
+
+    /* Free used packets */
+    free(pkt);
+    free(convert);
+
+    /* Return write count */
+    return wc;
+}
+
+
+
+
+/**
+ * rdp_send_keepalive function used for checking that a peer is alive
+ * Uses flag 0x80. The server sends it to idle peers and to probe a closed
+ * receive window, and the client answers with the same packet and its window
+ * @param fd: socket used for sending packet
+ * @param addr: destinations address for sending packet
+ * @param window: free receive window to advertise in metadata, -1 for none
  */
-ssize_t rdp_send_ack(int fd, struct sockaddr_in addr, unsigned char ack) {
+ssize_t rdp_send_keepalive(int fd, struct sockaddr_in addr, int window) {
     ssize_t wc;
 
     /* Make rdp_packet for sending */
-    struct rdp_packet *pkt = make_rdp_packet(0x08, 0, ack, 0, 0, 0, 0, NULL);
+    struct rdp_packet *pkt = make_rdp_packet(0x80, 0, 0, window >= 0 ? RDP_OPT_WINDOW : 0, 0, 0, window >= 0 ? window : 0, NULL);
 
     /* Get size of rdp packet and convert it for sending */
-    unsigned int size = sizeof(struct rdp_packet);
+    unsigned int size;
     char* convert = get_packet(pkt, &size);
 
     /* Send rdp_packet to receiver */
@@ -487,21 +1681,20 @@ ssize_t rdp_send_ack(int fd, struct sockaddr_in addr, unsigned char ack) {
 /**
  * rdp_end_connection function used for sending packet containing connection ending
  * Uses flag 0x02 for telling receiver that packet contain connection ending
+ * A client ends a connection with reason 0. The server ends one with a
+ * reason, e.g. RDP_END_BEHIND, when it can not serve the client any longer
  * @param fd: socket used for sending packet
  * @param addr: destinations address for sending packet
- * @param retry: used for deciding pktseq in case of packet loss
+ * @param reason: why the connection is ended, carried in metadata
  */
-ssize_t rdp_end_connection(int fd, struct sockaddr_in addr, int retry) {
+ssize_t rdp_end_connection(int fd, struct sockaddr_in addr, int reason) {
     ssize_t wc;
 
-    /* Get pktseq of packet. Check retry mode to account for packet loss */
-    char pk = get_pktseq(retry);
-
     /* Make rdp_packet for sending */
-    struct rdp_packet *pkt = make_rdp_packet(0x02, pk, 0, 0, 0, 0, 0, NULL);
+    struct rdp_packet *pkt = make_rdp_packet(0x02, 0, 0, 0, 0, 0, reason, NULL);
 
     /* Get size of rdp packet and convert it for sending */
-    unsigned int size = sizeof(struct rdp_packet);
+    unsigned int size;
     char* convert = get_packet(pkt, &size);
 
     /* Send rdp_packet to receiver */
@@ -519,139 +1712,199 @@ ssize_t rdp_end_connection(int fd, struct sockaddr_in addr, int retry) {
 
 
 /**
- * rdp_wait funkction which implements the "stop and wait" functionality
- * Uses a timpout of 100ms to check if any type of "confirmation" packet is received
- * The packets of interest are ack-packets (flag 0x08) and end-connection packets (flag 0x02)
- * @param sockfd: socket for for receiving packet
+ * Sequence number of a chunk
+ * Chunk numbers grow past what fits in a byte, but never more than
+ * RDP_MAX_WINDOW chunks are in flight, so the low byte tells them apart
+ * Sequence number 0 is not used by chunk 0, which keeps the first data packet
+ * apart from header-only packets
+ * @param chunk: number of chunk within the range of the connection
  */
-ssize_t rdp_wait(int sockfd) {
-    char r_buffer[BUFSIZE];
+unsigned char rdp_chunk_seq(int64_t chunk) {
+    return (unsigned char) (chunk + 1);
+}
 
-    /* 100ms timeout to wait for packet */
-    struct timeval timeout = { 0, 100000 };
-    setsockopt(sockfd,SOL_SOCKET,SO_RCVTIMEO,(char*)&timeout,sizeof(struct timeval));
 
-    /* Try to receive packet */
-    ssize_t rc = recv(sockfd, r_buffer, BUFSIZE, 0);
-    if (rc < 0) {
-        return 0;
-    }
 
-    /* Open rdp_packet and store in struct */
-    struct rdp_packet *pkt = open_rdp_packet(r_buffer, rc);
 
-    /* Check if flag is valid */
-    int flag_check = check_bits_flag(&pkt -> flag, sizeof(char));
-    if(flag_check == -1){
-        printf("Received unavailable flag in rdp_wait(). Program exit!\n");
-        free(pkt);
-        return -1;
+/**
+ * Mark the chunk with sequence number ackseq as acked by the client
+ * Acks may come in any order. The window slides forward over all chunks
+ * from file_status that are acked, and acks outside the window are ignored
+ * @param cnt: connection the ack came from
+ * @param ackseq: sequence number of the acked chunk
+ */
+void rdp_ack_chunk(struct connection *cnt, unsigned char ackseq) {
+    int offset = (unsigned char) (ackseq - rdp_chunk_seq(cnt -> file_status));
+    if(offset >= cnt -> next_chunk - cnt -> file_status) {
+        return;
+    }
+
+    cnt -> acked |= 1ULL << offset;
+    while(cnt -> acked & 1) {
+        cnt -> acked >>= 1;
+        cnt -> file_status++;
     }
+}
 
-    // Return 1 if packet is an ack packet
-    if(pkt -> flag == 0x08){
-        unsigned char to_check = get_pktseq(1);
 
-        if(pkt -> ackseq == to_check){
-            free(pkt);
-            return 1;
-        }
 
-        else {
-            printf("Error: received ack packet, but not the correct ack-number!\n");
-            free(pkt);
-            return -1;
+
+/**
+ * Check if a new chunk may be sent on the connection
+ * @param cnt: connection to check
+ * Returns 1 if there are chunks left and room in both the send window and
+ * the receive window of the client, otherwise 0
+ */
+int rdp_window_open(struct connection *cnt) {
+    int64_t in_flight = cnt -> next_chunk - cnt -> file_status;
+    return cnt -> next_chunk < cnt -> chunks && in_flight < cnt -> window && in_flight < cnt -> rwnd;
+}
+
+
+
+
+/**
+ * Find a chunk in flight that has not been acked in time
+ * Each retry of a chunk waits twice as long as the one before
+ * @param cnt: connection to check
+ * @param now: current time from rdp_now
+ * Returns index of the first such chunk, or -1 if there is none
+ */
+int64_t rdp_next_expired(struct connection *cnt, long long now) {
+    for(int64_t chunk = cnt -> file_status; chunk < cnt -> next_chunk; chunk++) {
+        if(!(cnt -> acked & (1ULL << (chunk - cnt -> file_status)))
+           && now >= rdp_chunk_due(cnt, chunk)) {
+            return chunk;
         }
     }
+    return -1;
+}
 
-    // Return 1 if packet is a connection ending
-    if(pkt -> flag == 0x02){
-        free(pkt);
-        return 1;
-    }
 
-    /* Return -1 if uncorrect flag is received*/
-    free(pkt);
-    return -1;
+
+
+/**
+ * Check if the EOF is to be sent (again)
+ * @param cnt: connection whose chunks are all acked
+ * @param now: current time from rdp_now
+ */
+int rdp_eof_expired(struct connection *cnt, long long now) {
+    return now >= rdp_eof_due(cnt);
+}
+
+
+
+
+/**
+ * Record that the EOF has been sent, starting its retransmission timer
+ * @param cnt: active connection, its timer is armed for the retry
+ */
+void rdp_eof_sent(struct rdp_ctx *ctx, struct connection *cnt) {
+    cnt -> eof_tries++;
+    cnt -> eof_ms = rdp_now();
+    cnt -> last_sent_ms = cnt -> eof_ms;
+    rdp_timer_update(ctx, cnt);
 }
 
 
 
 
 /**
- * Rdp_read function used for reading data packets in rdp protocol
- *
- * 1. Receives packet and read content into local buffer
- * 2. It then reads from buffer and and opens packet inside function
- * 3. Check flags in packet, both for validation and for information about the packet
- * 4. Copy payload into application buffer, which is then ready to be written
- * 5. Send ack back to server, confirming packet is received
- * 7. Return metadata, to be able to get size of payload in application
- *
- * @param sockfd: socket used for receiving and sending packets
- * @param buf: pointer to buffer to read from and write back to
- * @param size: size of buffer to know how much to read
- * @param addr: destinations address for sending ack
- * @param seq: sequence number to be acked and sendt back to server
+ * Check if a zero window probe is to be sent
+ * @param cnt: connection to check
+ * @param now: current time from rdp_now
+ * Returns 1 if the client has closed its receive window and a probe is due
  */
-ssize_t rdp_read(int sockfd, char* buf, int size, struct sockaddr_in addr, unsigned char *seq){
-    char buffer[size];
-    ssize_t wc, rc = 0;
-    fd_set fds;
+int rdp_probe_expired(struct connection *cnt, long long now) {
+    return rdp_window_closed(cnt) && now >= rdp_probe_due(cnt);
+}
+
+
 
-    FD_ZERO(&fds);
-    FD_SET(sockfd, &fds);
 
+/**
+ * Record that a zero window probe has been sent, the next one backs off
+ * @param cnt: active connection, its timer is armed for the next probe
+ */
+void rdp_probe_sent(struct rdp_ctx *ctx, struct connection *cnt) {
+    cnt -> probe_tries++;
+    cnt -> last_sent_ms = rdp_now();
+    rdp_timer_update(ctx, cnt);
+}
 
-    /* Use select to check if there is activity on socket
-     * The function had in principle not needed to implement select as recv-
-     * is a blocking call, but it turned out to get rid of a bug that sometimes
-     * occurred when recv was used alone */
-    int res = select(FD_SETSIZE, &fds, NULL, NULL, NULL);
-    check_error(res, "select");
 
-    /* If activity on socket */
-    if(FD_ISSET(sockfd, &fds)) {
 
-        /* Try to receive packet */
-        rc = recv(sockfd, buffer, size, 0);
-        if(rc == -1){
-            return rc;
-        }
+
+/**
+ * Record that a chunk has been sent, starting its retransmission timer
+ * @param cnt: active connection the chunk was sent to, its timer is armed for the retry
+ * @param chunk: number of chunk within the range of the connection
+ * @param first: 1 if the chunk was sent for the first time, 0 for a retry
+ */
+void rdp_chunk_sent(struct rdp_ctx *ctx, struct connection *cnt, int64_t chunk, int first) {
+    int slot = chunk % RDP_MAX_WINDOW;
+    uint32_t drops = ctx -> batch.dropped;
+
+    /* An ack that may have been dropped by our own receive queue says nothing
+     * about the path, so the retry does not back off or count towards giving up */
+    int local = !first && cnt -> sent_drops[slot] != drops;
+    if(first) {
+        cnt -> tries[slot] = 0;
+    }
+    else if(local) {
+        ctx -> stats.local_retransmits++;
     }
+    else {
+        ctx -> stats.retransmits++;
+    }
+    if(!local && cnt -> tries[slot] < 255) {
+        cnt -> tries[slot]++;
+    }
+    cnt -> sent_drops[slot] = drops;
+    cnt -> sent_ms[slot] = rdp_now();
+    cnt -> last_sent_ms = cnt -> sent_ms[slot];
+
+    /* A new chunk in flight is due before anything else only if nothing else was */
+    if(!timer_armed(&cnt -> timer) || cnt -> timer.expires > rdp_chunk_due(cnt, chunk)) {
+        timer_arm(&ctx -> timers, &cnt -> timer, rdp_chunk_due(cnt, chunk));
+    }
+}
 
-    /* Open rdp_packet and store in struct */
-    struct rdp_packet *new = open_rdp_packet(buffer, rc);
-    // print_rdp_packet(new);
 
-    /* Check if flag is valid */
-    int flag_check = check_bits_flag(&new -> flag, sizeof(char));
-    if(flag_check == -1) {
-        printf("Received unavailable flag in rdp_read(). Program exit!\n");
-        free(new);
-        return -1;
+
+
+/**
+ * Check if the peer of a connection has stopped answering
+ * It has if a chunk or the EOF has been sent RDP_MAX_RETRIES times and the
+ * last try was not acked in time either, or if nothing at all has been
+ * heard from it for RDP_IDLE_TIMEOUT ms, keepalive answers included
+ * @param cnt: connection to check
+ * @param now: current time from rdp_now
+ * Returns 1 if the connection should be evicted, otherwise 0
+ */
+int rdp_peer_dead(struct connection *cnt, long long now) {
+    if(now - cnt -> last_heard_ms > RDP_IDLE_TIMEOUT) {
+        return 1;
     }
 
-    /* If packet is an EOF packet  */
-    if (new -> flag == 0x20) {
-        wc = rdp_end_connection(sockfd, addr, 0);
-        check_error(wc, "rdp_send_ack");
-        free(new);
-        return 0;
+    if(cnt -> file_status >= cnt -> chunks) {
+        return cnt -> eof_tries >= RDP_MAX_RETRIES && now >= rdp_eof_due(cnt);
     }
 
-    /* memcpy payload into application buffer */
-    memcpy(buf, new -> payload, new -> metadata);
-    *seq = new -> pktseq;
-    int length = new -> metadata;
+    int64_t chunk = rdp_next_expired(cnt, now);
+    return chunk != -1 && cnt -> tries[chunk % RDP_MAX_WINDOW] >= RDP_MAX_RETRIES;
+}
+
+
 
-    /* Send ack back to server  */
-    wc = rdp_send_ack(sockfd, addr, new -> pktseq);
-    check_error(wc, "rdp_send_ack");
 
-    /* Free used packet and return */
-    free(new);
-    return length;
+/**
+ * Current time in ms from a clock that only moves forward
+ */
+long long rdp_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 
@@ -671,11 +1924,33 @@ ssize_t rdp_read(int sockfd, char* buf, int size, struct sockaddr_in addr, unsig
 
 /**
  * Close rdp connection
+ * A connection the client ended before all its chunks were acked gives its
+ * file slot back like an evicted one, once no other part of its download is left
  * @param cnt: connection to close
  * Uses client_id to identify connection
  */
-void rdp_close(struct connection *cnt) {
-    remove_rdp_connection(cnt -> client_id);
+void rdp_close(struct rdp_ctx *ctx, struct connection *cnt) {
+    if(cnt -> file_status < cnt -> chunks && group_active(ctx, cnt) == 1 && group_queued(ctx, cnt) == 0) {
+        ctx -> n_counter--;
+    }
+    remove_rdp_connection(ctx, cnt -> server_id);
+}
+
+
+
+
+/**
+ * Evict a connection whose peer has stopped answering
+ * Its file slot is given back, so another client can get the file instead,
+ * once no other part of the same download is left
+ * @param cnt: connection to evict
+ */
+void rdp_evict(struct rdp_ctx *ctx, struct connection *cnt) {
+    printf("EVICTED %d %016llx\n", cnt -> client_id, (unsigned long long) cnt -> server_id);
+    if(group_active(ctx, cnt) == 1 && group_queued(ctx, cnt) == 0) {
+        ctx -> n_counter--;
+    }
+    remove_rdp_connection(ctx, cnt -> server_id);
 }
 
 
@@ -683,21 +1958,22 @@ void rdp_close(struct connection *cnt) {
 
 /**
  * Remove connection between client and server
- * Gather global list and update N
- * @param client_id: unique id for identifiyng connection
- */
-void remove_rdp_connection(int client_id) {
-    for(int i = 0; i < N; i++) {
-        if(connections[i] != NULL) {
-            if(connections[i] -> client_id == client_id) {
-                free_connection(connections[i]);
-                connections[i] = NULL;
-                printf("DISCONNECTED %d %d\n", client_id, 0 );
+ * Gather connection list of the endpoint
+ * @param server_id: unique id for identifiyng connection
+ */
+void remove_rdp_connection(struct rdp_ctx *ctx, uint64_t server_id) {
+    for(int i = 0; i < ctx -> n; i++) {
+        if(ctx -> connections[i] != NULL) {
+            if(ctx -> connections[i] -> server_id == server_id) {
+                printf("DISCONNECTED %d %016llx\n", ctx -> connections[i] -> client_id, (unsigned long long) server_id);
+                timer_cancel(&ctx -> timers, &ctx -> connections[i] -> timer);
+                free_connection(ctx -> connections[i]);
+                ctx -> connections[i] = NULL;
                 return;
             }
         }
     }
-    printf(" - Could not remove connection. No client_id with id:  %d\n", client_id);
+    printf(" - Could not remove connection. No connection with id:  %016llx\n", (unsigned long long) server_id);
 }
 
 
@@ -715,17 +1991,32 @@ void free_connection(struct connection *connection) {
 
 
 /**
- * Free allocated memory for all connections
+ * Free an endpoint with all its connections
  * Uses the free_connection() function to free connections
- * Finally frees allocated memory for global list connections
+ * Finally frees allocated memory for connection list, admission queue
+ * and buffers zerocopy still holds
  */
-void free_all_rdp_connections() {
-    for(int i = 0; i < N; i++) {
-        if(connections[i] != NULL) {
-            free_connection(connections[i]);
+void rdp_ctx_free(struct rdp_ctx *ctx) {
+    if(ctx == NULL) {
+        return;
+    }
+    for(int i = 0; i < ctx -> n; i++) {
+        if(ctx -> connections[i] != NULL) {
+            free_connection(ctx -> connections[i]);
         }
     }
-    free(connections);
+    free(ctx -> connections);
+
+    for(int i = 0; i < ctx -> queue_len; i++) {
+        free_connection(ctx -> queue[i]);
+    }
+    free(ctx -> queue);
+    free(ctx -> remaining);
+    zerocopy_release(&ctx -> zc);
+    if(ctx -> epfd != -1) {
+        close(ctx -> epfd);
+    }
+    free(ctx);
 }
 
 /****************************************************************************/
@@ -13,66 +13,276 @@
 #include <sys/select.h>
 #include <time.h>
 
+#include "ratelimit.h"
+#include "timer.h"
+#include "histogram.h"
 
-// Global variables used in RDP protocol
-int N;
-int max_addr;
-int n_counter;
+
+// Connection request timeout, doubled for each retry
+#define RDP_CONNECT_TIMEOUT 250
+#define RDP_CONNECT_RETRIES 5
+
+// Longest a queued client waits before asking the server again, in ms
+#define RDP_QUEUE_POLL_MAX 5000
+
+// Default length of admission queue
+#define RDP_QUEUE_DEFAULT 16
+
+// Retransmission timeout in ms, doubled for every retry of the same packet
+// up to RDP_RTO << RDP_BACKOFF_MAX. A peer that echoes timestamps gets one
+// from its RTT samples instead, within RDP_RTO_MIN and RDP_RTO_MAX
+#define RDP_RTO 100
+#define RDP_RTO_MIN 50
+#define RDP_RTO_MAX 2000
+#define RDP_BACKOFF_MAX 4
+
+// A peer is evicted when a packet has been sent this many times without ack,
+// or when nothing has been heard from it for RDP_IDLE_TIMEOUT ms
+#define RDP_MAX_RETRIES 16
+#define RDP_IDLE_TIMEOUT 15000
+
+// A peer not sent anything for this long gets a keepalive probe (flag 0x80)
+#define RDP_KEEPALIVE 1000
+
+// Chunks a sender may have in flight per connection, and the receiver's
+// reorder buffer. The send window is at most half the buffer so that new
+// and old sequence numbers never look the same
+#define RDP_WINDOW 8
+#define RDP_MAX_WINDOW 64
+
+// Max number of connections one download may be split over, see struct rdp_range
+#define RDP_MAX_STREAMS 8
+
+// New connection requests without a cookie the server takes per second
+// before it answers them with a cookie instead, 0 to always ask for one.
+// A cookie is valid in the period it was made in and the one after
+#define RDP_COOKIE_RATE 64
+#define RDP_COOKIE_PERIOD 10000
+
+// Chunks of a file whose end is not known yet, a live stream before its
+// source has ended, see rdp_set_total_chunks
+#define RDP_CHUNKS_UNKNOWN (INT64_MAX / 4)
+
+// Reason in metadata of an end packet (0x02) from the server: the client fell
+// so far behind a live stream that the chunks it needs are gone
+#define RDP_END_BEHIND 1
+
+// Reason in metadata of an end packet (0x02) from the server, and of the
+// reject (0x20) of a new client: the file changed while it was served
+#define RDP_END_CHANGED 5
+
+// Longest the server waits for packets when no timer is due sooner, in ms
+#define RDP_POLL_MAX 1000
+
+// Events returned by rdp_receive
+#define RDP_EVENT_NONE 0
+#define RDP_EVENT_CONNECT 1
+#define RDP_EVENT_ACK 2
+#define RDP_EVENT_CLOSE 3
+#define RDP_EVENT_IGNORED 4
+#define RDP_EVENT_KEEPALIVE 5
+#define RDP_EVENT_RECONNECT 6
+
+
+// State of one RDP endpoint: connections, admission queue, scheduler, rate
+// limits and zerocopy. Made with rdp_ctx_new, every call that needs state
+// takes it, so a process can run many endpoints
+struct rdp_ctx;
 
 
 // Connection struct
+// Chunks are counted within the range of the connection: chunk i is chunk
+// start_chunk + i * stride of the file, and the connection sends chunks
+// below chunks. file_status is the first chunk not acked, chunks up to
+// next_chunk are in flight. Chunk numbers are 64 bits, so a file of any
+// size fits. client_id is picked by the client and only tells
+// its connections apart, server_id is given by the server and unique.
+// digest is the CRC32C of what a live stream has sent the connection, and
+// end_reason is set by the application when it can no longer serve the
+// connection, for it to be ended with that reason, see rdp_end_connection.
+// sent_drops is the receive queue drop count of the endpoint when each chunk
+// in flight was sent, see rdp_chunk_sent. ts_recent is the last timestamp
+// from the peer and ts_recent_rx when it came in, srtt_us and rttvar_us the
+// smoothed RTT and its variation, and rto the retransmission timeout in ms.
+// rwnd is the free receive window the client last advertised, chunks past
+// file_status + rwnd are not sent, and probe_tries counts the probes sent
+// since it was closed, see RDP_OPT_WINDOW
 struct connection{
-  int server_id;
+  uint64_t server_id;
   int client_id;
-  int file_status;
+  int64_t file_status;
+  int64_t next_chunk;
+  int window;
+  uint64_t acked;
+  long long sent_ms[RDP_MAX_WINDOW];
+  unsigned char tries[RDP_MAX_WINDOW];
+  uint32_t sent_drops[RDP_MAX_WINDOW];
+  uint32_t ts_recent;
+  uint32_t ts_recent_rx;
+  long srtt_us;
+  long rttvar_us;
+  int rto;
+  int rwnd;
+  int probe_tries;
+  long long eof_ms;
+  int eof_tries;
+  long long last_heard_ms;
+  long long last_sent_ms;
+  long long start_ms;
+  int64_t start_chunk;
+  int stride;
+  int64_t chunks;
+  int group;
+  int priority;
+  int weight;
+  int deficit;
+  struct token_bucket bucket;
+  int rate_prefix;
+  unsigned char options;
   struct sockaddr_in client_addr;
-}__attribute__((packed));
+  struct timer timer;
+  uint32_t digest;
+  int end_reason;
+};
+
+
+// Latency samples from the timestamps of packets, see RDP_OPT_TSTAMP. rtt
+// leaves out the time packets waited at the peer, owd is the one-way delay
+// from the peer, only right if the clocks of both hosts agree
+struct rdp_latency {
+  struct histogram rtt;
+  struct histogram owd;
+};
 
 
-// Connection list used to store client connections
-struct connection **connections;
+// Counters of an endpoint, see rdp_ctx_stats. A chunk sent again after the
+// receive queue of the endpoint dropped datagrams may only have lost its ack
+// on this host, it is counted in local_retransmits instead of retransmits
+struct rdp_stats {
+  uint64_t received;
+  uint64_t local_drops;
+  uint64_t retransmits;
+  uint64_t local_retransmits;
+  int sndbuf;
+  int rcvbuf;
+  struct rdp_latency latency;
+};
 
 
 // Functions used in RDP protocol
-struct connection *get_connection(int client_id, int server_id, struct sockaddr_in client_addr);
+struct rdp_ctx *rdp_ctx_new(int max_connections);
+
+void rdp_ctx_free(struct rdp_ctx *ctx);
+
+struct connection **rdp_connections(struct rdp_ctx *ctx, int *n);
+
+struct scheduler *rdp_ctx_scheduler(struct rdp_ctx *ctx);
+
+struct rate_limits *rdp_ctx_limits(struct rdp_ctx *ctx);
+
+struct zerocopy *rdp_ctx_zerocopy(struct rdp_ctx *ctx);
+
+struct rdp_stats *rdp_ctx_stats(struct rdp_ctx *ctx);
+
+struct connection *get_connection(struct rdp_ctx *ctx, int client_id, uint64_t server_id, struct sockaddr_in client_addr, int64_t start_chunk);
+
+int64_t rdp_file_chunk(struct connection *cnt, int64_t chunk);
+
+int rdp_group_size(struct rdp_ctx *ctx, struct connection *cnt);
+
+ssize_t rdp_send_accept(int fd, struct connection *cnt, unsigned char seq, char *payload, int len, unsigned char options);
 
-struct connection *rdp_send_accept(int fd, struct sockaddr_in dest_addr, int id);
+struct connection *rdp_accept(struct rdp_ctx *ctx, int fd, struct rdp_packet *pk, struct sockaddr_in *client_addr);
 
-struct connection *rdp_accept(int fd, struct sockaddr_in *client_addr);
+int rdp_receive(struct rdp_ctx *ctx, int fd, struct connection **cnt);
 
-ssize_t rdp_connect(int fd, struct sockaddr_in dest_addr);
+int rdp_listen(struct rdp_ctx *ctx, int fd, int timeout_ms);
 
-int rdp_listen(int fd, fd_set fds, struct timeval timeout);
+void rdp_watch(struct rdp_ctx *ctx, int fd, int on);
+
+int rdp_poll_timeout(struct rdp_ctx *ctx);
 
 ssize_t rdp_send_reject(int fd, struct sockaddr_in addr, int id, int meta);
 
-ssize_t rdp_confirmation(int fd, struct sockaddr_in *server_addr);
+ssize_t rdp_send_wait(int fd, struct sockaddr_in addr, int id, int wait_ms);
+
+ssize_t rdp_send_cookie(int fd, struct sockaddr_in addr, int id, uint64_t cookie);
+
+ssize_t rdp_send_ack(int fd, struct sockaddr_in addr, unsigned char ack, uint32_t tsecr, int window);
+
+ssize_t rdp_end_connection(int fd, struct sockaddr_in addr, int reason);
+
+ssize_t rdp_write(struct rdp_ctx *ctx, int sockfd, void *buffer, struct connection *cnt, unsigned char seq, int len, unsigned char options);
+
+void rdp_latency_init(struct rdp_latency *lat);
+
+int rdp_latency_sample(struct rdp_latency *lat, struct rdp_packet *pk, uint32_t stamp);
+
+ssize_t rdp_EOF(int fd, struct sockaddr_in addr, uint32_t digest);
+
+unsigned char rdp_chunk_seq(int64_t chunk);
+
+void rdp_ack_chunk(struct connection *cnt, unsigned char ackseq);
+
+int rdp_window_open(struct connection *cnt);
+
+int64_t rdp_next_expired(struct connection *cnt, long long now);
+
+void rdp_chunk_sent(struct rdp_ctx *ctx, struct connection *cnt, int64_t chunk, int first);
+
+int rdp_eof_expired(struct connection *cnt, long long now);
 
-ssize_t rdp_wait(int sockfd);
+void rdp_eof_sent(struct rdp_ctx *ctx, struct connection *cnt);
 
-ssize_t rdp_send_ack(int fd, struct sockaddr_in addr, unsigned char ack);
+int rdp_probe_expired(struct connection *cnt, long long now);
 
-ssize_t rdp_end_connection(int fd, struct sockaddr_in addr, int retry);
+void rdp_probe_sent(struct rdp_ctx *ctx, struct connection *cnt);
 
-ssize_t rdp_write(int sockfd, void *buffer, struct sockaddr_in addr, int retry, int len);
+void rdp_timer_update(struct rdp_ctx *ctx, struct connection *cnt);
 
-ssize_t rdp_read(int sockfd, char* buf, int size, struct sockaddr_in addr, unsigned char *seq);
+int rdp_expire_timers(struct rdp_ctx *ctx, int (*fire)(struct connection *cnt, void *arg), void *arg);
 
-ssize_t rdp_EOF(int fd, struct sockaddr_in addr, int retry);
+int rdp_peer_dead(struct connection *cnt, long long now);
+
+ssize_t rdp_send_keepalive(int fd, struct sockaddr_in addr, int window);
+
+void rdp_evict(struct rdp_ctx *ctx, struct connection *cnt);
+
+void rdp_set_window(struct rdp_ctx *ctx, int window);
+
+void rdp_set_cookie_rate(struct rdp_ctx *ctx, int rate);
+
+void rdp_set_busy_poll(struct rdp_ctx *ctx, int budget_us);
+
+void rdp_set_total_chunks(struct rdp_ctx *ctx, int64_t chunks);
+
+long long rdp_now();
 
 void free_connection(struct connection *connection);
 
-void init_connections(int n);
+void add_rdp_connection(struct rdp_ctx *ctx, struct connection *connection);
+
+void remove_rdp_connection(struct rdp_ctx *ctx, uint64_t server_id);
+
+void rdp_close(struct rdp_ctx *ctx, struct connection *cnt);
+
+struct connection *find_rdp_connection(struct rdp_ctx *ctx, struct sockaddr_in addr, int client_id);
+
+struct connection *find_connection_by_address(struct rdp_ctx *ctx, struct sockaddr_in addr);
+
+int same_address(struct sockaddr_in a, struct sockaddr_in b);
+
+int count_rdp_connections(struct rdp_ctx *ctx);
 
-void free_all_rdp_connections();
+void init_admission(struct rdp_ctx *ctx, int active, int queued, int64_t chunks);
 
-void add_rdp_connection(struct connection *connection);
+int find_queued_connection(struct rdp_ctx *ctx, struct sockaddr_in addr, int client_id);
 
-void remove_rdp_connection(int client_id);
+int estimate_wait(struct rdp_ctx *ctx, int position);
 
-void rdp_close(struct connection *cnt);
+struct connection *rdp_admit_next(struct rdp_ctx *ctx);
 
-int check_client_id(int client_id);
+void rdp_close_admission(struct rdp_ctx *ctx, int fd, int reason);
 
 
 
@@ -0,0 +1,567 @@
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+/*****************************************************************************
+------------------------------- RDP CLIENT -----------------------------------
+******************************************************************************
+
+  Client side of RDP as a non-blocking state machine. A download owns its
+  own UDP socket, which the application can put in select, poll or epoll
+  together with anything else it waits for. When the socket is readable, or
+  when the time from rdp_download_timeout has passed, the application calls
+  rdp_download_process. It reads every packet waiting on the socket without
+  blocking, sends connection requests again when they are due, and hands
+  every chunk that can be delivered in order to a callback. Nothing is kept
+  in globals, so one process can run many downloads at the same time.
+
+  Every ack advertises how many more chunks the reorder buffer can take, and
+  the server sends no more than that. A callback that can not take a chunk
+  yet returns RDP_CHUNK_LATER, chunks then pile up in the buffer until its
+  window is closed, instead of being dropped and sent again. When space
+  frees up the client says so, and the server probes a closed window in
+  case that update is lost.
+
+******************************************************************************/
+
+#define STATE_CONNECTING 0
+#define STATE_TRANSFER 1
+#define STATE_DONE 2
+#define STATE_FAILED 3
+
+struct rdp_download {
+    int fd;
+    int state;
+    int client_id;
+    int64_t start_chunk;
+    struct rdp_range range;
+    unsigned char options;
+    uint64_t cookie;
+    struct sockaddr_in server_addr;
+
+    /* Connection request is sent again at retry_ms, waiting longer each time */
+    int attempts;
+    int timeout_ms;
+    long long retry_ms;
+
+    /* Chunks received out of order, indexed by chunk % RDP_MAX_WINDOW
+     * Chunks are counted within the range, from 0 */
+    struct rdp_packet *reorder[RDP_MAX_WINDOW];
+    int64_t recv_next;
+
+    /* Receive window in the last ack, and whether the callback put off a chunk */
+    int window_sent;
+    int deferred;
+
+    long long last_heard_ms;
+    uint32_t digest;
+
+    /* Packets read and not handled yet */
+    struct rdp_batch batch;
+
+    /* Receive buffer, made larger when its queue drops data packets */
+    struct sockbuf sockbuf;
+
+    /* Samples from the timestamps of data packets, with RDP_OPT_TSTAMP */
+    struct rdp_latency latency;
+};
+
+
+
+/**
+ * Send the connection request of a download
+ * The starting chunk is carried in metadata so interrupted transfers can resume
+ * and the options the client supports in the unnassigned byte. A download of
+ * only part of the file carries its range as payload, and a client the server
+ * asked for a cookie sends it back
+ */
+static void send_connect(struct rdp_download *d) {
+    struct rdp_range *range = (d -> options & RDP_OPT_RANGE) ? &d -> range : NULL;
+    struct rdp_packet *pkt = make_rdp_packet(0x01, 0, 0, d -> options, d -> client_id, 0, d -> start_chunk, (char *) range);
+    pkt -> cookie = d -> cookie;
+    unsigned int size;
+    char *convert = get_packet(pkt, &size);
+
+    ssize_t wc = send_packet(d -> fd, convert, size, 0, (struct sockaddr*) &d -> server_addr, sizeof(d -> server_addr));
+    check_error(wc, "send_packet");
+
+    free(pkt);
+    free(convert);
+}
+
+
+
+/**
+ * Free receive window: chunks the reorder buffer can take past those it
+ * holds in order. The server may have every chunk up to there acked, so
+ * the window reaches at most RDP_MAX_WINDOW chunks past recv_next, the
+ * last chunk store_chunk keeps
+ */
+static int free_window(struct rdp_download *d) {
+    int held = 0;
+    while(held < RDP_MAX_WINDOW && d -> reorder[(d -> recv_next + held) % RDP_MAX_WINDOW] != NULL) {
+        held++;
+    }
+    return RDP_MAX_WINDOW - held;
+}
+
+
+
+/**
+ * Store a data packet in the reorder buffer and ack it
+ * The server has up to RDP_MAX_WINDOW / 2 chunks in flight, so a packet is
+ * either one of the next RDP_MAX_WINDOW chunks or a chunk already delivered
+ * whose ack was lost. Old chunks are acked again and dropped. The ack echoes
+ * the timestamp of a data packet that has one, and carries the free window
+ * @param pkt: data or accept packet, freed unless it is kept in the buffer
+ */
+static void store_chunk(struct rdp_download *d, struct rdp_packet *pkt) {
+    int offset = (unsigned char) (pkt -> pktseq - rdp_chunk_seq(d -> recv_next));
+    int kept = 0;
+
+    /* Chunk too far ahead to be in the window, the server sends it again later */
+    if(offset >= RDP_MAX_WINDOW && offset < 256 - RDP_MAX_WINDOW) {
+        free(pkt);
+        return;
+    }
+
+    if(offset < RDP_MAX_WINDOW) {
+        int slot = (d -> recv_next + offset) % RDP_MAX_WINDOW;
+        if(d -> reorder[slot] == NULL) {
+            d -> reorder[slot] = pkt;
+            kept = 1;
+        }
+    }
+
+    /* The echo leaves out the time the packet waited here */
+    uint32_t tsecr = 0;
+    if(rdp_has_tstamp(pkt -> flag, pkt -> unnassigned)) {
+        uint32_t stamp = d -> batch.last_stamp;
+        rdp_latency_sample(&d -> latency, pkt, stamp);
+        tsecr = pkt -> tsval + (rdp_tstamp_now() - stamp);
+    }
+
+    d -> window_sent = free_window(d);
+    ssize_t wc = rdp_send_ack(d -> fd, d -> server_addr, pkt -> pktseq, tsecr, d -> window_sent);
+    check_error(wc, "rdp_send_ack");
+
+    if(!kept) {
+        free(pkt);
+    }
+}
+
+
+
+/**
+ * Reject (0x20) while connecting ends the download, with the reason in metadata
+ */
+static void on_reject(struct rdp_download *d, struct rdp_packet *pkt) {
+    printf("NOT CONNECTED: %llu %llu\n", (unsigned long long) pkt -> recvid, (unsigned long long) pkt -> senderid);
+    if(pkt -> metadata == 1) {
+        printf(" - Client-id is already connected to server\n");
+    } else if(pkt -> metadata == 2) {
+        printf(" - Server has no more files to send\n");
+    } else if(pkt -> metadata == 3) {
+        printf(" - Server is busy, please try again later\n");
+    } else if(pkt -> metadata == 4) {
+        printf(" - Server sends a live stream, it can not be split\n");
+    } else if(pkt -> metadata == RDP_END_CHANGED) {
+        printf(" - File changed on the server while it was served\n");
+    }
+    d -> state = STATE_FAILED;
+    free(pkt);
+}
+
+
+
+/**
+ * Wait (0x40) means the request is queued, metadata holds the estimated wait
+ * The client waits that long for the accept, then asks again
+ * A wait with a cookie means the server is flooded with connection requests,
+ * the request is sent again right away with the cookie
+ */
+static void on_wait(struct rdp_download *d, struct rdp_packet *pkt) {
+    if(pkt -> unnassigned & RDP_OPT_COOKIE) {
+        d -> cookie = pkt -> cookie;
+        d -> options |= RDP_OPT_COOKIE;
+        send_connect(d);
+        d -> attempts = 1;
+        d -> timeout_ms = RDP_CONNECT_TIMEOUT;
+        d -> retry_ms = rdp_now() + d -> timeout_ms;
+        free(pkt);
+        return;
+    }
+
+    printf("QUEUED: estimated wait %lld ms\n", (long long) pkt -> metadata);
+    d -> attempts = 0;
+    d -> timeout_ms = pkt -> metadata < RDP_CONNECT_TIMEOUT ? RDP_CONNECT_TIMEOUT
+                    : pkt -> metadata > RDP_QUEUE_POLL_MAX ? RDP_QUEUE_POLL_MAX : pkt -> metadata;
+    d -> retry_ms = rdp_now() + d -> timeout_ms;
+    free(pkt);
+}
+
+
+
+/**
+ * Accept (0x10) may carry the first chunk of the file. If the accept was
+ * lost and a data packet (0x04) arrives instead, the download is accepted as well
+ */
+static void on_accept(struct rdp_download *d, struct rdp_packet *pkt) {
+    printf("CONNECTED: %llu %016llx\n", (unsigned long long) pkt -> senderid, (unsigned long long) pkt -> recvid);
+    d -> state = STATE_TRANSFER;
+    if(pkt -> metadata > 0) {
+        store_chunk(d, pkt);
+        return;
+    }
+    free(pkt);
+}
+
+
+
+/**
+ * Data, or an accept sent again with the first chunk, during the transfer
+ */
+static void on_data(struct rdp_download *d, struct rdp_packet *pkt) {
+    if(pkt -> metadata > 0) {
+        store_chunk(d, pkt);
+        return;
+    }
+    free(pkt);
+}
+
+
+
+/**
+ * EOF (0x20) ends the download with the digest of the file. The server sends
+ * EOF only when every chunk has been acked, so all of them are in the reorder
+ * buffer by then
+ */
+static void on_eof(struct rdp_download *d, struct rdp_packet *pkt) {
+    d -> digest = (uint32_t) pkt -> metadata;
+    d -> state = STATE_DONE;
+    ssize_t wc = rdp_end_connection(d -> fd, d -> server_addr, 0);
+    check_error(wc, "rdp_end_connection");
+    free(pkt);
+}
+
+
+
+/**
+ * End (0x02) from the server during the transfer means it can not go on,
+ * with the reason in metadata. The download fails
+ */
+static void on_end(struct rdp_download *d, struct rdp_packet *pkt) {
+    fprintf(stderr, "Server ended the connection");
+    if(pkt -> metadata == RDP_END_BEHIND) {
+        fprintf(stderr, ": fell behind the live stream");
+    } else if(pkt -> metadata == RDP_END_CHANGED) {
+        fprintf(stderr, ": the file changed on the server");
+    }
+    fprintf(stderr, "\n");
+    d -> state = STATE_FAILED;
+    free(pkt);
+}
+
+
+
+/**
+ * Keepalive probes (0x80) from the server are answered with the same packet,
+ * which tells a server probing a closed window how much it may send
+ */
+static void on_keepalive(struct rdp_download *d, struct rdp_packet *pkt) {
+    d -> window_sent = free_window(d);
+    ssize_t wc = rdp_send_keepalive(d -> fd, d -> server_addr, d -> window_sent);
+    check_error(wc, "rdp_send_keepalive");
+    free(pkt);
+}
+
+
+
+typedef void (*download_handler)(struct rdp_download *d, struct rdp_packet *pkt);
+
+// Indexed by state and rdp_packet_type, packets without a handler are dropped
+static const download_handler download_handlers[2][8] = {
+    [STATE_CONNECTING] = {
+        [2] = on_accept,        /* 0x04 */
+        [4] = on_accept,        /* 0x10 */
+        [5] = on_reject,        /* 0x20 */
+        [6] = on_wait,          /* 0x40 */
+    },
+    [STATE_TRANSFER] = {
+        [1] = on_end,           /* 0x02 */
+        [2] = on_data,          /* 0x04 */
+        [4] = on_data,          /* 0x10 */
+        [5] = on_eof,           /* 0x20 */
+        [7] = on_keepalive,     /* 0x80 */
+    },
+};
+
+
+
+/**
+ * Start a download, the connection request is sent right away
+ * @param server_addr: address of server
+ * @param start_chunk: first chunk of the file to receive, 0 for the whole file
+ * @param options: RDP_OPT_ bits the client supports, e.g. RDP_OPT_COMPRESS
+ * Returns the download, or NULL if the socket could not be made
+ */
+struct rdp_download *rdp_download_open(struct sockaddr_in server_addr, int64_t start_chunk, unsigned char options) {
+    return rdp_download_open_range(server_addr, start_chunk, 1, 0, 0, options);
+}
+
+
+
+/**
+ * Start a download of part of the file, the connection request is sent right away
+ * Chunks are delivered in order within the range: start_chunk, then every
+ * stride-th chunk after it. Downloads with the same group id are parts of one
+ * download to the server, e.g. stripes with stride K and start 0 to K - 1
+ * @param server_addr: address of server
+ * @param start_chunk: first chunk of the file to receive
+ * @param stride: distance between chunks, 1 for every chunk
+ * @param end: chunk to stop before, 0 for the end of the file
+ * @param group: id shared by the parts of one download, 0 if there are no other parts
+ * @param options: RDP_OPT_ bits the client supports, e.g. RDP_OPT_COMPRESS
+ * Returns the download, or NULL if the socket could not be made
+ */
+struct rdp_download *rdp_download_open_range(struct sockaddr_in server_addr,
+                                             int64_t start_chunk,
+                                             int stride,
+                                             int64_t end,
+                                             int group,
+                                             unsigned char options) {
+    struct rdp_download *d = calloc(1, sizeof(struct rdp_download));
+    if(d == NULL) {
+        fprintf(stderr, "malloc: could not allocate memory in rdp_download_open()\n");
+        return NULL;
+    }
+
+    d -> fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(d -> fd == -1 || fcntl(d -> fd, F_SETFL, O_NONBLOCK) == -1) {
+        perror("socket");
+        if(d -> fd != -1) {
+            close(d -> fd);
+        }
+        free(d);
+        return NULL;
+    }
+
+    /* Room for the largest window the server may give */
+    sockbuf_init(&d -> sockbuf);
+    sockbuf_enable(&d -> sockbuf, d -> fd);
+    sockbuf_tune(&d -> sockbuf, d -> fd, RDP_MAX_WINDOW, 0);
+    rdp_enable_timestamps(d -> fd);
+    rdp_latency_init(&d -> latency);
+
+    d -> state = STATE_CONNECTING;
+    d -> client_id = get_random_number();
+    d -> start_chunk = start_chunk;
+    d -> recv_next = 0;
+    d -> window_sent = RDP_MAX_WINDOW;
+    d -> options = options;
+    d -> range.group = group;
+    d -> range.stride = stride;
+    d -> range.end = end;
+    if(stride != 1 || end != 0 || group != 0) {
+        d -> options |= RDP_OPT_RANGE;
+    }
+    d -> server_addr = server_addr;
+
+    send_connect(d);
+    d -> attempts = 1;
+    d -> timeout_ms = RDP_CONNECT_TIMEOUT;
+    d -> retry_ms = rdp_now() + d -> timeout_ms;
+    d -> last_heard_ms = rdp_now();
+    return d;
+}
+
+
+
+/**
+ * Socket of a download, readable when rdp_download_process has packets to handle
+ */
+int rdp_download_fd(struct rdp_download *d) {
+    return d -> fd;
+}
+
+
+
+/**
+ * Time since the server last sent anything during the transfer
+ * Returns time in ms, 0 while the download is connecting or is finished
+ */
+int rdp_download_idle(struct rdp_download *d) {
+    if(d -> state != STATE_TRANSFER) {
+        return 0;
+    }
+    return (int) (rdp_now() - d -> last_heard_ms);
+}
+
+
+
+/**
+ * Longest time the application may wait before calling rdp_download_process
+ * even if the socket is not readable
+ * Returns time in ms, 0 if the download is finished or something is due now
+ */
+int rdp_download_timeout(struct rdp_download *d) {
+    long long due;
+
+    if(d -> state == STATE_CONNECTING) {
+        due = d -> retry_ms;
+    } else if(d -> state == STATE_TRANSFER) {
+        due = d -> last_heard_ms + RDP_IDLE_TIMEOUT;
+    } else if(d -> state == STATE_DONE && d -> deferred) {
+        return RDP_DELIVER_RETRY;
+    } else {
+        return 0;
+    }
+
+    long long now = rdp_now();
+    if(d -> deferred && due > now + RDP_DELIVER_RETRY) {
+        return RDP_DELIVER_RETRY;
+    }
+    return due <= now ? 0 : (int) (due - now);
+}
+
+
+
+/**
+ * Handle everything pending for a download without blocking
+ * 1. Reads every packet waiting on the socket in batches with recvmmsg,
+ *    dropping invalid and corrupt ones, and hands each to the handler for
+ *    its type in the current state, and doubles the receive buffer if its
+ *    queue has dropped packets
+ * 2. Sends the connection request again if no answer came in time, and gives
+ *    up after RDP_CONNECT_RETRIES tries
+ * 3. Gives up if nothing has been heard from the server for RDP_IDLE_TIMEOUT ms
+ * 4. Calls deliver for every chunk that is now next in order, until it puts
+ *    one off with RDP_CHUNK_LATER, and tells the server when a window it
+ *    had closed is open again
+ * @param d: download to process
+ * @param deliver: called with each chunk, in order
+ * @param arg: passed on to deliver
+ * Returns RDP_DOWNLOAD_ACTIVE while the download goes on, RDP_DOWNLOAD_DONE when the
+ * whole file has been delivered, and RDP_DOWNLOAD_FAILED if it can not be completed.
+ * The download is not done while the callback still puts off chunks
+ */
+int rdp_download_process(struct rdp_download *d, rdp_chunk_cb deliver, void *arg) {
+    struct rdp_batch *batch = &d -> batch;
+    struct sockaddr_in addr;
+    struct rdp_packet *pkt;
+
+    while(d -> state == STATE_CONNECTING || d -> state == STATE_TRANSFER) {
+        if((pkt = rdp_batch_next(batch, &addr)) == NULL) {
+            if(rdp_batch_recv(batch, d -> fd) == -1) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                    perror("recvmmsg");
+                    d -> state = STATE_FAILED;
+                }
+                break;
+            }
+            continue;
+        }
+
+        d -> last_heard_ms = rdp_now();
+        download_handler handler = download_handlers[d -> state][rdp_packet_type(pkt -> flag)];
+        if(handler != NULL) {
+            handler(d, pkt);
+        } else {
+            free(pkt);
+        }
+    }
+
+    /* Data packets dropped on this host are sent again by the server like
+     * any lost packet, a larger buffer keeps it from happening again */
+    if(sockbuf_tune(&d -> sockbuf, d -> fd, RDP_MAX_WINDOW, batch -> dropped)) {
+        fprintf(stderr, "Receive queue overflowed, %llu packets dropped on this host, receive buffer now %d bytes\n",
+                (unsigned long long) batch -> dropped, d -> sockbuf.rcvbuf);
+    }
+
+    long long now = rdp_now();
+    if(d -> state == STATE_CONNECTING && now >= d -> retry_ms) {
+        if(d -> attempts >= RDP_CONNECT_RETRIES) {
+            printf("No response from server. Please try again!\n");
+            d -> state = STATE_FAILED;
+        } else {
+            send_connect(d);
+            d -> attempts++;
+            d -> timeout_ms *= 2;
+            d -> retry_ms = now + d -> timeout_ms;
+        }
+    }
+    if(d -> state == STATE_TRANSFER && now - d -> last_heard_ms > RDP_IDLE_TIMEOUT) {
+        fprintf(stderr, "No packets from server for %d ms\n", RDP_IDLE_TIMEOUT);
+        d -> state = STATE_FAILED;
+    }
+
+    /* Deliver chunks in order, a chunk put off stays where it is */
+    struct rdp_packet *next;
+    d -> deferred = 0;
+    while(d -> state != STATE_FAILED && (next = d -> reorder[d -> recv_next % RDP_MAX_WINDOW]) != NULL) {
+        int rc = deliver(arg, next -> payload, next -> metadata, next -> unnassigned);
+        if(rc == RDP_CHUNK_LATER) {
+            d -> deferred = 1;
+            break;
+        }
+        d -> reorder[d -> recv_next % RDP_MAX_WINDOW] = NULL;
+        d -> recv_next++;
+        if(rc == -1) {
+            d -> state = STATE_FAILED;
+        }
+        free(next);
+    }
+
+    /* The server only probes a closed window now and then, an update gets it going sooner */
+    if(d -> state == STATE_TRANSFER && d -> window_sent == 0 && free_window(d) > 0) {
+        d -> window_sent = free_window(d);
+        ssize_t wc = rdp_send_keepalive(d -> fd, d -> server_addr, d -> window_sent);
+        check_error(wc, "rdp_send_keepalive");
+    }
+
+    if(d -> state == STATE_DONE) {
+        return d -> deferred ? RDP_DOWNLOAD_ACTIVE : RDP_DOWNLOAD_DONE;
+    }
+    return d -> state == STATE_FAILED ? RDP_DOWNLOAD_FAILED : RDP_DOWNLOAD_ACTIVE;
+}
+
+
+
+/**
+ * CRC32C of the whole file as sent by the server with EOF
+ * Only valid when rdp_download_process has returned RDP_DOWNLOAD_DONE
+ */
+uint32_t rdp_download_digest(struct rdp_download *d) {
+    return d -> digest;
+}
+
+
+
+/**
+ * Latency samples of a download, empty unless it was opened with RDP_OPT_TSTAMP
+ */
+const struct rdp_latency *rdp_download_latency(struct rdp_download *d) {
+    return &d -> latency;
+}
+
+
+
+/**
+ * Close the socket of a download and free it with any chunks not delivered
+ * A download stopped before it is done tells the server the connection has
+ * ended, so the server does not keep sending until it gives up on the client
+ */
+void rdp_download_close(struct rdp_download *d) {
+    if(d == NULL) {
+        return;
+    }
+    if(d -> state == STATE_CONNECTING || d -> state == STATE_TRANSFER) {
+        rdp_end_connection(d -> fd, d -> server_addr, 0);
+    }
+    for(int i = 0; i < RDP_MAX_WINDOW; i++) {
+        free(d -> reorder[i]);
+    }
+    close(d -> fd);
+    free(d);
+}
@@ -0,0 +1,48 @@
+#ifndef RDP_CLIENT_H
+#define RDP_CLIENT_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Results of rdp_download_process
+#define RDP_DOWNLOAD_FAILED -1
+#define RDP_DOWNLOAD_ACTIVE 0
+#define RDP_DOWNLOAD_DONE 1
+
+
+// Returned by the callback when it can not take a chunk yet. The chunk stays
+// in the reorder buffer, which the server is told has less room, and it is
+// offered again on a later rdp_download_process, RDP_DELIVER_RETRY ms later at most
+#define RDP_CHUNK_LATER 1
+#define RDP_DELIVER_RETRY 10
+
+
+// Called for every chunk delivered in order, returns 0 when the chunk is taken,
+// -1 to abort the download or RDP_CHUNK_LATER to put it off
+// options has RDP_OPT_COMPRESS set if data is compressed
+typedef int (*rdp_chunk_cb)(void *arg, char *data, int len, unsigned char options);
+
+// One download from a server, the struct is private to rdp_client.c
+struct rdp_download;
+
+
+struct rdp_download *rdp_download_open(struct sockaddr_in server_addr, int64_t start_chunk, unsigned char options);
+
+struct rdp_download *rdp_download_open_range(struct sockaddr_in server_addr, int64_t start_chunk, int stride, int64_t end, int group, unsigned char options);
+
+int rdp_download_fd(struct rdp_download *d);
+
+int rdp_download_timeout(struct rdp_download *d);
+
+int rdp_download_idle(struct rdp_download *d);
+
+int rdp_download_process(struct rdp_download *d, rdp_chunk_cb deliver, void *arg);
+
+uint32_t rdp_download_digest(struct rdp_download *d);
+
+const struct rdp_latency *rdp_download_latency(struct rdp_download *d);
+
+void rdp_download_close(struct rdp_download *d);
+
+
+#endif
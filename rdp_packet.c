@@ -1,54 +1,109 @@
+#define _GNU_SOURCE /* recvmmsg */
 #include "common.h"
 
 /*****************************************************************************
 ------------------------------- RDP PACKET -----------------------------------
 ******************************************************************************/
 
-unsigned char pktseq = 0b0000;
+/**
+ * Size of the payload that follows the header of a packet
+ * Data and accept packets carry metadata bytes, a connect packet may carry
+ * a range, all other packets have no payload
+ * @param flag: flag of packet
+ * @param options: option bits of packet
+ * @param metadata: metadata of packet in host byte order
+ */
+int rdp_payload_size(unsigned char flag, unsigned char options, int64_t metadata) {
+    if(flag == 0x04 || flag == 0x10) {
+        return metadata;
+    }
+    if(flag == 0x01 && (options & RDP_OPT_RANGE)) {
+        return sizeof(struct rdp_range);
+    }
+    return 0;
+}
+
+
+
+/**
+ * Check if a packet carries a cookie after its header fields
+ * @param flag: flag of packet
+ * @param options: option bits of packet
+ */
+int rdp_has_cookie(unsigned char flag, unsigned char options) {
+    return (flag == 0x01 || flag == 0x40) && (options & RDP_OPT_COOKIE);
+}
+
+
+
+/**
+ * Check if a packet carries timestamps after its header fields
+ * @param flag: flag of packet
+ * @param options: option bits of packet
+ */
+int rdp_has_tstamp(unsigned char flag, unsigned char options) {
+    return (flag == 0x04 || flag == 0x08) && (options & RDP_OPT_TSTAMP);
+}
+
+
+
+/**
+ * Current time for the timestamps of a packet, in microseconds
+ * The wall clock is used since the kernel stamps received datagrams with
+ * it, and only the low 32 bits are kept, differences of them are right as
+ * long as they are below 71 minutes
+ */
+uint32_t rdp_tstamp_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint32_t) ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+
 
 /**
  * Makes rdp packet used by protocol for communication between client and server
  * @param flag: defining different types of packets
  * @param pktseq: sequence number of packet
  * @param ackseq: sequence number ACK-ed by packet
- * @param unnassigned: unused, that is, always 0
- * @param senderid: sender ́s connection ID in network byte order
- * @param recvid: receiver ́s connection ID in network byte order
- * @param metadata: integer value in network byte order whose interpretation depends on the value of flags
+ * @param unnassigned: option bits, RDP_OPT_COMPRESS, otherwise 0
+ * @param senderid: sender ́s connection ID
+ * @param recvid: receiver ́s connection ID
+ * @param metadata: integer value whose interpretation depends on the value of flags
+ * All values are in host byte order, get_packet() encodes them and adds the checksum
+ * The cookie is 0, the caller sets it on connect and wait packets with RDP_OPT_COOKIE,
+ * and so are the timestamps, set on data and ack packets with RDP_OPT_TSTAMP
  * @param payload: the number of bytes indicated by the previous integer value, max 1000 bytes
+ *                 or a struct rdp_range for a connect packet with RDP_OPT_RANGE
  */
 struct rdp_packet *make_rdp_packet( unsigned char flag,
                                     unsigned char pktseq,
                                     unsigned char ackseq,
                                     unsigned char unnassigned,
-                                    int senderid,
-                                    int recvid,
-                                    int metadata,
+                                    uint64_t senderid,
+                                    uint64_t recvid,
+                                    int64_t metadata,
                                     char *payload){
     /* Define packet pointer */
     struct rdp_packet *pkt;
 
     /* If payload is to large */
-    if(metadata > 999) {
+    if((flag == 0x04 || flag == 0x10) && metadata > 999) {
         metadata = 999;
         pkt = malloc(sizeof(struct rdp_packet) + metadata);
         printf("Packet can not contain more then 1000 bytes!\n");
     }
 
-    /* If metadata is used for error messages */
-    else if(flag == 0x20){
-        pkt = malloc(sizeof(struct rdp_packet));
-    }
-
-    /* Allocate memory for normal payload packet */
+    /* If metadata is used for error messages or connection parameters
+     * Accept packets (0x10) may carry data like data packets, and
+     * connect packets a range */
     else {
-        pkt = malloc(sizeof(struct rdp_packet) + metadata);
+        pkt = malloc(sizeof(struct rdp_packet) + rdp_payload_size(flag, unnassigned, metadata));
     }
 
     /* Error allocating */
     if (pkt == NULL) {
         fprintf(stderr, "malloc: could not allacoate memory in make_rdp_packet()\n");
-        free_all_rdp_connections();
         exit(EXIT_FAILURE);
     }
 
@@ -60,10 +115,14 @@ struct rdp_packet *make_rdp_packet( unsigned char flag,
     pkt -> senderid = senderid;
     pkt -> recvid = recvid;
     pkt -> metadata = metadata;
+    pkt -> checksum = 0;
+    pkt -> cookie = 0;
+    pkt -> tsval = 0;
+    pkt -> tsecr = 0;
 
     /* Allocate memory if payload in packet */
     if(payload != NULL) {
-      memcpy(pkt -> payload, payload, metadata);
+      memcpy(pkt -> payload, payload, rdp_payload_size(flag, unnassigned, metadata));
     }
 
     /* Return "filled" packet */
@@ -72,43 +131,164 @@ struct rdp_packet *make_rdp_packet( unsigned char flag,
 
 
 
+/**
+ * Write an unsigned integer as a varint, 7 bits per byte with the lowest
+ * bits first and the high bit set on every byte but the last
+ * @param p: where to write, room for RDP_VARINT_MAX bytes
+ * @param v: value to write
+ * Returns number of bytes written
+ */
+static int put_varint(unsigned char *p, uint64_t v) {
+    int n = 0;
+
+    while(v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+
+
+/**
+ * Read a varint written by put_varint
+ * @param p: first byte of varint
+ * @param end: first byte after the packet
+ * @param v: where to store the value
+ * Returns number of bytes read, -1 if the varint runs past end or is too long
+ */
+static int get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+    uint64_t value = 0;
+
+    for(int n = 0; n < RDP_VARINT_MAX && p + n < end; n++) {
+        value |= (uint64_t) (p[n] & 0x7f) << (7 * n);
+        if(!(p[n] & 0x80)) {
+            *v = value;
+            return n + 1;
+        }
+    }
+    return -1;
+}
+
+
+
 /**
  * Function for converting rdp_packet for sending
+ * Writes the compact wire format described in rdp_packet.h: fields that are 0
+ * are left out, ids and metadata are varints, and the metadata of data and
+ * accept packets is not sent since the payload length gives it. A CRC32C over
+ * everything before it ends the packet
  * @param pkt: rdp_packet to be converted
  * @param size: pointer for getting size of converted packet
  */
 char *get_packet(struct rdp_packet *pkt, unsigned int *size) {
-    int total_size;
+    int payload_size = rdp_payload_size(pkt -> flag, pkt -> unnassigned, pkt -> metadata);
+    int has_range = pkt -> flag == 0x01 && (pkt -> unnassigned & RDP_OPT_RANGE);
+    int n = 2;
 
-    /* Get total size of packet */
-    if(pkt -> flag == 0x04){
-      total_size = sizeof(struct rdp_packet) + pkt -> metadata;
+    /* A range takes up to three varints */
+    if(has_range) {
+        payload_size = 3 * RDP_VARINT_MAX;
     }
 
-    /* Packet without payload */
-    else {
-      total_size = sizeof(struct rdp_packet);
-    }
-
-    /* Allocate memory */
-    struct rdp_packet *to_send = malloc(total_size);
+    /* Allocate memory for the largest header, payload and checksum */
+    unsigned char *d = malloc(RDP_MAX_HEADER + payload_size + RDP_CHECKSUM_SIZE);
 
     /* Error allocating */
-    if (to_send == NULL) {
+    if (d == NULL) {
         fprintf(stderr, "malloc: could not allacoate memory in get_packet()\n");
-        free_all_rdp_connections();
         exit(EXIT_FAILURE);
     }
 
-    /* Copy memory, and convert integers to network byte order */
-    memcpy(to_send, pkt, total_size);
-    to_send -> senderid = htonl(to_send -> senderid);
-    to_send -> recvid = htonl(to_send -> recvid);
-    to_send -> metadata = htonl(to_send -> metadata);
+    /* Flag first, send_packet looks at it. Then version and present fields */
+    d[0] = pkt -> flag;
+    d[1] = RDP_WIRE_VERSION << 6;
+    if(pkt -> pktseq) {
+        d[1] |= RDP_HDR_PKTSEQ;
+        d[n++] = pkt -> pktseq;
+    }
+    if(pkt -> ackseq) {
+        d[1] |= RDP_HDR_ACKSEQ;
+        d[n++] = pkt -> ackseq;
+    }
+    if(pkt -> unnassigned) {
+        d[1] |= RDP_HDR_OPTIONS;
+        d[n++] = pkt -> unnassigned;
+    }
+    if(pkt -> senderid) {
+        d[1] |= RDP_HDR_SENDER;
+        n += put_varint(d + n, pkt -> senderid);
+    }
+    if(pkt -> recvid) {
+        d[1] |= RDP_HDR_RECV;
+        n += put_varint(d + n, pkt -> recvid);
+    }
+    if(pkt -> metadata && pkt -> flag != 0x04 && pkt -> flag != 0x10) {
+        d[1] |= RDP_HDR_META;
+        n += put_varint(d + n, (uint64_t) pkt -> metadata);
+    }
+    if(rdp_has_cookie(pkt -> flag, pkt -> unnassigned)) {
+        for(int i = 7; i >= 0; i--) {
+            d[n++] = pkt -> cookie >> (8 * i);
+        }
+    }
+    if(rdp_has_tstamp(pkt -> flag, pkt -> unnassigned)) {
+        for(int i = 3; i >= 0; i--) {
+            d[n++] = pkt -> tsval >> (8 * i);
+        }
+        for(int i = 3; i >= 0; i--) {
+            d[n++] = pkt -> tsecr >> (8 * i);
+        }
+    }
+
+    /* Payload, the range of a connect packet as three varints */
+    if(has_range) {
+        struct rdp_range *range = (struct rdp_range *) pkt -> payload;
+        n += put_varint(d + n, (uint32_t) range -> group);
+        n += put_varint(d + n, (uint32_t) range -> stride);
+        n += put_varint(d + n, (uint64_t) range -> end);
+    }
+    else if(payload_size > 0) {
+        memcpy(d + n, pkt -> payload, payload_size);
+        n += payload_size;
+    }
+
+    /* Checksum in network byte order */
+    uint32_t crc = crc32c(0, d, n);
+    d[n++] = crc >> 24;
+    d[n++] = crc >> 16;
+    d[n++] = crc >> 8;
+    d[n++] = crc;
 
     /* Dereference pointer, get total size, cast to char pointer */
-    *size = total_size;
-    return (char *)to_send;
+    *size = n;
+    return (char *) d;
+}
+
+
+
+/**
+ * Verify received packet before opening it
+ * @param d: received bytes
+ * @param size: number of bytes received
+ * Return -1 if packet is too short, of another wire version or checksum does not match
+ * Return 0 if packet is intact
+ */
+int verify_rdp_packet(char *d, unsigned int size) {
+    unsigned char *p = (unsigned char *) d;
+
+    if(size < RDP_MIN_PACKET || (p[1] >> 6) != RDP_WIRE_VERSION) {
+        return -1;
+    }
+
+    /* Checksum covers everything before it */
+    unsigned char *c = p + size - RDP_CHECKSUM_SIZE;
+    uint32_t checksum = (uint32_t) c[0] << 24 | (uint32_t) c[1] << 16 | (uint32_t) c[2] << 8 | c[3];
+    if(crc32c(0, d, size - RDP_CHECKSUM_SIZE) != checksum) {
+        return -1;
+    }
+    return 0;
 }
 
 
@@ -117,26 +297,104 @@ char *get_packet(struct rdp_packet *pkt, unsigned int *size) {
  * Open rdp_packet after sending
  * @param converted_packet: rdp packet to open
  * @param size: size of packet
- * Function convert integers in packet from network byte order to host byte order
- * Allocate memory for packet with size equal argument size and memcpy content in packet
+ * Function decodes the compact wire format into a struct rdp_packet in host
+ * byte order, fields that were left out are 0
+ * Returns NULL if the packet is corrupt, the caller treats it as lost
+ * A connect packet with RDP_OPT_RANGE but no valid range is corrupt as well
  */
 struct rdp_packet* open_rdp_packet(char *d, unsigned int size) {
+    const unsigned char *p = (const unsigned char *) d;
+    const unsigned char *end = p + size - RDP_CHECKSUM_SIZE;
+    const unsigned char *at = p + 2;
+    uint64_t v[3] = {0, 0, 0};
+    int n;
+
+    /* Drop packet if checksum does not match */
+    if(verify_rdp_packet(d, size) == -1) {
+        fprintf(stderr, "Dropping corrupt packet\n");
+        return NULL;
+    }
 
-    /* Allocate memory for rdp_packet */
-    struct rdp_packet *pkt = malloc(size);
+    /* Room for the struct and the largest payload the packet can hold */
+    struct rdp_packet *pkt = malloc(sizeof(struct rdp_packet) + size + sizeof(struct rdp_range));
 
     /* Check successful memory allocation */
     if (pkt == NULL) {
         fprintf(stderr, "malloc: could not allacoate memory in open_rdp_packet()\n");
-        free_all_rdp_connections();
         exit(EXIT_FAILURE);
     }
+    memset(pkt, 0, sizeof(struct rdp_packet));
+
+    /* Single byte fields, then varints, in the order of their bits */
+    unsigned char present = p[1];
+    unsigned char *bytes[3] = {&pkt -> pktseq, &pkt -> ackseq, &pkt -> unnassigned};
+    uint64_t *ids[2] = {&pkt -> senderid, &pkt -> recvid};
+    pkt -> flag = p[0];
+    for(int i = 0; i < 6; i++) {
+        if(!(present & (1 << i))) {
+            continue;
+        }
+        if(i < 3 && at < end) {
+            *bytes[i] = *at++;
+        }
+        else if(i >= 3 && (n = get_varint(at, end, &v[0])) != -1) {
+            if(i == 5) {
+                pkt -> metadata = (int64_t) v[0];
+            } else {
+                *ids[i - 3] = v[0];
+            }
+            at += n;
+        }
+        else {
+            fprintf(stderr, "Dropping truncated packet\n");
+            free(pkt);
+            return NULL;
+        }
+    }
+    if(rdp_has_cookie(pkt -> flag, pkt -> unnassigned)) {
+        if(end - at < RDP_COOKIE_SIZE) {
+            fprintf(stderr, "Dropping truncated packet\n");
+            free(pkt);
+            return NULL;
+        }
+        for(int i = 0; i < RDP_COOKIE_SIZE; i++) {
+            pkt -> cookie = pkt -> cookie << 8 | *at++;
+        }
+    }
+    if(rdp_has_tstamp(pkt -> flag, pkt -> unnassigned)) {
+        if(end - at < RDP_TSTAMP_SIZE) {
+            fprintf(stderr, "Dropping truncated packet\n");
+            free(pkt);
+            return NULL;
+        }
+        for(int i = 0; i < 4; i++) {
+            pkt -> tsval = pkt -> tsval << 8 | *at++;
+        }
+        for(int i = 0; i < 4; i++) {
+            pkt -> tsecr = pkt -> tsecr << 8 | *at++;
+        }
+    }
+    pkt -> checksum = (uint32_t) end[0] << 24 | (uint32_t) end[1] << 16 | (uint32_t) end[2] << 8 | end[3];
 
-    /* Convert received rdp_packet and assign to struct */
-    memcpy(pkt, d, size);
-    pkt -> senderid = ntohl(pkt -> senderid);
-    pkt -> recvid = ntohl(pkt -> recvid);
-    pkt -> metadata = ntohl(pkt -> metadata);
+    /* Payload of data and accept packets is the rest of the datagram */
+    if(pkt -> flag == 0x04 || pkt -> flag == 0x10) {
+        pkt -> metadata = end - at;
+        memcpy(pkt -> payload, at, end - at);
+    }
+    else if(pkt -> flag == 0x01 && (pkt -> unnassigned & RDP_OPT_RANGE)) {
+        for(int i = 0; i < 3; i++) {
+            if((n = get_varint(at, end, &v[i])) == -1) {
+                fprintf(stderr, "Dropping connect packet without range\n");
+                free(pkt);
+                return NULL;
+            }
+            at += n;
+        }
+        struct rdp_range *range = (struct rdp_range *) pkt -> payload;
+        range -> group = (int) (uint32_t) v[0];
+        range -> stride = (int) (uint32_t) v[1];
+        range -> end = (int64_t) v[2];
+    }
 
     return pkt;
 }
@@ -153,9 +411,10 @@ void print_rdp_packet(struct rdp_packet *pkt) {
     printf("%d\n", pkt -> pktseq);
     printf("%d\n", pkt -> ackseq);
     printf("%d\n", pkt -> unnassigned);
-    printf("%d\n", pkt -> senderid);
-    printf("%d\n", pkt -> recvid);
-    printf("%d\n", pkt -> metadata);
+    printf("%llu\n", (unsigned long long) pkt -> senderid);
+    printf("%llu\n", (unsigned long long) pkt -> recvid);
+    printf("%lld\n", (long long) pkt -> metadata);
+    printf("%u\n", pkt -> checksum);
     printf("%s\n", pkt -> payload);
 }
 
@@ -163,63 +422,198 @@ void print_rdp_packet(struct rdp_packet *pkt) {
 
 /**
  * Random number generator used for creating client id's
- * Will generate a random number between 0 - 999 and return
+ * Will generate a random number between 1 - 999999 and return
+ * A client may run many downloads split over several connections each, so the
+ * range is wide enough that their ids seldom collide. 0 is kept for "no id"
+ * The caller seeds rand once, so downloads started in the same second get different ids
  */
 int get_random_number(){
-  time_t t;
-  srand((unsigned) time(&t));
-  int random_number_1 = 0 + rand() % 999;
+  int random_number_1 = 1 + rand() % 999999;
   return random_number_1;
 }
 
 
 
 /**
- * Function for generating packet sequence number
- * Update number for each packet generated by rdp_write()
- * Update sequence number by 1 when called
- * @param retry: retry mode - no update of pktseq when trying to send previous packet
+ * Number of a packet type, used to index dispatch tables
+ * @param flag: flag of a packet that passed validation, exactly one bit is set
+ * Returns 0 for 0x01 up to 7 for 0x80
+ */
+int rdp_packet_type(unsigned char flag) {
+    return __builtin_ctz(flag);
+}
+
+
+
+/*****************************************************************************
+------------------------- RDP PACKET VALIDATION ------------------------------
+******************************************************************************/
+
+// Header fields each packet type must have and may have, see rdp_packet.h
+// Fields that are 0 are not sent, so only client ids, which never are, can be
+// required. Flags without an entry are not packet types
+struct rdp_flag_rule {
+  unsigned char valid;
+  unsigned char required;
+  unsigned char allowed;
+};
+
+static const struct rdp_flag_rule rdp_flag_rules[256] = {
+  [0x01] = {1, RDP_HDR_SENDER, RDP_HDR_OPTIONS | RDP_HDR_SENDER | RDP_HDR_META},
+  [0x02] = {1, 0, RDP_HDR_META},
+  [0x04] = {1, 0, RDP_HDR_PKTSEQ | RDP_HDR_OPTIONS},
+  [0x08] = {1, 0, RDP_HDR_ACKSEQ | RDP_HDR_OPTIONS | RDP_HDR_META},
+  [0x10] = {1, RDP_HDR_SENDER, RDP_HDR_PKTSEQ | RDP_HDR_OPTIONS | RDP_HDR_SENDER | RDP_HDR_RECV},
+  [0x20] = {1, 0, RDP_HDR_RECV | RDP_HDR_META},
+  [0x40] = {1, RDP_HDR_RECV, RDP_HDR_OPTIONS | RDP_HDR_RECV | RDP_HDR_META},
+  [0x80] = {1, 0, RDP_HDR_OPTIONS | RDP_HDR_META},
+};
+
+
+
+/**
+ * Check the header of a received packet before it is decoded
+ * One table lookup on the flag replaces checking its bits one by one: the
+ * flag must be a packet type, and the fields present must be the ones the
+ * type has. Written without branches so rdp_validate_batch runs straight
+ * through a batch
+ * @param d: received bytes, at least 2 bytes of buffer even if size is smaller
+ * @param size: number of bytes received
+ * Returns 1 if the header is valid, 0 if not. The checksum is checked by open_rdp_packet
  */
-char get_pktseq(int retry) {
-    int seq = (int) pktseq;
+int rdp_header_valid(const char *d, unsigned int size) {
+    const unsigned char *p = (const unsigned char *) d;
+    const struct rdp_flag_rule *rule = &rdp_flag_rules[p[0]];
+    unsigned char present = p[1] & 0x3f;
+
+    return (size >= RDP_MIN_PACKET)
+         & ((p[1] >> 6) == RDP_WIRE_VERSION)
+         & rule -> valid
+         & ((present & ~rule -> allowed) == 0)
+         & ((present & rule -> required) == rule -> required);
+}
+
+
 
-    if(retry == 1){
-        char new_seq = (unsigned char) seq;
-        return new_seq;
+/**
+ * Validate the headers of every packet in a batch in one pass
+ * @param b: batch filled by rdp_batch_recv
+ */
+void rdp_validate_batch(struct rdp_batch *b) {
+    for(int i = 0; i < b -> count; i++) {
+        b -> valid[i] = rdp_header_valid(b -> buf[i], b -> len[i]);
     }
+}
+
 
-    seq += 1;
-    char new_seq = (unsigned char) seq;
-    pktseq = new_seq;
-    return new_seq;
+
+/**
+ * Make the kernel stamp every datagram with the time it came in
+ * @param fd: socket read with rdp_batch_recv
+ * Returns -1 if it can not, then datagrams are stamped when they are read
+ */
+int rdp_enable_timestamps(int fd) {
+    int one = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == -1) {
+        perror("setsockopt: SO_TIMESTAMPNS");
+        return -1;
+    }
+    return 0;
 }
 
 
 
 /**
- * Check bits in flag
- * @param flag: flag to check
- * @param size: size of flag datatype
- * Return -1 if more then 1 bit in flag is 1
- * Return 0 if there only are 1 or less bits in flag with 1
+ * Take what the kernel sent with a datagram: the drop counter and the time it came in
+ * The counter only grows, so a new value tells how many datagrams were
+ * dropped on this host since the last one, not on the path
+ * @param i: index of datagram in batch
  */
-int check_bits_flag(void *flag, int size){
-    int counter = 0;
-    unsigned char *to_bits = (unsigned char *) flag;
-    for(int x = size - 1; x >= 0; x--){
-        for(int y = 7; y >= 0; y--){
-            char bit = (to_bits[x] & (1 << y)) ? '1' : '0';
-            if(bit == '1'){
-                counter++;
-            }
+static void rdp_batch_control(struct rdp_batch *b, int i, struct msghdr *msg) {
+    for(struct cmsghdr *c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+        if(c -> cmsg_level == SOL_SOCKET && c -> cmsg_type == SO_RXQ_OVFL) {
+            uint32_t counter;
+            memcpy(&counter, CMSG_DATA(c), sizeof(counter));
+            b -> dropped += (uint32_t) (counter - b -> drop_counter);
+            b -> drop_counter = counter;
+        }
+        else if(c -> cmsg_level == SOL_SOCKET && c -> cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            b -> stamp[i] = (uint32_t) ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
         }
     }
+}
 
-    if(counter > 1){
+
+
+/**
+ * Read every datagram waiting on a socket, up to RDP_RECV_BATCH, with one
+ * recvmmsg call and validate their headers
+ * @param b: batch to fill, packets still in it are dropped
+ * @param fd: socket to read from, read without blocking
+ * Returns number of datagrams read, -1 with errno set if none could be read
+ */
+int rdp_batch_recv(struct rdp_batch *b, int fd) {
+    struct mmsghdr msgs[RDP_RECV_BATCH];
+    struct iovec iov[RDP_RECV_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < RDP_RECV_BATCH; i++) {
+        iov[i].iov_base = b -> buf[i];
+        iov[i].iov_len = RDP_DATAGRAM_MAX;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &b -> addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_control = b -> control[i];
+        msgs[i].msg_hdr.msg_controllen = RDP_BATCH_CONTROL;
+    }
+
+    b -> count = 0;
+    b -> next = 0;
+    int rc = recvmmsg(fd, msgs, RDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+    if(rc == -1) {
         return -1;
     }
 
-    return 0;
+    /* A datagram cut to fit the buffer is not a packet of ours. Datagrams the
+     * kernel did not stamp get the time they were read */
+    uint32_t now = rdp_tstamp_now();
+    for(int i = 0; i < rc; i++) {
+        b -> len[i] = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : msgs[i].msg_len;
+        b -> stamp[i] = now;
+        rdp_batch_control(b, i, &msgs[i].msg_hdr);
+    }
+    b -> count = rc;
+    rdp_validate_batch(b);
+    return rc;
+}
+
+
+
+/**
+ * Next packet of a batch that passed validation, decoded
+ * Packets with an invalid header or a wrong checksum are skipped
+ * @param b: batch filled by rdp_batch_recv
+ * @param addr: set to the address the packet came from
+ * Returns the packet, to be freed by the caller, or NULL when the batch is used up
+ */
+struct rdp_packet *rdp_batch_next(struct rdp_batch *b, struct sockaddr_in *addr) {
+    while(b -> next < b -> count) {
+        int i = b -> next++;
+        if(!b -> valid[i]) {
+            fprintf(stderr, "Dropping invalid packet\n");
+            continue;
+        }
+        struct rdp_packet *pkt = open_rdp_packet(b -> buf[i], b -> len[i]);
+        if(pkt != NULL) {
+            *addr = b -> addr[i];
+            b -> last_stamp = b -> stamp[i];
+            return pkt;
+        }
+    }
+    return NULL;
 }
 
 /****************************************************************************/
@@ -12,23 +12,139 @@
 #include <sys/select.h>
 #include <time.h>
 
+// Option bits carried in the unnassigned byte
+// In a connect packet: client can receive compressed payloads
+// In a data packet: payload is lz compressed
+#define RDP_OPT_COMPRESS 0x01
+
+// In a connect packet: a struct rdp_range follows the header
+#define RDP_OPT_RANGE 0x02
+
+// In a wait packet: a cookie the client must send back in its connection request
+// In a connect packet: the cookie from the server
+#define RDP_OPT_COOKIE 0x04
+
+// In a connect packet: client echoes timestamps
+// In data and ack packets: tsval and tsecr follow the header, see rdp_tstamp_now
+#define RDP_OPT_TSTAMP 0x08
+
+// In ack and keepalive packets from the client: metadata is its free receive
+// window in chunks, the sender never has more than that beyond the last ack
+#define RDP_OPT_WINDOW 0x10
+
+// Wire format, version RDP_WIRE_VERSION. Integers are written byte by byte,
+// never through a packed struct:
+//   flag          1 byte, first so send_packet can see it
+//   version/bits  1 byte, version in the top two bits, below it one bit for
+//                 each of the fields that follow which is present
+//   pktseq, ackseq, options   1 byte each, left out when 0
+//   senderid, recvid, metadata  varints, left out when 0, all 64 bits
+//   cookie        connect and wait packets with RDP_OPT_COOKIE: 8 bytes big endian
+//   tsval, tsecr  data and ack packets with RDP_OPT_TSTAMP: 4 bytes big endian each
+//   payload       data and accept packets: the rest of the datagram, its
+//                 length is their metadata, which is not sent. Connect packets
+//                 with RDP_OPT_RANGE: group, stride and end as varints
+//   checksum      CRC32C over all bytes before it, 4 bytes big endian
+// An ACK is 7 bytes on the wire, 9 with the receive window of RDP_OPT_WINDOW,
+// and a data packet 7 bytes plus its payload
+#define RDP_WIRE_VERSION 1
+#define RDP_HDR_PKTSEQ  0x01
+#define RDP_HDR_ACKSEQ  0x02
+#define RDP_HDR_OPTIONS 0x04
+#define RDP_HDR_SENDER  0x08
+#define RDP_HDR_RECV    0x10
+#define RDP_HDR_META    0x20
+
+#define RDP_VARINT_MAX 10
+#define RDP_COOKIE_SIZE 8
+#define RDP_TSTAMP_SIZE 8
+#define RDP_CHECKSUM_SIZE 4
+#define RDP_MAX_HEADER (5 + 3 * RDP_VARINT_MAX + RDP_COOKIE_SIZE + RDP_TSTAMP_SIZE)
+#define RDP_MIN_PACKET (2 + RDP_CHECKSUM_SIZE)
+
+// Packet as used in memory, all values in host byte order. tsval is when the
+// packet was sent, tsecr the tsval of the last packet from the peer moved on
+// by the time it waited there, both in microseconds, 0 if not known
 struct rdp_packet{
   unsigned char flag;
   unsigned char pktseq;
   unsigned char ackseq;
   unsigned char unnassigned;
-  int senderid;
-  int recvid;
-  int metadata;
+  uint64_t senderid;
+  uint64_t recvid;
+  int64_t metadata;
+  unsigned int checksum;
+  uint64_t cookie;
+  uint32_t tsval;
+  uint32_t tsecr;
   char payload[0];
-} __attribute__((packed));
+};
+
+// Part of the file a connection asks for. Metadata of the connect packet holds
+// the first chunk, after it every stride-th chunk is sent up to end, 0 for the
+// end of the file. Connections from the same address with the same group id
+// are parts of one download, group 0 means the connection is on its own
+struct rdp_range {
+  int group;
+  int stride;
+  int64_t end;
+};
+
+
+// Datagrams read with one recvmmsg call
+#define RDP_RECV_BATCH 32
+
+// Room for the largest packet, longer datagrams are cut and fail validation
+#define RDP_DATAGRAM_MAX 2048
+
+// Room for the SO_RXQ_OVFL counter and SO_TIMESTAMPNS time the kernel puts
+// with each datagram, a multiple of 8 so every control buffer is aligned for
+// struct cmsghdr
+#define RDP_BATCH_CONTROL 64
+
+// Packets read by rdp_batch_recv. valid is set for every packet whose length,
+// flag and header fields fit its packet type, next is the first packet not yet
+// handed out by rdp_batch_next. With SO_RXQ_OVFL on, drop_counter is the last
+// count of datagrams the kernel dropped because the receive queue was full,
+// and dropped how many of them have been seen since the batch was made.
+// stamp is when each datagram came in, from the kernel with SO_TIMESTAMPNS
+// on, and last_stamp that of the packet last handed out
+struct rdp_batch {
+  int count;
+  int next;
+  uint32_t drop_counter;
+  uint64_t dropped;
+  uint32_t last_stamp;
+  uint32_t stamp[RDP_RECV_BATCH];
+  unsigned int len[RDP_RECV_BATCH];
+  unsigned char valid[RDP_RECV_BATCH];
+  struct sockaddr_in addr[RDP_RECV_BATCH];
+  char control[RDP_RECV_BATCH][RDP_BATCH_CONTROL] __attribute__((aligned(8)));
+  char buf[RDP_RECV_BATCH][RDP_DATAGRAM_MAX];
+};
 
 
-char get_pktseq(int retry);
-
 int get_random_number();
 
-int check_bits_flag(void *flag, int size);
+int rdp_payload_size(unsigned char flag, unsigned char options, int64_t metadata);
+
+int rdp_has_cookie(unsigned char flag, unsigned char options);
+
+int rdp_has_tstamp(unsigned char flag, unsigned char options);
+
+int rdp_packet_type(unsigned char flag);
+
+int rdp_header_valid(const char *d, unsigned int size);
+
+void rdp_validate_batch(struct rdp_batch *b);
+
+int rdp_batch_recv(struct rdp_batch *b, int fd);
+
+struct rdp_packet *rdp_batch_next(struct rdp_batch *b, struct sockaddr_in *addr);
+
+int rdp_enable_timestamps(int fd);
+
+uint32_t rdp_tstamp_now();
 
 void print_rdp_packet(struct rdp_packet *pkt);
 
@@ -36,13 +152,15 @@ char *get_packet(struct rdp_packet *pkt, unsigned int *size);
 
 struct rdp_packet* open_rdp_packet(char *d, unsigned int size);
 
+int verify_rdp_packet(char *d, unsigned int size);
+
 struct rdp_packet *make_rdp_packet(unsigned char flag,
                                    unsigned char pktseq,
                                    unsigned char ackseq,
                                    unsigned char unnassigned,
-                                   int senderid,
-                                   int recvid,
-                                   int metadata,
+                                   uint64_t senderid,
+                                   uint64_t recvid,
+                                   int64_t metadata,
                                    char *payload);
 
 
@@ -0,0 +1,144 @@
+#include "common.h"
+
+/*****************************************************************************
+-------------------------------- SCHEDULER -----------------------------------
+******************************************************************************
+
+  Transmit scheduler for the server. Connections are put in priority classes,
+  and a class is only served when no connection in a class before it can send.
+  Within a class, connections share the link by deficit round robin: every
+  round a connection that can send gets a quantum of BUFSIZE bytes times its
+  weight added to its deficit, and sends chunks as long as the deficit is
+  positive. The last chunk may overdraw the deficit, which is paid back the
+  next round. A connection whose window is closed, or that has nothing left
+  to send, loses its deficit, so it can not save up for a burst later.
+  Connections held back by a rate limit (ratelimit.c) are skipped the same way.
+
+  Clients are classified by address with rules like 10.0.0.0/8=0,4 given to
+  the server, the first matching rule decides class and weight.
+
+******************************************************************************/
+
+/**
+ * Set up a scheduler without rules, every connection gets the default class
+ */
+void scheduler_init(struct scheduler *sched) {
+    memset(sched, 0, sizeof(struct scheduler));
+}
+
+
+
+/**
+ * Add a classification rule
+ * @param spec: rule as <ip>[/<bits>]=<class>[,<weight>], e.g. 127.0.0.1=0,4
+ * Returns 0 on success, -1 if the rule could not be parsed
+ */
+int scheduler_add_rule(struct scheduler *sched, const char *spec) {
+    int bits;
+    int priority;
+    int weight = SCHED_DEFAULT_WEIGHT;
+    uint32_t addr;
+    uint32_t mask;
+    const char *eq;
+
+    if(sched -> rule_count == SCHED_MAX_RULES) {
+        fprintf(stderr, "Too many scheduler rules, max is %d\n", SCHED_MAX_RULES);
+        return -1;
+    }
+
+    if(parse_prefix(spec, &addr, &mask, &bits, &eq) == -1) {
+        return -1;
+    }
+
+    /* Class and optional weight */
+    int fields = sscanf(eq + 1, "%d,%d", &priority, &weight);
+    if(fields < 1 || priority < 0 || priority >= SCHED_CLASSES || weight < 1) {
+        return -1;
+    }
+
+    struct sched_rule *rule = &sched -> rules[sched -> rule_count++];
+    rule -> mask = mask;
+    rule -> addr = addr;
+    rule -> priority = priority;
+    rule -> weight = weight;
+    return 0;
+}
+
+
+
+/**
+ * Set priority class and weight of a new connection from the rules
+ * @param cnt: connection to classify
+ */
+void scheduler_classify(struct scheduler *sched, struct connection *cnt) {
+    struct sockaddr_in addr = cnt -> client_addr;
+
+    cnt -> priority = SCHED_DEFAULT_CLASS;
+    cnt -> weight = SCHED_DEFAULT_WEIGHT;
+    cnt -> deficit = 0;
+
+    for(int i = 0; i < sched -> rule_count; i++) {
+        struct sched_rule *rule = &sched -> rules[i];
+        if((addr.sin_addr.s_addr & rule -> mask) == rule -> addr) {
+            cnt -> priority = rule -> priority;
+            cnt -> weight = rule -> weight;
+            return;
+        }
+    }
+}
+
+
+
+/**
+ * Serve one deficit round robin round of the first class that can send
+ * @param limits: rate limits the connections are held to
+ * @param list: connections, NULL entries are skipped
+ * @param n: length of list
+ * @param can_send: tells if a connection has a chunk to send now
+ * @param send_next: sends the next chunk of a connection, returns bytes sent
+ * @param arg: passed on to the callbacks
+ * Returns number of chunks sent
+ */
+int scheduler_round(struct scheduler *sched, struct rate_limits *limits, struct connection **list, int n, sched_can_send can_send, sched_send_next send_next, void *arg) {
+    if(n == 0) {
+        return 0;
+    }
+
+    long long now = rdp_now();
+
+    for(int class = 0; class < SCHED_CLASSES; class++) {
+        int sent = 0;
+        int start = sched -> next_start[class] % n;
+
+        for(int k = 0; k < n; k++) {
+            struct connection *cnt = list[(start + k) % n];
+            if(cnt == NULL || cnt -> priority != class) {
+                continue;
+            }
+
+            /* Closed window, nothing to send or over its rate, no credit is kept */
+            if(!can_send(cnt, arg) || !ratelimit_allow(limits, cnt, now)) {
+                cnt -> deficit = 0;
+                continue;
+            }
+
+            cnt -> deficit += BUFSIZE * cnt -> weight;
+            while(cnt -> deficit > 0 && can_send(cnt, arg) && ratelimit_allow(limits, cnt, now)) {
+                int bytes = send_next(cnt, arg);
+                cnt -> deficit -= bytes;
+                ratelimit_charge(limits, cnt, bytes);
+                sent++;
+            }
+            if(!can_send(cnt, arg) && cnt -> deficit > 0) {
+                cnt -> deficit = 0;
+            }
+        }
+
+        /* Lower classes only get what this class could not use */
+        if(sent > 0) {
+            sched -> next_start[class] = start + 1;
+            return sent;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "rdp.h"
+
+// Number of priority classes, class 0 is served first
+#define SCHED_CLASSES 3
+
+// Class and weight of connections no rule matches
+#define SCHED_DEFAULT_CLASS 1
+#define SCHED_DEFAULT_WEIGHT 1
+
+// Max number of classification rules given with -P
+#define SCHED_MAX_RULES 32
+
+
+// Callbacks used by scheduler_round
+// can_send returns 1 if the connection has a chunk to send and room in its window
+// send_next sends that chunk and returns the number of bytes sent
+typedef int (*sched_can_send)(struct connection *cnt, void *arg);
+typedef int (*sched_send_next)(struct connection *cnt, void *arg);
+
+
+struct sched_rule {
+  uint32_t addr;
+  uint32_t mask;
+  int priority;
+  int weight;
+};
+
+// Rules and round robin position of one RDP endpoint
+struct scheduler {
+  struct sched_rule rules[SCHED_MAX_RULES];
+  int rule_count;
+
+  // Where the next round of each class starts, so no connection is always first
+  int next_start[SCHED_CLASSES];
+};
+
+
+void scheduler_init(struct scheduler *sched);
+
+int scheduler_add_rule(struct scheduler *sched, const char *spec);
+
+void scheduler_classify(struct scheduler *sched, struct connection *cnt);
+
+int scheduler_round(struct scheduler *sched, struct rate_limits *limits, struct connection **list, int n, sched_can_send can_send, sched_send_next send_next, void *arg);
+
+
+#endif
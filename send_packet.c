@@ -30,13 +30,29 @@ void set_loss_probability( float x )
  * function. However, it drops some of the packets that are intended for
  * sending randomly. */
 ssize_t send_packet( int sock, const char* buffer, size_t size, int flags, const struct sockaddr* addr, socklen_t addrlen )
+{
+    return send_packet_report( sock, buffer, size, flags, addr, addrlen, NULL );
+}
+
+/* Same as send_packet, and sets *dropped to 1 if the packet was dropped
+ * instead of sent, 0 otherwise. The caller owns the flag, so sockets used
+ * on different threads do not share it. */
+ssize_t send_packet_report( int sock, const char* buffer, size_t size, int flags, const struct sockaddr* addr, socklen_t addrlen, int* dropped )
 {
     float rnd = drand48();
 
+    if( dropped != NULL )
+    {
+        *dropped = 0;
+    }
     if( (buffer[0] & (0x4|0x8)) && /* We drop only data and ACK packets */
 	    (rnd < loss_probability) )
     {
         fprintf(stderr, "Randomly dropping a packet\n");
+        if( dropped != NULL )
+        {
+            *dropped = 1;
+        }
         return size;
     }
 
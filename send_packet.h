@@ -24,4 +24,10 @@ void set_loss_probability( float x );
  */
 ssize_t send_packet( int sock, const char* buffer, size_t size, int flags, const struct sockaddr* addr, socklen_t addrlen );
 
+/* Same as send_packet, and tells the caller in *dropped whether the packet
+ * was dropped instead of sent. Used by callers that hand the buffer to the
+ * kernel, like MSG_ZEROCOPY, and must know that it was never sent.
+ */
+ssize_t send_packet_report( int sock, const char* buffer, size_t size, int flags, const struct sockaddr* addr, socklen_t addrlen, int* dropped );
+
 #endif /* SEND_PACKET_H */
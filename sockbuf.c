@@ -0,0 +1,118 @@
+#include "common.h"
+
+#include <sys/socket.h>
+
+/*****************************************************************************
+-------------------------------- SOCKET BUFFERS ------------------------------
+******************************************************************************
+
+  Send and receive buffers sized for what a socket has in flight. RDP is
+  window limited, so a connection never has more than its window of data
+  packets, and of acks for them, on the way at once. That window is its
+  bandwidth-delay product, and the buffers of a socket need room for the
+  windows of all its connections. Too small a send buffer makes sendmsg fail
+  with a full window still to send, too small a receive buffer makes the
+  kernel drop datagrams before they are read, which looks like path loss.
+
+  SO_RXQ_OVFL makes the kernel send the number of datagrams it has dropped
+  on the socket with every datagram, see rdp_batch_recv. Every time that
+  number grows the receive buffer is doubled on top of what the windows
+  need, up to SOCKBUF_BOOST_MAX times. Sizes are rounded up to a power of
+  two, so the buffers are only set again when the windows change a lot.
+  The kernel caps sizes at net.core.wmem_max and rmem_max unless the process
+  may go past them with SO_SNDBUFFORCE and SO_RCVBUFFORCE.
+
+******************************************************************************/
+
+/**
+ * Set up buffer state for a socket, nothing is set until sockbuf_enable
+ */
+void sockbuf_init(struct sockbuf *sb) {
+    memset(sb, 0, sizeof(struct sockbuf));
+}
+
+
+
+/**
+ * Ask for a buffer size and read back what the kernel gave
+ * @param opt: SO_SNDBUF or SO_RCVBUF
+ * @param force: SO_SNDBUFFORCE or SO_RCVBUFFORCE, used first
+ * @param bytes: size to ask for
+ * Returns size of buffer, which the kernel doubles for its bookkeeping
+ */
+static int sockbuf_set(int fd, int opt, int force, int bytes) {
+    if(setsockopt(fd, SOL_SOCKET, force, &bytes, sizeof(bytes)) == -1) {
+        setsockopt(fd, SOL_SOCKET, opt, &bytes, sizeof(bytes));
+    }
+
+    int size = 0;
+    socklen_t len = sizeof(size);
+    getsockopt(fd, SOL_SOCKET, opt, &size, &len);
+    return size;
+}
+
+
+
+/**
+ * Round a buffer size up to a power of two within SOCKBUF_MIN and SOCKBUF_MAX
+ */
+static int sockbuf_round(long long bytes) {
+    int size = SOCKBUF_MIN;
+    while(size < bytes && size < SOCKBUF_MAX) {
+        size *= 2;
+    }
+    return size;
+}
+
+
+
+/**
+ * Turn on drop counting for a socket and give it the smallest buffers
+ * @param fd: socket to tune
+ * Returns -1 if the kernel does not count drops, the buffers are sized anyway
+ */
+int sockbuf_enable(struct sockbuf *sb, int fd) {
+    int one = 1;
+    int rc = setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    if(rc == -1) {
+        perror("setsockopt: SO_RXQ_OVFL");
+    }
+    sockbuf_tune(sb, fd, 0, 0);
+    return rc;
+}
+
+
+
+/**
+ * Size the buffers of a socket for the packets it has in flight
+ * @param fd: socket to tune
+ * @param packets: sum of the windows of the connections on the socket
+ * @param drops: datagrams dropped by the receive queue so far, from rdp_batch
+ * Returns 1 if the receive buffer was made larger because of new drops, otherwise 0
+ */
+int sockbuf_tune(struct sockbuf *sb, int fd, int packets, uint64_t drops) {
+    int grew = 0;
+    if(drops > sb -> drops) {
+        sb -> drops = drops;
+        if(sb -> boost < SOCKBUF_BOOST_MAX) {
+            sb -> boost++;
+            grew = 1;
+        }
+    }
+
+    long long bytes = (long long) packets * SOCKBUF_PER_PACKET;
+    int want_snd = sockbuf_round(bytes);
+    int want_rcv = sockbuf_round((long long) want_snd << sb -> boost);
+
+    if(want_snd != sb -> want_snd) {
+        sb -> want_snd = want_snd;
+        sb -> sndbuf = sockbuf_set(fd, SO_SNDBUF, SO_SNDBUFFORCE, want_snd);
+    }
+    if(want_rcv != sb -> want_rcv) {
+        sb -> want_rcv = want_rcv;
+        sb -> rcvbuf = sockbuf_set(fd, SO_RCVBUF, SO_RCVBUFFORCE, want_rcv);
+    }
+    return grew;
+}
+
+/****************************************************************************/
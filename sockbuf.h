@@ -0,0 +1,40 @@
+#ifndef SOCKBUF_H
+#define SOCKBUF_H
+
+#include <stdint.h>
+
+// Socket buffers are kept between these sizes in bytes. The smallest is the
+// default of most kernels, the largest holds a full window for hundreds of peers
+#define SOCKBUF_MIN (256 * 1024)
+#define SOCKBUF_MAX (16 * 1024 * 1024)
+
+// Buffer space a datagram of up to RDP_DATAGRAM_MAX bytes is charged for,
+// the kernel counts its own bookkeeping for the packet as well
+#define SOCKBUF_PER_PACKET 4096
+
+// Max number of times the receive buffer is doubled after queue overflows
+#define SOCKBUF_BOOST_MAX 4
+
+
+// Buffer sizes of one socket. want_snd and want_rcv are the sizes last asked
+// for, sndbuf and rcvbuf what the kernel gave. drops is the number of
+// datagrams the receive queue has dropped, boost how many times that made
+// the receive buffer double
+struct sockbuf {
+  int want_snd;
+  int want_rcv;
+  int sndbuf;
+  int rcvbuf;
+  int boost;
+  uint64_t drops;
+};
+
+
+void sockbuf_init(struct sockbuf *sb);
+
+int sockbuf_enable(struct sockbuf *sb, int fd);
+
+int sockbuf_tune(struct sockbuf *sb, int fd, int packets, uint64_t drops);
+
+
+#endif
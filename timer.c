@@ -0,0 +1,225 @@
+#include "common.h"
+
+/*****************************************************************************
+---------------------------------- TIMERS ------------------------------------
+******************************************************************************
+
+  Hierarchical timing wheel, one tick per ms. A timer is put in the lowest
+  level whose range reaches the time it is due: level 0 has a slot for each
+  of the next ticks, level 1 a slot for each block of 64 ticks, and so on.
+  Arming and cancelling is linking into or out of a slot list. When the
+  wheel moves into a new block, the slot of that block one level up is
+  emptied and its timers are put into the lower level again, so every timer
+  is moved at most once per level before it fires. Bitmaps of occupied
+  slots let the wheel skip empty ticks and tell when it next has work.
+
+******************************************************************************/
+
+/**
+ * Set up an empty wheel
+ * @param now: current tick
+ */
+void timer_wheel_init(struct timer_wheel *w, long long now) {
+    memset(w, 0, sizeof(struct timer_wheel));
+    w -> now = now;
+}
+
+
+
+/**
+ * Set up a timer that is not armed
+ * @param data: owner of timer, given back to the expiry callback through t -> data
+ */
+void timer_init(struct timer *t, void *data) {
+    t -> next = NULL;
+    t -> pprev = NULL;
+    t -> expires = 0;
+    t -> data = data;
+}
+
+
+
+/**
+ * Check if a timer is armed
+ */
+int timer_armed(struct timer *t) {
+    return t -> pprev != NULL;
+}
+
+
+
+/**
+ * Link a timer into the slot for its expiry time
+ * A timer already due goes into the slot of the current tick
+ */
+static void timer_place(struct timer_wheel *w, struct timer *t) {
+    long long expires = t -> expires > w -> now ? t -> expires : w -> now;
+    int level = 0;
+
+    /* Beyond the top level, wait for the last tick the top level reaches */
+    if(((expires ^ w -> now) >> (TIMER_SLOT_BITS * TIMER_LEVELS)) != 0) {
+        expires = w -> now | ((1LL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1);
+    }
+
+    /* Lowest level where expires and now are in the same block */
+    while(level < TIMER_LEVELS - 1 && ((expires ^ w -> now) >> (TIMER_SLOT_BITS * (level + 1))) != 0) {
+        level++;
+    }
+
+    int slot = (expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+    struct timer **head = &w -> slots[level][slot];
+
+    t -> level = level;
+    t -> slot = slot;
+    t -> next = *head;
+    if(*head != NULL) {
+        (*head) -> pprev = &t -> next;
+    }
+    t -> pprev = head;
+    *head = t;
+    w -> occupied[level] |= 1ULL << slot;
+}
+
+
+
+/**
+ * Unlink a timer from its slot
+ */
+static void timer_unlink(struct timer_wheel *w, struct timer *t) {
+    *t -> pprev = t -> next;
+    if(t -> next != NULL) {
+        t -> next -> pprev = t -> pprev;
+    }
+    if(w -> slots[t -> level][t -> slot] == NULL) {
+        w -> occupied[t -> level] &= ~(1ULL << t -> slot);
+    }
+    t -> next = NULL;
+    t -> pprev = NULL;
+}
+
+
+
+/**
+ * Arm a timer, or move it if it is armed already
+ * @param t: timer to arm
+ * @param expires: tick the timer is due, a tick already passed fires it on the next expiry
+ */
+void timer_arm(struct timer_wheel *w, struct timer *t, long long expires) {
+    if(timer_armed(t)) {
+        timer_unlink(w, t);
+    }
+    t -> expires = expires;
+    timer_place(w, t);
+}
+
+
+
+/**
+ * Cancel a timer, nothing happens if it is not armed
+ */
+void timer_cancel(struct timer_wheel *w, struct timer *t) {
+    if(timer_armed(t)) {
+        timer_unlink(w, t);
+    }
+}
+
+
+
+/**
+ * Put the timers of a slot into the levels below it again
+ */
+static void timer_cascade(struct timer_wheel *w, int level, int slot) {
+    struct timer *t;
+    while((t = w -> slots[level][slot]) != NULL) {
+        timer_unlink(w, t);
+        timer_place(w, t);
+    }
+}
+
+
+
+/**
+ * Earliest tick the wheel may have a timer to fire
+ * Exact for timers in level 0, for later ones it is the start of their block
+ * Returns the tick, or -1 if no timer is armed
+ */
+long long timer_wheel_next(struct timer_wheel *w) {
+
+    /* The wheel stopped at the start of a block it has not brought down yet */
+    for(int level = 1; level < TIMER_LEVELS; level++) {
+        if(w -> occupied[level] & (1ULL << ((w -> now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)))) {
+            return w -> now;
+        }
+    }
+
+    for(int level = 0; level < TIMER_LEVELS; level++) {
+        int shift = TIMER_SLOT_BITS * level;
+        int current = (w -> now >> shift) & (TIMER_SLOTS - 1);
+        uint64_t ahead = w -> occupied[level] >> current;
+        if(ahead != 0) {
+            long long block = (w -> now >> (shift + TIMER_SLOT_BITS)) << (shift + TIMER_SLOT_BITS);
+            long long due = block + ((long long) (current + __builtin_ctzll(ahead)) << shift);
+            return due > w -> now ? due : w -> now;
+        }
+    }
+    return -1;
+}
+
+
+
+/**
+ * Fire every timer due up to and including now
+ * Timers are unlinked before fire is called, so fire may arm them again or
+ * arm and cancel any other timer
+ * @param now: current tick
+ * @param fire: called for each expired timer
+ * @param arg: passed on to fire
+ * Returns number of timers fired
+ */
+int timer_wheel_expire(struct timer_wheel *w, long long now, timer_cb fire, void *arg) {
+    int fired = 0;
+
+    while(w -> now <= now) {
+        long long tick = w -> now;
+        int slot = tick & (TIMER_SLOTS - 1);
+
+        /* Nothing armed, jump straight to now */
+        int empty = 1;
+        for(int level = 0; level < TIMER_LEVELS; level++) {
+            empty &= w -> occupied[level] == 0;
+        }
+        if(empty) {
+            w -> now = now + 1;
+            break;
+        }
+
+        /* New block: bring timers down from the levels above, highest first */
+        if(slot == 0) {
+            for(int level = TIMER_LEVELS - 1; level > 0; level--) {
+                if((tick & ((1LL << (TIMER_SLOT_BITS * level)) - 1)) == 0) {
+                    timer_cascade(w, level, (tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1));
+                }
+            }
+        }
+
+        /* Timers armed again while firing go to later ticks */
+        w -> now = tick + 1;
+        struct timer *t;
+        while((t = w -> slots[0][slot]) != NULL) {
+            timer_unlink(w, t);
+            fire(t, arg);
+            fired++;
+        }
+
+        /* Skip empty ticks up to the end of the block */
+        int next = w -> now & (TIMER_SLOTS - 1);
+        if(next != 0 && w -> now <= now) {
+            uint64_t ahead = w -> occupied[0] >> next;
+            long long skip_to = ahead != 0 ? w -> now + __builtin_ctzll(ahead) : (w -> now | (TIMER_SLOTS - 1)) + 1;
+            w -> now = skip_to < now + 1 ? skip_to : now + 1;
+        }
+    }
+    return fired;
+}
+
+/****************************************************************************/
@@ -0,0 +1,51 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Levels of the wheel and slots per level, ticks are ms. Level l holds
+// timers due within 64^(l+1) ticks, so four levels reach 4.6 hours ahead.
+// Timers due later than that fire early and are armed again by their owner
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+
+// A timer, embedded in what it times. data points back to the owner.
+// pprev points at the pointer to the timer in its slot, NULL when not armed
+struct timer {
+  struct timer *next;
+  struct timer **pprev;
+  long long expires;
+  unsigned char level;
+  unsigned char slot;
+  void *data;
+};
+
+// Hierarchical timing wheel. Every timer due before now has fired, occupied
+// has a bit set for every slot that holds timers
+struct timer_wheel {
+  long long now;
+  uint64_t occupied[TIMER_LEVELS];
+  struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+
+typedef void (*timer_cb)(struct timer *t, void *arg);
+
+void timer_wheel_init(struct timer_wheel *w, long long now);
+
+void timer_init(struct timer *t, void *data);
+
+int timer_armed(struct timer *t);
+
+void timer_arm(struct timer_wheel *w, struct timer *t, long long expires);
+
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+long long timer_wheel_next(struct timer_wheel *w);
+
+int timer_wheel_expire(struct timer_wheel *w, long long now, timer_cb fire, void *arg);
+
+
+#endif
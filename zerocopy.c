@@ -0,0 +1,217 @@
+#include "common.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+
+/*****************************************************************************
+-------------------------------- ZEROCOPY ------------------------------------
+******************************************************************************
+
+  Optional MSG_ZEROCOPY transmit path for large data packets. The kernel
+  sends straight from the packet buffer instead of copying it, so the buffer
+  must stay untouched until the kernel reports on the socket error queue that
+  it is done with it. Every zerocopy send gets the next number of a per socket
+  counter, and notifications report ranges of these numbers. Sent buffers are
+  kept in a ring indexed by that number and freed when their range completes.
+  The ring lives in a struct zerocopy owned by the RDP endpoint of the socket.
+
+  Packets below the size limit are sent the normal way. If the kernel reports
+  that it had to copy anyway (e.g. over loopback), zerocopy is turned off.
+
+  Zerocopy only pays off for sends of about 10 KB and more, below that
+  pinning the pages costs more than the copy it saves. A data packet is at
+  most BUFSIZE bytes plus its header, so there is no default size limit and
+  the path only runs with a limit the caller picks, e.g. to measure it. What
+  is handed to the kernel is the packet get_packet built, so the copy of the
+  chunk into that packet is still made.
+
+******************************************************************************/
+
+/**
+ * Set up zerocopy state for a socket, zerocopy stays off until zerocopy_enable
+ */
+void zerocopy_init(struct zerocopy *zc) {
+    memset(zc, 0, sizeof(struct zerocopy));
+}
+
+
+
+/**
+ * Turn on zerocopy sending for socket
+ * @param fd: socket used for sending data packets
+ * @param min_size: smallest packet to send with zerocopy, at least 1
+ * Returns -1 if the size is 0 or the kernel does not support SO_ZEROCOPY,
+ * then packets are copied as before
+ */
+int zerocopy_enable(struct zerocopy *zc, int fd, size_t min_size) {
+    int one = 1;
+
+    if(min_size == 0) {
+        return -1;
+    }
+
+    if(setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+        perror("setsockopt: SO_ZEROCOPY");
+        return -1;
+    }
+
+    zc -> enabled = 1;
+    zc -> min_size = min_size;
+    return 0;
+}
+
+
+
+/**
+ * Check if a packet of this size should be sent with zerocopy
+ * @param size: size of packet including header
+ */
+int zerocopy_wanted(struct zerocopy *zc, size_t size) {
+    return zc -> enabled && size >= zc -> min_size;
+}
+
+
+
+/**
+ * Free buffers for a range of completed sends
+ * @param lo: first completed send number
+ * @param hi: last completed send number, may have wrapped around
+ */
+static void zerocopy_complete(struct zerocopy *zc, uint32_t lo, uint32_t hi) {
+    for(uint32_t id = lo; id != hi + 1; id++) {
+        char **slot = &zc -> pending[id % ZEROCOPY_MAX_PENDING];
+        if(*slot != NULL) {
+            free(*slot);
+            *slot = NULL;
+            zc -> inflight--;
+        }
+    }
+}
+
+
+
+/**
+ * Read completion notifications from the socket error queue
+ * Frees every buffer the kernel is done with, never blocks
+ * @param fd: socket used for zerocopy sending
+ * Returns number of notifications read
+ */
+int zerocopy_reap(struct zerocopy *zc, int fd) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    int count = 0;
+
+    while(zc -> inflight > 0) {
+        struct msghdr msg = { 0 };
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            break;
+        }
+
+        for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if(serr -> ee_errno != 0 || serr -> ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            zerocopy_complete(zc, serr -> ee_info, serr -> ee_data);
+            count++;
+
+            /* Kernel copied the data anyway, so zerocopy only adds overhead */
+            if(serr -> ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc -> enabled = 0;
+            }
+        }
+    }
+
+    return count;
+}
+
+
+
+/**
+ * Block until at least one pending buffer is completed
+ * @param fd: socket used for zerocopy sending
+ */
+static void zerocopy_wait(struct zerocopy *zc, int fd) {
+    struct pollfd pfd = { .fd = fd, .events = 0 };
+
+    /* POLLERR is always reported, no need to ask for it */
+    int rc = poll(&pfd, 1, 1000);
+    check_error(rc, "poll");
+    zerocopy_reap(zc, fd);
+}
+
+
+
+/**
+ * Send packet without copying it into the kernel
+ * Takes over the buffer, which must be allocated with malloc, and frees it
+ * when the kernel is done with it
+ * @param fd: socket to send on
+ * @param buffer: converted rdp packet
+ * @param size: size of packet
+ * @param addr: destination address
+ * @param addrlen: size of address
+ */
+ssize_t zerocopy_send(struct zerocopy *zc, int fd, char *buffer, size_t size, const struct sockaddr *addr, socklen_t addrlen) {
+    ssize_t wc;
+    int dropped;
+
+    /* Free what has completed, and make room if every slot is in use */
+    zerocopy_reap(zc, fd);
+    while(zc -> inflight == ZEROCOPY_MAX_PENDING) {
+        zerocopy_wait(zc, fd);
+    }
+
+    wc = send_packet_report(fd, buffer, size, MSG_ZEROCOPY, addr, addrlen, &dropped);
+
+    /* Out of pinned memory, send this one the normal way */
+    if(wc == -1 && errno == ENOBUFS) {
+        wc = send_packet(fd, buffer, size, 0, addr, addrlen);
+        free(buffer);
+        return wc;
+    }
+
+    /* Nothing was handed to the kernel, so no notification will come */
+    if(wc == -1 || dropped) {
+        free(buffer);
+        return wc;
+    }
+
+    zc -> pending[zc -> next % ZEROCOPY_MAX_PENDING] = buffer;
+    zc -> next++;
+    zc -> inflight++;
+    return wc;
+}
+
+
+
+/**
+ * Wait for all pending sends to complete and free their buffers
+ * Gives up after a few seconds and frees the rest, used before closing the socket
+ * @param fd: socket used for zerocopy sending
+ */
+void zerocopy_flush(struct zerocopy *zc, int fd) {
+    for(int tries = 0; zc -> inflight > 0 && tries < 5; tries++) {
+        zerocopy_wait(zc, fd);
+    }
+    zerocopy_release(zc);
+}
+
+
+
+/**
+ * Free pending buffers without waiting, only safe once the socket is closed
+ */
+void zerocopy_release(struct zerocopy *zc) {
+    for(int i = 0; i < ZEROCOPY_MAX_PENDING; i++) {
+        free(zc -> pending[i]);
+        zc -> pending[i] = NULL;
+    }
+    zc -> inflight = 0;
+}
+
+/****************************************************************************/
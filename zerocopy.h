@@ -0,0 +1,37 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Max number of sent buffers waiting for a completion notification
+#define ZEROCOPY_MAX_PENDING 1024
+
+
+// Zerocopy state of one socket
+struct zerocopy {
+  int enabled;
+  size_t min_size;
+  uint32_t next;
+  int inflight;
+  char *pending[ZEROCOPY_MAX_PENDING];
+};
+
+
+void zerocopy_init(struct zerocopy *zc);
+
+int zerocopy_enable(struct zerocopy *zc, int fd, size_t min_size);
+
+int zerocopy_wanted(struct zerocopy *zc, size_t size);
+
+ssize_t zerocopy_send(struct zerocopy *zc, int fd, char *buffer, size_t size, const struct sockaddr *addr, socklen_t addrlen);
+
+int zerocopy_reap(struct zerocopy *zc, int fd);
+
+void zerocopy_flush(struct zerocopy *zc, int fd);
+
+void zerocopy_release(struct zerocopy *zc);
+
+
+#endif